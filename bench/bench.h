@@ -0,0 +1,19 @@
+#ifndef __BRUBECK_BENCH_H__
+#define __BRUBECK_BENCH_H__
+
+#include <time.h>
+
+static inline double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static inline void bench_report(const char *name, size_t ops, double elapsed)
+{
+	printf("%-32s %10.1f Mops/s %8.1f ns/op\n",
+		name, (double)ops / elapsed / 1e6, elapsed * 1e9 / (double)ops);
+}
+
+#endif
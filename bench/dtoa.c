@@ -0,0 +1,44 @@
+#include "brubeck.h"
+#include "bench.h"
+
+#define DTOA_VALUES 4096
+#define DTOA_ROUNDS 1000
+
+static volatile size_t bench_sink;
+
+static void run(const char *name, const double *values, bool use_printf)
+{
+	char buf[BRUBECK_DTOA_SIZE];
+	size_t i, r, total = 0;
+	double start = bench_now();
+
+	for (r = 0; r < DTOA_ROUNDS; ++r) {
+		for (i = 0; i < DTOA_VALUES; ++i) {
+			if (use_printf)
+				total += snprintf(buf, sizeof(buf), "%.17g", values[i]);
+			else
+				total += brubeck_dtoa(buf, values[i]);
+		}
+	}
+
+	bench_report(name, DTOA_VALUES * DTOA_ROUNDS, bench_now() - start);
+	bench_sink = total;
+}
+
+/* What we typically flush: counters, and histogram/timer samples */
+void bench_dtoa(void)
+{
+	static double counters[DTOA_VALUES], timers[DTOA_VALUES];
+	size_t i;
+
+	srand(42);
+	for (i = 0; i < DTOA_VALUES; ++i) {
+		counters[i] = (double)(rand() % 1000000);
+		timers[i] = (double)rand() / (double)(1 + rand() % 1000);
+	}
+
+	run("dtoa: integral values", counters, false);
+	run("snprintf: integral values", counters, true);
+	run("dtoa: fractional values", timers, false);
+	run("snprintf: fractional values", timers, true);
+}
@@ -0,0 +1,142 @@
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#include "brubeck.h"
+#include "bench.h"
+
+#define HMAC_PACKETS 1024
+#define HMAC_ROUNDS 200
+#define HMAC_BATCH 16
+
+static const char *HMAC_KEY = "750c783e6ab0b503eaa86e310a5db738";
+static volatile uint8_t bench_sink;
+
+static uint8_t packets[HMAC_PACKETS][512];
+static const uint8_t *msgs[HMAC_PACKETS];
+static size_t lens[HMAC_PACKETS];
+
+/* What statsd-secure did before: a HMAC context reused for every packet */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static void run_openssl(void)
+{
+	uint8_t out[BRUBECK_SHA256_SIZE];
+	size_t out_len, i, r;
+	double start;
+	EVP_MAC *mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	EVP_MAC_CTX *ctx = EVP_MAC_CTX_new(mac);
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	EVP_MAC_init(ctx, (const unsigned char *)HMAC_KEY, strlen(HMAC_KEY), params);
+	start = bench_now();
+
+	for (r = 0; r < HMAC_ROUNDS; ++r) {
+		for (i = 0; i < HMAC_PACKETS; ++i) {
+			EVP_MAC_init(ctx, NULL, 0, NULL);
+			EVP_MAC_update(ctx, msgs[i], lens[i]);
+			EVP_MAC_final(ctx, out, &out_len, sizeof(out));
+			bench_sink ^= out[0];
+		}
+	}
+
+	bench_report("openssl: per packet", HMAC_PACKETS * HMAC_ROUNDS, bench_now() - start);
+
+	EVP_MAC_CTX_free(ctx);
+	EVP_MAC_free(mac);
+}
+#else
+static void run_openssl(void)
+{
+	uint8_t out[BRUBECK_SHA256_SIZE];
+	unsigned int out_len;
+	size_t i, r;
+	double start;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	HMAC_CTX _ctx, *ctx = &_ctx;
+	HMAC_CTX_init(ctx);
+#else
+	HMAC_CTX *ctx = HMAC_CTX_new();
+#endif
+
+	HMAC_Init_ex(ctx, HMAC_KEY, strlen(HMAC_KEY), EVP_sha256(), NULL);
+	start = bench_now();
+
+	for (r = 0; r < HMAC_ROUNDS; ++r) {
+		for (i = 0; i < HMAC_PACKETS; ++i) {
+			HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+			HMAC_Update(ctx, msgs[i], lens[i]);
+			HMAC_Final(ctx, out, &out_len);
+			bench_sink ^= out[0];
+		}
+	}
+
+	bench_report("openssl: per packet", HMAC_PACKETS * HMAC_ROUNDS, bench_now() - start);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	HMAC_CTX_cleanup(ctx);
+#else
+	HMAC_CTX_free(ctx);
+#endif
+}
+#endif
+
+static void run(const char *impl_name, const struct brubeck_hmac_sha256 *hmac, size_t batch)
+{
+	static uint8_t out[HMAC_BATCH][BRUBECK_SHA256_SIZE];
+	char name[64];
+	size_t i, r;
+	double start = bench_now();
+
+	for (r = 0; r < HMAC_ROUNDS; ++r) {
+		for (i = 0; i < HMAC_PACKETS; i += batch) {
+			if (batch == 1)
+				brubeck_hmac_sha256(hmac, msgs[i], lens[i], out[0]);
+			else
+				brubeck_hmac_sha256_batch(hmac, msgs + i, lens + i, batch, out);
+			bench_sink ^= out[0][0];
+		}
+	}
+
+	if (batch == 1)
+		snprintf(name, sizeof(name), "%s: per packet", impl_name);
+	else
+		snprintf(name, sizeof(name), "%s: batches of %zu", impl_name, batch);
+
+	bench_report(name, HMAC_PACKETS * HMAC_ROUNDS, bench_now() - start);
+}
+
+/* Signed statsd packets: a few metric lines after the hmac and nonce */
+void bench_hmac(void)
+{
+	static const char *names[] = { "scalar", "avx2", "shani" };
+	static const size_t batches[] = { 1, 4, 8, 16 };
+
+	enum brubeck_sha256_impl detected = brubeck_sha256_impl();
+	struct brubeck_hmac_sha256 hmac;
+	size_t i, j;
+	int impl;
+
+	srand(42);
+	for (i = 0; i < HMAC_PACKETS; ++i) {
+		lens[i] = 40 + rand() % 400;
+		for (j = 0; j < lens[i]; ++j)
+			packets[i][j] = (uint8_t)rand();
+		msgs[i] = packets[i];
+	}
+
+	run_openssl();
+
+	for (impl = BRUBECK_SHA256_SCALAR; impl <= BRUBECK_SHA256_SHANI; ++impl) {
+		if (!brubeck_sha256_select(impl))
+			continue;
+
+		brubeck_hmac_sha256_init(&hmac, HMAC_KEY, strlen(HMAC_KEY));
+		for (i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i)
+			run(names[impl], &hmac, batches[i]);
+	}
+
+	brubeck_sha256_select(detected);
+}
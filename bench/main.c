@@ -0,0 +1,11 @@
+#include "brubeck.h"
+
+void bench_dtoa(void);
+void bench_hmac(void);
+
+int main(int argc, char *argv[])
+{
+	bench_dtoa();
+	bench_hmac();
+	return 0;
+}
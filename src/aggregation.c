@@ -0,0 +1,181 @@
+#include "brubeck.h"
+
+/* `*` matches any run of characters; segments never contain dots */
+static int
+segment_match(const char *pat, size_t pat_len, const char *str, size_t str_len)
+{
+	size_t p = 0, s = 0, star = SIZE_MAX, mark = 0;
+
+	while (s < str_len) {
+		if (p < pat_len && pat[p] == '*') {
+			star = ++p;
+			mark = s;
+		} else if (p < pat_len && pat[p] == str[s]) {
+			p++;
+			s++;
+		} else if (star != SIZE_MAX) {
+			p = star;
+			s = ++mark;
+		} else {
+			return 0;
+		}
+	}
+
+	while (p < pat_len && pat[p] == '*')
+		p++;
+
+	return p == pat_len;
+}
+
+static int
+find_capture(const struct brubeck_aggregation_rule *rule, const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < rule->segment_count; ++i) {
+		const struct brubeck_aggregation_segment *seg = &rule->segments[i];
+
+		if (seg->capture && seg->len == len + 2 && !memcmp(seg->text + 1, name, len))
+			return (int)i;
+	}
+
+	return -1;
+}
+
+static void
+compile_rule(struct brubeck_aggregation_rule *rule)
+{
+	const char *p = rule->pattern, *t;
+	size_t i, n = 1;
+
+	for (t = p; *t; ++t) {
+		if (*t == '.')
+			n++;
+	}
+
+	if (!*p || n > BRUBECK_AGGREGATE_MAX_SEGMENTS)
+		die("config error: invalid aggregate pattern '%s'", rule->pattern);
+
+	rule->segments = xcalloc(n, sizeof(struct brubeck_aggregation_segment));
+	rule->segment_count = n;
+
+	for (i = 0; i < n; ++i) {
+		struct brubeck_aggregation_segment *seg = &rule->segments[i];
+		const char *dot = strchr(p, '.');
+
+		if (!dot)
+			dot = p + strlen(p);
+
+		seg->text = p;
+		seg->len = (uint16_t)(dot - p);
+		seg->capture = (seg->len > 2 && p[0] == '<' && p[seg->len - 1] == '>');
+
+		p = dot + 1;
+	}
+
+	/* every capture in the target must come from the pattern */
+	for (t = rule->target; (t = strchr(t, '<')) != NULL; ) {
+		const char *close = strchr(t, '>');
+
+		if (!close || find_capture(rule, t + 1, close - t - 1) < 0)
+			die("config error: unknown capture in aggregate target '%s'", rule->target);
+
+		t = close + 1;
+	}
+}
+
+struct brubeck_aggregation *
+brubeck_aggregation_new(json_t *rules)
+{
+	struct brubeck_aggregation *aggregation;
+	size_t idx;
+	json_t *r;
+
+	if (!json_is_array(rules))
+		die("config error: aggregates must be an array");
+
+	aggregation = xcalloc(1, sizeof(struct brubeck_aggregation) +
+		json_array_size(rules) * sizeof(struct brubeck_aggregation_rule));
+
+	json_array_foreach(rules, idx, r) {
+		struct brubeck_aggregation_rule *rule = &aggregation->rules[idx];
+
+		json_unpack_or_die(r, "{s:s, s:s, s?:b}",
+			"pattern", &rule->pattern,
+			"target", &rule->target,
+			"drop", &rule->drop);
+
+		compile_rule(rule);
+
+		log_splunk("event=load_aggregate pattern=%s target=%s drop=%d",
+			rule->pattern, rule->target, rule->drop);
+	}
+
+	aggregation->count = json_array_size(rules);
+	return aggregation;
+}
+
+/*
+ * Render the aggregate key for `key` into `target` (NUL-terminated).
+ * Returns its length, or 0 when the key doesn't match the rule or the
+ * aggregate key doesn't fit.
+ */
+size_t
+brubeck_aggregation_target(const struct brubeck_aggregation_rule *rule,
+	char *target, size_t size, const char *key, size_t key_len)
+{
+	const char *captured[BRUBECK_AGGREGATE_MAX_SEGMENTS];
+	size_t captured_len[BRUBECK_AGGREGATE_MAX_SEGMENTS];
+	size_t i, pos = 0, len = 0;
+	const char *t;
+
+	for (i = 0; i < rule->segment_count; ++i) {
+		const struct brubeck_aggregation_segment *seg = &rule->segments[i];
+		const char *dot;
+		size_t seg_len;
+
+		/* the key has fewer segments than the pattern */
+		if (pos > key_len)
+			return 0;
+
+		dot = memchr(key + pos, '.', key_len - pos);
+		seg_len = dot ? (size_t)(dot - key - pos) : key_len - pos;
+
+		if (seg->capture) {
+			if (seg_len == 0)
+				return 0;
+		} else if (!segment_match(seg->text, seg->len, key + pos, seg_len)) {
+			return 0;
+		}
+
+		captured[i] = key + pos;
+		captured_len[i] = seg_len;
+		pos += seg_len + 1;
+	}
+
+	/* ...or more */
+	if (pos <= key_len)
+		return 0;
+
+	for (t = rule->target; *t; ) {
+		if (*t == '<') {
+			const char *close = strchr(t, '>');
+			int c = find_capture(rule, t + 1, close - t - 1);
+
+			if (len + captured_len[c] >= size)
+				return 0;
+
+			memcpy(target + len, captured[c], captured_len[c]);
+			len += captured_len[c];
+			t = close + 1;
+		} else {
+			if (len + 1 >= size)
+				return 0;
+
+			target[len++] = *t++;
+		}
+	}
+
+	target[len] = '\0';
+	return len;
+}
@@ -0,0 +1,47 @@
+#ifndef __BRUBECK_AGGREGATION_H__
+#define __BRUBECK_AGGREGATION_H__
+
+/*
+ * Ingest-time aggregation, in the style of carbon-aggregator. Each rule
+ * maps the keys that match its pattern to an aggregate key:
+ *
+ *	{ "pattern": "app.<host>.requests", "target": "app.all.requests" }
+ *
+ * Patterns are matched one dot-separated segment at a time; a `*`
+ * matches any run of characters within a segment and `<name>` captures
+ * a whole segment, which can then be used in the target.
+ *
+ * Rules are only evaluated when a metric is created: the metric keeps
+ * a list of the aggregates it matched, and every record is applied to
+ * both. With `"drop": true` the matching metrics only feed their
+ * aggregates and are never sampled themselves.
+ */
+#define BRUBECK_MAX_AGGREGATES 8
+#define BRUBECK_AGGREGATE_KEY_MAX 1024
+#define BRUBECK_AGGREGATE_MAX_SEGMENTS 64
+
+struct brubeck_aggregation_segment {
+	const char *text;
+	uint16_t len;
+	int capture;
+};
+
+struct brubeck_aggregation_rule {
+	const char *pattern;
+	const char *target;
+	int drop;
+
+	size_t segment_count;
+	struct brubeck_aggregation_segment *segments;
+};
+
+struct brubeck_aggregation {
+	size_t count;
+	struct brubeck_aggregation_rule rules[];
+};
+
+struct brubeck_aggregation *brubeck_aggregation_new(json_t *rules);
+size_t brubeck_aggregation_target(const struct brubeck_aggregation_rule *rule,
+	char *target, size_t size, const char *key, size_t key_len);
+
+#endif
@@ -13,39 +13,84 @@ void brubeck_backend_register_metric(struct brubeck_backend *self, struct brubec
 	}
 }
 
+/*
+ * Sample all the metrics in the backend's queue and flush them out.
+ * Rollups sample the metrics of their parent, which are only ever
+ * prepended to its queue while they walk it.
+ */
+void brubeck_backend_flush(struct brubeck_backend *self)
+{
+	const uint32_t epoch = self->server->expire_epoch;
+	struct brubeck_metric *mt;
+	struct timespec now;
+
+	if (self->connect(self))
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	self->tick_time = now.tv_sec;
+
+	if (self->parent) {
+		for (mt = self->parent->queue; mt; mt = mt->next) {
+			if (brubeck_metric_expire(mt, epoch) > BRUBECK_EXPIRE_DISABLED)
+				brubeck_metric_sample_rollup(mt, self->rollup_n, self->sample, self);
+		}
+	} else {
+		for (mt = self->queue; mt; mt = mt->next) {
+			if (brubeck_metric_expire(mt, epoch) > BRUBECK_EXPIRE_DISABLED) {
+				self->replicas = mt->replicas;
+				brubeck_metric_sample(mt, self->sample, self);
+			}
+		}
+	}
+
+	self->replicas = 0;
+
+	if (self->flush)
+		self->flush(self);
+}
+
 static void *backend__thread(void *_ptr)
 {
 	struct brubeck_backend *self = (struct brubeck_backend *)_ptr;
 
 	for (;;) {
-		struct timespec now, then;
+		struct timespec then;
 
 		clock_gettime(CLOCK_MONOTONIC, &then);
 		then.tv_sec += self->sample_freq;
 
-		if (!self->connect(self)) {
-			struct brubeck_metric *mt;
-
-			clock_gettime(CLOCK_REALTIME, &now);
-			self->tick_time = now.tv_sec;
-
-			for (mt = self->queue; mt; mt = mt->next) {
-				if (mt->expire > BRUBECK_EXPIRE_DISABLED)
-					brubeck_metric_sample(mt, self->sample, self);
-			}
-
-			if (self->flush)
-				self->flush(self);
-		}
+		/* a flush is never interrupted halfway; the thread
+		 * can only be stopped while it sleeps */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		brubeck_backend_flush(self);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
 		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &then, NULL);
 	}
 	return NULL;
 }
 
+/* rollups start and stop with their parent */
 void brubeck_backend_run_threaded(struct brubeck_backend *self)
 {
+	int i;
+
 	if (pthread_create(&self->thread, NULL, &backend__thread, self) != 0)
 		die("failed to start backend thread");
+
+	for (i = 0; i < self->rollup_count; ++i)
+		brubeck_backend_run_threaded(self->rollups[i]);
+}
+
+void brubeck_backend_stop(struct brubeck_backend *self)
+{
+	int i;
+
+	pthread_cancel(self->thread);
+	pthread_join(self->thread, NULL);
+
+	for (i = 0; i < self->rollup_count; ++i)
+		brubeck_backend_stop(self->rollups[i]);
 }
 
@@ -1,6 +1,9 @@
 #ifndef __BRUBECK_BACKEND_H__
 #define __BRUBECK_BACKEND_H__
 
+#define BRUBECK_MAX_BACKENDS 8
+#define BRUBECK_MAX_ROLLUPS 4
+
 enum brubeck_backend_t {
 	BRUBECK_BACKEND_CARBON
 };
@@ -8,21 +11,50 @@ enum brubeck_backend_t {
 struct brubeck_backend {
 	enum brubeck_backend_t type;
 	struct brubeck_server *server;
+	json_t *settings;
 	int sample_freq;
 	int shard_n;
 
+	/* placement in the shard ring */
+	const char *shard_key;
+	int weight;
+
+	/* other shards the metric being sampled is replicated to */
+	uint8_t replicas;
+
 	int (*connect)(void *);
 	bool (*is_connected)(void *);
-	void (*sample)(const char *, value_t, void *);
+	void (*sample)(const char *, size_t, value_t, void *);
 	void (*flush)(void *);
+	bool (*drained)(void *);
+
+	/* config reloads: move to new shard numbers (indexed by
+	 * the old ones, -1 for removed backends), and tear down */
+	void (*renumber)(void *, const int *);
+	void (*shutdown)(void *);
 
 	uint32_t tick_time;
 	pthread_t thread;
 
 	struct brubeck_metric *queue;
+
+	/*
+	 * Coarser resolutions of the same metrics. Every flush of this
+	 * backend folds the values of the interval into the rollup state
+	 * of each metric; the rollups have no queue of their own, and
+	 * sample that state on their own schedule.
+	 */
+	struct brubeck_backend *rollups[BRUBECK_MAX_ROLLUPS];
+	int rollup_count;
+
+	/* for rollups: the backend they roll up, and their index in it */
+	struct brubeck_backend *parent;
+	int rollup_n;
 };
 
 void brubeck_backend_run_threaded(struct brubeck_backend *);
+void brubeck_backend_stop(struct brubeck_backend *);
+void brubeck_backend_flush(struct brubeck_backend *);
 void brubeck_backend_register_metric(struct brubeck_backend *self, struct brubeck_metric *metric);
 
 static inline const char *brubeck_backend_name(struct brubeck_backend *backend)
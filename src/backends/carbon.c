@@ -1,80 +1,529 @@
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
 #include "brubeck.h"
 
 static bool carbon_is_connected(void *backend)
 {
 	struct brubeck_carbon *self = (struct brubeck_carbon *)backend;
-	return (self->out_sock >= 0);
+	return (self->state == CARBON_CONNECTED);
 }
 
+/*
+ * The backend thread never touches the socket; it only needs to
+ * know whether there's any point in sampling for this flush.
+ * Reconnection is handled by the writer thread. When spooling,
+ * flushes are always sampled and captured to disk if needed.
+ */
 static int carbon_connect(void *backend)
 {
 	struct brubeck_carbon *self = (struct brubeck_carbon *)backend;
+	return (self->spool || carbon_is_connected(self)) ? 0 : -1;
+}
 
-	if (carbon_is_connected(self))
-		return 0;
+static uint64_t carbon_now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-	self->out_sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-	if (self->out_sock >= 0) {
-		int rc = connect(self->out_sock,
-				(struct sockaddr *)&self->out_sockaddr,
-				sizeof(self->out_sockaddr));
-		
-		if (rc == 0) {
-			log_splunk("backend=carbon event=connected");
-			sock_enlarge_out(self->out_sock);
-			return 0;
-		}
+/*
+ * Look up the addresses of all the endpoints. This blocks for as long
+ * as the resolver takes, so after startup it only runs on the resolver
+ * thread, never on the writer.
+ */
+static void carbon_lookup(struct brubeck_carbon *self,
+	struct sockaddr_in *addrs, bool *found)
+{
+	size_t i;
+
+	for (i = 0; i < self->endpoint_count; ++i) {
+		struct carbon_endpoint *ep = &self->endpoints[i];
 
-		close(self->out_sock);
-		self->out_sock = -1;
+		found[i] = (url_to_inaddr(&addrs[i], ep->host, ep->port) == 0);
+		if (!found[i])
+			log_splunk("backend=carbon event=failed_to_resolve host=%s", ep->host);
 	}
+}
+
+static void carbon_apply_lookup(struct brubeck_carbon *self,
+	const struct sockaddr_in *addrs, const bool *found)
+{
+	size_t i;
+
+	for (i = 0; i < self->endpoint_count; ++i) {
+		struct carbon_endpoint *ep = &self->endpoints[i];
+
+		if (!found[i])
+			continue;
+
+		/* takes effect on the next connection attempt */
+		if (ep->resolved && memcmp(&ep->addr, &addrs[i], sizeof(addrs[i])) != 0)
+			log_splunk("backend=carbon event=address_changed host=%s", ep->host);
+
+		ep->addr = addrs[i];
+		ep->resolved = true;
+	}
+}
+
+static void *carbon__resolver(void *_ptr)
+{
+	struct brubeck_carbon *self = (struct brubeck_carbon *)_ptr;
+	struct sockaddr_in addrs[CARBON_MAX_ENDPOINTS];
+	bool found[CARBON_MAX_ENDPOINTS];
+	const uint64_t wakeup = 1;
+
+	for (;;) {
+		sleep(self->resolve_interval);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		carbon_lookup(self, addrs, found);
+
+		pthread_mutex_lock(&self->resolver.lock);
+		memcpy(self->resolver.addrs, addrs, sizeof(addrs));
+		memcpy(self->resolver.found, found, sizeof(found));
+		self->resolver.ready = 1;
+		pthread_mutex_unlock(&self->resolver.lock);
+
+		/* the writer swaps the new addresses in when it wakes up */
+		if (write(self->event_fd, &wakeup, sizeof(wakeup)) < 0)
+			log_splunk_errno("backend=carbon event=failed_wakeup");
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	return NULL;
+}
+
+/* Writer side: pick up the latest lookup of the resolver thread */
+static void carbon_resolved(struct brubeck_carbon *self)
+{
+	pthread_mutex_lock(&self->resolver.lock);
+	if (self->resolver.ready) {
+		carbon_apply_lookup(self, self->resolver.addrs, self->resolver.found);
+		self->resolver.ready = 0;
+	}
+	pthread_mutex_unlock(&self->resolver.lock);
+}
+
+static void carbon_socket_events(struct brubeck_carbon *self, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = self->out_sock;
+	epoll_ctl(self->epoll_fd, op, self->out_sock, &ev);
+}
+
+static void carbon_connected(struct brubeck_carbon *self)
+{
+	struct carbon_endpoint *ep = &self->endpoints[self->endpoint];
+
+	log_splunk("backend=carbon event=connected host=%s port=%d", ep->host, ep->port);
+
+	ep->failures = 0;
+	ep->retry_at = 0;
+
+	sock_enlarge_out(self->out_sock);
+
+	/* each connection is a separate compressed stream */
+	if (self->zstream)
+		deflateReset(self->zstream);
+
+	/* carbon never talks back: any readable event on
+	 * the socket means the relay has hung up */
+	carbon_socket_events(self, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP);
+	self->want_write = 0;
+	self->state = CARBON_CONNECTED;
+}
+
+/* Bench an endpoint that failed, with an exponential backoff */
+static void carbon_endpoint_failed(struct carbon_endpoint *ep, uint64_t now)
+{
+	uint32_t shift = ep->failures < 5 ? ep->failures : 5;
+	uint64_t backoff = (uint64_t)CARBON_RECONNECT_MS << shift;
 
-	log_splunk_errno("backend=carbon event=failed_to_connect");
+	if (backoff > CARBON_MAX_BACKOFF_MS)
+		backoff = CARBON_MAX_BACKOFF_MS;
+
+	ep->failures++;
+	ep->retry_at = now + backoff;
+}
+
+static void carbon_connect_failed(struct brubeck_carbon *self, int error, uint64_t now)
+{
+	struct carbon_endpoint *ep = &self->endpoints[self->endpoint];
+
+	carbon_endpoint_failed(ep, now);
+
+	errno = error;
+	log_splunk_errno("backend=carbon event=failed_to_connect host=%s port=%d failures=%u",
+		ep->host, ep->port, ep->failures);
+
+	close(self->out_sock);
+	self->out_sock = -1;
+	self->state = CARBON_DISCONNECTED;
+}
+
+/*
+ * Start a non-blocking connection to the given endpoint. Returns
+ * 0 if the connection is established or in progress.
+ */
+static int carbon_endpoint_connect(struct brubeck_carbon *self, size_t idx, uint64_t now)
+{
+	struct carbon_endpoint *ep = &self->endpoints[idx];
+	int rc;
+
+	self->out_sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (self->out_sock < 0) {
+		log_splunk_errno("backend=carbon event=failed_socket");
+		carbon_endpoint_failed(ep, now);
+		return -1;
+	}
+
+	self->endpoint = idx;
+	self->out_sockaddr = ep->addr;
+	carbon_socket_events(self, EPOLL_CTL_ADD, EPOLLOUT);
+
+	rc = connect(self->out_sock, (struct sockaddr *)&ep->addr, sizeof(ep->addr));
+
+	if (rc == 0) {
+		carbon_connected(self);
+		return 0;
+	}
+
+	if (errno == EINPROGRESS) {
+		self->state = CARBON_CONNECTING;
+		self->connect_deadline = now + self->connect_timeout;
+		return 0;
+	}
+
+	carbon_connect_failed(self, errno, now);
 	return -1;
 }
 
+/*
+ * Connect to the most preferred endpoint that is not benched.
+ */
+static void carbon_writer_connect(struct brubeck_carbon *self, uint64_t now)
+{
+	size_t i;
+
+	for (i = 0; i < self->endpoint_count; ++i) {
+		struct carbon_endpoint *ep = &self->endpoints[i];
+
+		if (!ep->resolved || ep->retry_at > now)
+			continue;
+
+		if (carbon_endpoint_connect(self, i, now) == 0)
+			return;
+	}
+}
+
+/* Complete a connection attempt once the socket turns writable */
+static void carbon_writer_finish_connect(struct brubeck_carbon *self, uint64_t now)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(self->out_sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		error = errno;
+
+	if (error == 0) {
+		carbon_connected(self);
+		return;
+	}
+
+	/* fail over to the next candidate right away */
+	carbon_connect_failed(self, error, now);
+	carbon_writer_connect(self, now);
+}
+
+/* How long the writer can sleep before it needs to try to reconnect */
+static int carbon_reconnect_timeout(struct brubeck_carbon *self, uint64_t now)
+{
+	uint64_t wake = now + (uint64_t)self->resolve_interval * 1000;
+	size_t i;
+
+	if (self->state == CARBON_CONNECTING) {
+		wake = self->connect_deadline;
+	} else {
+		for (i = 0; i < self->endpoint_count; ++i) {
+			struct carbon_endpoint *ep = &self->endpoints[i];
+			if (ep->resolved && ep->retry_at < wake)
+				wake = ep->retry_at;
+		}
+	}
+
+	return (wake > now) ? (int)(wake - now) : 1;
+}
+
 static void carbon_disconnect(struct brubeck_carbon *self)
 {
+	bool partial = (self->pending && self->pending->pos > 0);
+
 	log_splunk_errno("backend=carbon event=disconnected");
 
 	close(self->out_sock);
 	self->out_sock = -1;
+	self->state = CARBON_DISCONNECTED;
+
+	/* a half-written chunk cannot be resumed on a new
+	 * connection without corrupting the stream; an unsent
+	 * compressed chunk is compressed again for the new stream */
+	if (self->deflated) {
+		partial = (self->deflated->pos > 0);
+		free(self->deflated);
+		self->deflated = NULL;
+	}
+
+	if (partial) {
+		free(self->pending);
+		self->pending = NULL;
+		brubeck_atomic_inc(&self->dropped);
+	}
 }
 
-static void plaintext_each(
-	const char *key,
-	value_t value,
-	void *backend)
+static void carbon_want_write(struct brubeck_carbon *self, int want)
 {
-	struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
-	char buffer[1024];
-	char *ptr = buffer;
-	size_t key_len = strlen(key);
-	ssize_t wr;
-
-	if (!carbon_is_connected(carbon))
+	if (self->want_write == want)
 		return;
 
-	memcpy(ptr, key, key_len);
-	ptr += key_len;
-	*ptr++ = ' ';
+	carbon_socket_events(self, EPOLL_CTL_MOD,
+		EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0));
+	self->want_write = want;
+}
 
-	ptr += brubeck_ftoa(ptr, value);
-	*ptr++ = ' ';
+/*
+ * Pull the oldest spooled chunk for replay, as long as the replay
+ * rate allows it. Returns 0 when a chunk has been made pending, or
+ * the number of milliseconds to wait before trying again (-1 when
+ * there's nothing to replay).
+ */
+static int carbon_writer_replay(struct brubeck_carbon *self)
+{
+	struct carbon_chunk *chunk;
+	struct timespec now;
+	double elapsed, need;
+	uint32_t len;
 
-	ptr += brubeck_itoa(ptr, carbon->backend.tick_time);
-	*ptr++ = '\n';
+	if (!self->spool || brubeck_spool_empty(self->spool))
+		return -1;
 
-	wr = write_in_full(carbon->out_sock, buffer, ptr - buffer);
-	if (wr < 0) {
-		carbon_disconnect(carbon);
-		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (double)(now.tv_sec - self->replay.last.tv_sec) +
+		(double)(now.tv_nsec - self->replay.last.tv_nsec) / 1e9;
+	self->replay.last = now;
+
+	/* token bucket, allowing bursts of up to one second of replay */
+	self->replay.tokens += elapsed * self->replay.rate;
+	if (self->replay.tokens > self->replay.rate)
+		self->replay.tokens = self->replay.rate;
+
+	len = brubeck_spool_peek(self->spool, NULL, 0);
+	need = (len < self->replay.rate) ? (double)len : self->replay.rate;
+
+	if (self->replay.tokens < need)
+		return 1 + (int)((need - self->replay.tokens) * 1000.0 / self->replay.rate);
+
+	chunk = xmalloc(sizeof(struct carbon_chunk) + len);
+	chunk->len = brubeck_spool_peek(self->spool, chunk->data, len);
+	chunk->pos = 0;
+	brubeck_spool_pop(self->spool);
+
+	self->replay.tokens -= len;
+	self->replayed++;
+	self->pending = chunk;
+	return 0;
+}
+
+/*
+ * Compress a whole chunk into the connection's stream. The stream
+ * is sync-flushed after every chunk, so the relay can decode all
+ * the metrics we've sent so far without waiting for more data.
+ */
+static struct carbon_chunk *carbon_deflate(struct brubeck_carbon *self, struct carbon_chunk *chunk)
+{
+	z_stream *z = self->zstream;
+	size_t cap = deflateBound(z, chunk->len) + 64;
+	struct carbon_chunk *out = xmalloc(sizeof(struct carbon_chunk) + cap);
+
+	z->next_in = (Bytef *)chunk->data;
+	z->avail_in = chunk->len;
+	z->next_out = (Bytef *)out->data;
+	z->avail_out = cap;
+
+	while (deflate(z, Z_SYNC_FLUSH) == Z_OK && z->avail_out == 0) {
+		size_t used = cap;
+
+		cap *= 2;
+		out = realloc(out, sizeof(struct carbon_chunk) + cap);
+		if (!out)
+			die("failed to grow compression buffer");
+
+		z->next_out = (Bytef *)out->data + used;
+		z->avail_out = cap - used;
+	}
+
+	out->len = cap - z->avail_out;
+	out->pos = 0;
+
+	self->raw_bytes += chunk->len;
+	self->compressed_bytes += out->len;
+	return out;
+}
+
+static bool carbon_writer_dequeue(struct brubeck_carbon *self, struct carbon_chunk **chunk)
+{
+	size_t i;
+
+	for (i = 0; i < BRUBECK_MAX_BACKENDS; ++i) {
+		struct carbon_sink *sink = self->inbound[i];
+
+		if (sink && ck_ring_dequeue_spsc(&sink->ring, sink->buffer, chunk))
+			return true;
 	}
 
-	carbon->sent += wr;
+	return false;
+}
+
+/*
+ * Write as many queued chunks as the socket will take without
+ * blocking. When the kernel buffer fills up, we wait for EPOLLOUT.
+ * While disconnected, queued chunks go to the spool (if any).
+ *
+ * Returns the timeout for the next epoll wait.
+ */
+static int carbon_writer_drain(struct brubeck_carbon *self)
+{
+	int timeout = -1;
+
+	/* hold on to the queue until we know how the connection goes */
+	if (self->state == CARBON_CONNECTING)
+		return -1;
+
+	for (;;) {
+		struct carbon_chunk *chunk = self->pending, *out;
+		ssize_t wr;
+
+		if (!chunk) {
+			/* dequeued straight into `pending`, so that the
+			 * chunk is never out of sight of carbon_drained */
+			if (carbon_writer_dequeue(self, &self->pending))
+				chunk = self->pending;
+			else if (carbon_is_connected(self) &&
+					(timeout = carbon_writer_replay(self)) == 0)
+				chunk = self->pending;
+			else
+				break;
+		}
+
+		if (!carbon_is_connected(self)) {
+			if (self->spool && chunk->pos == 0 &&
+				brubeck_spool_append(self->spool, chunk->data, chunk->len)) {
+				self->spooled++;
+			} else {
+				brubeck_atomic_inc(&self->dropped);
+			}
+
+			free(chunk);
+			self->pending = NULL;
+			continue;
+		}
+
+		out = chunk;
+		if (self->zstream) {
+			if (!self->deflated)
+				self->deflated = carbon_deflate(self, chunk);
+			out = self->deflated;
+		}
+
+		wr = write(self->out_sock, out->data + out->pos, out->len - out->pos);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				carbon_want_write(self, 1);
+				return -1;
+			}
+
+			carbon_disconnect(self);
+			continue;
+		}
+
+		out->pos += wr;
+		self->sent += wr;
+
+		if (out->pos == out->len) {
+			if (out != chunk) {
+				free(out);
+				self->deflated = NULL;
+			}
+			free(chunk);
+			self->pending = NULL;
+		}
+	}
+
+	if (carbon_is_connected(self))
+		carbon_want_write(self, 0);
+
+	return timeout;
+}
+
+static void *carbon__writer(void *_ptr)
+{
+	struct brubeck_carbon *self = (struct brubeck_carbon *)_ptr;
+	struct epoll_event events[4];
+
+	/* the writer can only be stopped while it waits */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		uint64_t now = carbon_now_ms();
+		int i, n, timeout;
+
+		if (brubeck_atomic_fetch(&self->resolver.ready))
+			carbon_resolved(self);
+
+		if (self->state == CARBON_CONNECTING && now >= self->connect_deadline) {
+			carbon_connect_failed(self, ETIMEDOUT, now);
+			carbon_writer_connect(self, now);
+		} else if (self->state == CARBON_DISCONNECTED) {
+			carbon_writer_connect(self, now);
+		}
+
+		timeout = carbon_writer_drain(self);
+		if (!carbon_is_connected(self))
+			timeout = carbon_reconnect_timeout(self, now);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		n = epoll_wait(self->epoll_fd, events, 4, timeout);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		now = carbon_now_ms();
+
+		for (i = 0; i < n; ++i) {
+			if (events[i].data.fd == self->event_fd) {
+				uint64_t wakeups;
+				if (read(self->event_fd, &wakeups, sizeof(wakeups)) < 0 &&
+						errno != EAGAIN)
+					log_splunk_errno("backend=carbon event=failed_wakeup");
+			} else if (events[i].data.fd != self->out_sock) {
+				continue;
+			} else if (self->state == CARBON_CONNECTING) {
+				carbon_writer_finish_connect(self, now);
+			} else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+				carbon_disconnect(self);
+			}
+		}
+	}
+
+	return NULL;
 }
 
 static inline size_t pickle1_int32(char *ptr, void *_src)
@@ -102,10 +551,31 @@ static inline size_t pickle1_double(char *ptr, void *_src)
 	return 9;
 }
 
+/*
+ * Short keys are sent as SHORT_BINSTRING; anything that doesn't
+ * fit a one-byte length goes out as BINUNICODE instead of being
+ * truncated.
+ */
+static inline size_t pickle_key(char *ptr, const char *key, size_t key_len)
+{
+	if (key_len < 256) {
+		ptr[0] = 'U';
+		ptr[1] = (uint8_t)key_len;
+		memcpy(ptr + 2, key, key_len);
+		return 2 + key_len;
+	} else {
+		uint32_t len = (uint32_t)key_len;
+		ptr[0] = 'X';
+		memcpy(ptr + 1, &len, 4);
+		memcpy(ptr + 5, key, key_len);
+		return 5 + key_len;
+	}
+}
+
 static void pickle1_push(
 		struct pickler *buf,
 		const char *key,
-		uint8_t key_len,
+		size_t key_len,
 		uint32_t timestamp,
 		value_t value)
 {
@@ -113,10 +583,7 @@ static void pickle1_push(
 
 	*ptr++ = '(';
 
-	*ptr++ = 'U';
-	*ptr++ = key_len;
-	memcpy(ptr, key, key_len);
-	ptr += key_len;
+	ptr += pickle_key(ptr, key, key_len);
 
 	*ptr++ = 'q';
 	*ptr++ = buf->pt++;
@@ -135,6 +602,7 @@ static void pickle1_push(
 	*ptr++ = buf->pt++;
 
 	buf->pos = (ptr - buf->ptr);
+	buf->items++;
 }
 
 static inline void pickle1_init(struct pickler *buf)
@@ -144,19 +612,152 @@ static inline void pickle1_init(struct pickler *buf)
 	memcpy(buf->ptr + 4, lead, sizeof(lead));
 	buf->pos = 4 + sizeof(lead);
 	buf->pt = 1;
+	buf->items = 0;
 }
 
-static void pickle1_flush(void *backend)
+/*
+ * Protocol 2 builds each (key, (timestamp, value)) item with TUPLE2
+ * opcodes instead of MARK/TUPLE, and skips memoization altogether:
+ * nothing in the stream is ever referenced twice, so the PUT opcodes
+ * of protocol 1 are dead weight (and overflow past 256 items).
+ */
+static void pickle2_push(
+		struct pickler *buf,
+		const char *key,
+		size_t key_len,
+		uint32_t timestamp,
+		value_t value)
 {
-	static const uint8_t trail[] = {'e', '.'};
+	char *ptr = buf->ptr + buf->pos;
 
-	struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
-	struct pickler *buf = &carbon->pickler;
+	ptr += pickle_key(ptr, key, key_len);
+	ptr += pickle1_int32(ptr, &timestamp);
+	ptr += pickle1_double(ptr, &value);
+
+	*ptr++ = '\x86'; /* TUPLE2: (timestamp, value) */
+	*ptr++ = '\x86'; /* TUPLE2: (key, (...)) */
+
+	buf->pos = (ptr - buf->ptr);
+	buf->items++;
+}
+
+static inline void pickle2_init(struct pickler *buf)
+{
+	static const uint8_t lead[] = { 0x80, 2, ']', '(' };
+
+	memcpy(buf->ptr + 4, lead, sizeof(lead));
+	buf->pos = 4 + sizeof(lead);
+	buf->items = 0;
+}
+
+static struct carbon_sink *carbon_sink_new(struct brubeck_carbon *carbon)
+{
+	struct carbon_sink *sink = xcalloc(1, sizeof(struct carbon_sink));
+
+	sink->buffer = xcalloc(carbon->queue_size, sizeof(ck_ring_buffer_t));
+	ck_ring_init(&sink->ring, carbon->queue_size);
+
+	return sink;
+}
+
+static struct carbon_chunk *carbon_chunk(struct brubeck_carbon *carbon, struct carbon_sink *sink)
+{
+	if (!sink->chunk) {
+		sink->chunk = xmalloc(sizeof(struct carbon_chunk) + carbon->chunk_size);
+		sink->chunk->len = 0;
+		sink->chunk->pos = 0;
+
+		if (carbon->pickle) {
+			sink->pickler.ptr = sink->chunk->data;
+			if (carbon->pickle == 2)
+				pickle2_init(&sink->pickler);
+			else
+				pickle1_init(&sink->pickler);
+		}
+	}
+	return sink->chunk;
+}
+
+/*
+ * Hand the sink's current chunk over to the writer thread. This
+ * never blocks: if the writer has fallen so far behind that the
+ * queue is full, the chunk is dropped.
+ */
+static void carbon_enqueue(struct brubeck_carbon *carbon, struct carbon_sink *sink)
+{
+	static const uint64_t wakeup = 1;
+	struct carbon_chunk *chunk = sink->chunk;
+
+	if (!chunk)
+		return;
+
+	sink->chunk = NULL;
+
+	if (chunk->len == 0) {
+		free(chunk);
+		return;
+	}
+
+	if (!ck_ring_enqueue_spsc(&sink->ring, sink->buffer, chunk)) {
+		log_splunk("backend=carbon event=queue_full");
+		brubeck_atomic_inc(&carbon->dropped);
+		free(chunk);
+		return;
+	}
+
+	if (write(carbon->event_fd, &wakeup, sizeof(wakeup)) < 0)
+		log_splunk_errno("backend=carbon event=failed_wakeup");
+}
+
+static void plaintext_push(
+	struct brubeck_carbon *carbon,
+	struct carbon_sink *sink,
+	const char *key,
+	size_t key_len,
+	value_t value,
+	uint32_t timestamp)
+{
+	struct carbon_chunk *chunk = carbon_chunk(carbon, sink);
+	char *ptr;
+
+	if (chunk->len + CARBON_LINE_SIZE(key_len) > carbon->chunk_size) {
+		carbon_enqueue(carbon, sink);
+		chunk = carbon_chunk(carbon, sink);
+	}
+
+	if (unlikely(sink->ts != timestamp || sink->ts_len == 0)) {
+		char *ts = sink->ts_str;
+
+		*ts++ = ' ';
+		ts += brubeck_itoa(ts, timestamp);
+		*ts++ = '\n';
 
+		sink->ts = timestamp;
+		sink->ts_len = (uint8_t)(ts - sink->ts_str);
+	}
+
+	ptr = chunk->data + chunk->len;
+
+	memcpy(ptr, key, key_len);
+	ptr += key_len;
+	*ptr++ = ' ';
+
+	ptr += brubeck_dtoa(ptr, value);
+
+	memcpy(ptr, sink->ts_str, sink->ts_len);
+	ptr += sink->ts_len;
+
+	chunk->len = ptr - chunk->data;
+}
+
+static void pickle_flush(struct brubeck_carbon *carbon, struct carbon_sink *sink)
+{
+	static const uint8_t trail[] = {'e', '.'};
+
+	struct pickler *buf = &sink->pickler;
 	uint32_t *buf_lead;
-	ssize_t wr;
-	
-	if (buf->pt == 1 || !carbon_is_connected(carbon))
+
+	if (!sink->chunk || buf->items == 0)
 		return;
 
 	memcpy(buf->ptr + buf->pos, trail, sizeof(trail));
@@ -165,35 +766,263 @@ static void pickle1_flush(void *backend)
 	buf_lead = (uint32_t *)buf->ptr;
 	*buf_lead = htonl((uint32_t)buf->pos - 4);
 
-	wr = write_in_full(carbon->out_sock, buf->ptr, buf->pos);
+	sink->chunk->len = buf->pos;
+	carbon_enqueue(carbon, sink);
+}
 
-	pickle1_init(&carbon->pickler);
-	if (wr < 0) {
-		carbon_disconnect(carbon);
+static void pickle_each(
+	struct brubeck_carbon *carbon,
+	struct carbon_sink *sink,
+	const char *key,
+	size_t key_len,
+	value_t value,
+	uint32_t timestamp)
+{
+	/* can't be framed at all, even on an empty frame */
+	if (unlikely(PICKLE1_SIZE(key_len) + 16 > carbon->chunk_size)) {
+		brubeck_atomic_inc(&carbon->dropped);
 		return;
 	}
 
-	carbon->sent += wr;
+	if (carbon->pickle == 2) {
+		if (sink->chunk && sink->pickler.pos + PICKLE2_SIZE(key_len)
+			>= carbon->chunk_size) {
+			pickle_flush(carbon, sink);
+		}
+
+		carbon_chunk(carbon, sink);
+		pickle2_push(&sink->pickler, key, key_len, timestamp, value);
+	} else {
+		if (sink->chunk && sink->pickler.pos + PICKLE1_SIZE(key_len)
+			>= carbon->chunk_size) {
+			pickle_flush(carbon, sink);
+		}
+
+		carbon_chunk(carbon, sink);
+		pickle1_push(&sink->pickler, key, key_len, timestamp, value);
+	}
 }
 
-static void pickle1_each(
+/* Serialize a sample in the wire format of the destination writer */
+static inline void carbon_push(
+	struct brubeck_carbon *carbon,
+	struct carbon_sink *sink,
 	const char *key,
+	size_t key_len,
+	value_t value,
+	uint32_t timestamp)
+{
+	if (carbon->pickle)
+		pickle_each(carbon, sink, key, key_len, value, timestamp);
+	else
+		plaintext_push(carbon, sink, key, key_len, value, timestamp);
+}
+
+static void carbon_sink_flush(struct brubeck_carbon *carbon, struct carbon_sink *sink)
+{
+	if (carbon->pickle)
+		pickle_flush(carbon, sink);
+	else
+		carbon_enqueue(carbon, sink);
+}
+
+static struct brubeck_carbon *carbon_replica(struct brubeck_carbon *carbon, int shard)
+{
+	struct brubeck_backend *backend = carbon->backend.server->backends[shard];
+
+	if (!backend || backend->type != BRUBECK_BACKEND_CARBON)
+		return NULL;
+
+	return (struct brubeck_carbon *)backend;
+}
+
+/*
+ * Send a copy of the sample to the other shards the metric is
+ * replicated to. We become the (single) producer of a new sink
+ * in each of their writers.
+ */
+static void carbon_mirror(struct brubeck_carbon *carbon,
+	const char *key, size_t key_len, value_t value)
+{
+	const int self = carbon->backend.shard_n;
+	uint8_t replicas = carbon->backend.replicas;
+	int i;
+
+	for (i = 0; replicas; ++i, replicas >>= 1) {
+		struct brubeck_carbon *replica;
+		struct carbon_sink *sink;
+
+		if (!(replicas & 1) || !(replica = carbon_replica(carbon, i)))
+			continue;
+
+		sink = replica->inbound[self];
+		if (!sink) {
+			sink = carbon_sink_new(replica);
+			brubeck_barrier();
+			replica->inbound[self] = sink;
+		}
+
+		carbon_push(replica, sink, key, key_len, value, carbon->backend.tick_time);
+	}
+}
+
+static void carbon_each(
+	const char *key,
+	size_t key_len,
 	value_t value,
 	void *backend)
 {
 	struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
-	uint8_t key_len = (uint8_t)strlen(key);
 
-	if (carbon->pickler.pos + PICKLE1_SIZE(key_len)
-		>= PICKLE_BUFFER_SIZE) {
-		pickle1_flush(carbon);
-	}
+	carbon_push(carbon, carbon->inbound[carbon->backend.shard_n],
+		key, key_len, value, carbon->backend.tick_time);
+
+	if (unlikely(carbon->backend.replicas != 0))
+		carbon_mirror(carbon, key, key_len, value);
+}
 
-	if (!carbon_is_connected(carbon))
+static void carbon_flush(void *backend)
+{
+	struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
+	struct brubeck_server *server = carbon->backend.server;
+	const int self = carbon->backend.shard_n;
+	int i;
+
+	carbon_sink_flush(carbon, carbon->inbound[self]);
+
+	/* rollups share the shard number of their parent, but
+	 * they never mirror: they only produce into their own sink */
+	if (carbon->backend.parent)
 		return;
 
-	pickle1_push(&carbon->pickler, key, key_len,
-		carbon->backend.tick_time, value);
+	for (i = 0; i < server->active_backends; ++i) {
+		struct brubeck_carbon *replica = carbon_replica(carbon, i);
+
+		if (replica && replica != carbon && replica->inbound[self])
+			carbon_sink_flush(replica, replica->inbound[self]);
+	}
+}
+
+/*
+ * Whether the writer has sent (or spooled) everything that has
+ * been flushed so far.
+ */
+static bool carbon_drained(void *backend)
+{
+	struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
+	size_t i;
+
+	brubeck_barrier();
+
+	if (carbon->pending)
+		return false;
+
+	for (i = 0; i < BRUBECK_MAX_BACKENDS; ++i) {
+		struct carbon_sink *sink = carbon->inbound[i];
+
+		if (sink && ck_ring_size(&sink->ring) > 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Backends have been renumbered by a config reload: move the sink
+ * of every producer to its new shard number. Sinks of producers
+ * that are gone have been drained already; they are not freed,
+ * since the writer may still be looking at them.
+ */
+static void carbon_renumber(void *backend, const int *shard_map)
+{
+	struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
+	struct carbon_sink *inbound[BRUBECK_MAX_BACKENDS];
+	int i;
+
+	memset(inbound, 0x0, sizeof(inbound));
+
+	for (i = 0; i < BRUBECK_MAX_BACKENDS; ++i) {
+		if (carbon->inbound[i] && shard_map[i] >= 0)
+			inbound[shard_map[i]] = carbon->inbound[i];
+	}
+
+	brubeck_barrier();
+
+	for (i = 0; i < BRUBECK_MAX_BACKENDS; ++i)
+		carbon->inbound[i] = inbound[i];
+}
+
+static void carbon_shutdown(void *backend)
+{
+	struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
+
+	pthread_cancel(carbon->resolver.thread);
+	pthread_join(carbon->resolver.thread, NULL);
+
+	pthread_cancel(carbon->writer);
+	pthread_join(carbon->writer, NULL);
+
+	if (carbon->out_sock >= 0)
+		close(carbon->out_sock);
+
+	close(carbon->epoll_fd);
+	close(carbon->event_fd);
+
+	if (carbon->spool) {
+		brubeck_spool_close(carbon->spool);
+		carbon->spool = NULL;
+	}
+
+	log_splunk("backend=carbon event=stopped");
+}
+
+static void carbon_queue_init(struct brubeck_carbon *carbon, unsigned int size)
+{
+	struct epoll_event ev;
+	unsigned int ring_size = 2;
+
+	/* the ring holds one less entry than its (power of two) size */
+	while (ring_size <= size)
+		ring_size <<= 1;
+
+	carbon->queue_size = ring_size;
+	carbon->inbound[carbon->backend.shard_n] = carbon_sink_new(carbon);
+
+	carbon->event_fd = eventfd(0, EFD_NONBLOCK);
+	carbon->epoll_fd = epoll_create1(0);
+
+	if (carbon->event_fd < 0 || carbon->epoll_fd < 0)
+		die("failed to create carbon writer queue");
+
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = carbon->event_fd;
+
+	if (epoll_ctl(carbon->epoll_fd, EPOLL_CTL_ADD, carbon->event_fd, &ev) < 0)
+		die("failed to create carbon writer queue");
+}
+
+/*
+ * Endpoints are given as "host" or "host:port"; the port defaults
+ * to the one of the primary endpoint.
+ */
+static void carbon_add_endpoint(struct brubeck_carbon *carbon, const char *url, int port)
+{
+	struct carbon_endpoint *ep;
+	const char *colon = strrchr(url, ':');
+
+	if (carbon->endpoint_count == CARBON_MAX_ENDPOINTS)
+		die("config error: too many carbon endpoints (max %d)", CARBON_MAX_ENDPOINTS);
+
+	ep = &carbon->endpoints[carbon->endpoint_count++];
+
+	if (colon) {
+		ep->host = strndup(url, colon - url);
+		ep->port = atoi(colon + 1);
+	} else {
+		ep->host = url;
+		ep->port = port;
+	}
 }
 
 struct brubeck_backend *
@@ -202,35 +1031,151 @@ brubeck_carbon_new(struct brubeck_server *server, json_t *settings, int shard_n)
 	struct brubeck_carbon *carbon = xcalloc(1, sizeof(struct brubeck_carbon));
 	char *address;
 	int port, frequency, pickle = 0;
+	int pickle_protocol = 0, pickle_frame = 0;
+	int queue_size = CARBON_QUEUE_SIZE;
+	const char *spool = NULL;
+	int spool_size = CARBON_SPOOL_SIZE, spool_rate = CARBON_SPOOL_RATE;
+	json_t *failover = NULL;
+	const char *shard_key = NULL;
+	const char *compression = NULL;
+	int compression_level = Z_DEFAULT_COMPRESSION;
+
+	carbon->backend.weight = 1;
+	carbon->connect_timeout = CARBON_CONNECT_TIMEOUT_MS;
+	carbon->resolve_interval = CARBON_RESOLVE_INTERVAL;
 
 	json_unpack_or_die(settings,
-		"{s:s, s:i, s?:b, s:i}",
+		"{s:s, s:i, s?:b, s?:i, s?:i, s:i, s?:i, s?:s, s?:i, s?:i, s?:o, s?:i, s?:i, s?:i, s?:s, s?:s, s?:i}",
 		"address", &address,
 		"port", &port,
 		"pickle", &pickle,
-		"frequency", &frequency);
+		"pickle_protocol", &pickle_protocol,
+		"pickle_frame", &pickle_frame,
+		"frequency", &frequency,
+		"queue_size", &queue_size,
+		"spool", &spool,
+		"spool_size", &spool_size,
+		"spool_rate", &spool_rate,
+		"failover", &failover,
+		"connect_timeout", &carbon->connect_timeout,
+		"resolve_interval", &carbon->resolve_interval,
+		"weight", &carbon->backend.weight,
+		"shard_key", &shard_key,
+		"compression", &compression,
+		"compression_level", &compression_level);
 
 	carbon->backend.type = BRUBECK_BACKEND_CARBON;
 	carbon->backend.shard_n = shard_n;
 	carbon->backend.connect = &carbon_connect;
 	carbon->backend.is_connected = &carbon_is_connected;
 
-	if (pickle) {
-		carbon->backend.sample = &pickle1_each;
-		carbon->backend.flush = &pickle1_flush;
-		carbon->pickler.ptr = malloc(PICKLE_BUFFER_SIZE);
-		pickle1_init(&carbon->pickler);
+	carbon->backend.sample = &carbon_each;
+	carbon->backend.flush = &carbon_flush;
+	carbon->backend.drained = &carbon_drained;
+	carbon->backend.renumber = &carbon_renumber;
+	carbon->backend.shutdown = &carbon_shutdown;
+
+	if (pickle_protocol) {
+		if (pickle_protocol != 1 && pickle_protocol != 2)
+			die("config error: unsupported pickle protocol %d", pickle_protocol);
+		pickle = 1;
+	} else if (pickle) {
+		pickle_protocol = 1;
+	}
+
+	carbon->pickle = pickle ? pickle_protocol : 0;
+	carbon->chunk_size = CARBON_CHUNK_SIZE;
+
+	if (carbon->pickle) {
+		if (!pickle_frame)
+			pickle_frame = (carbon->pickle == 2) ? PICKLE2_FRAME_SIZE : PICKLE_BUFFER_SIZE;
+
+		if (pickle_frame < PICKLE_BUFFER_SIZE || pickle_frame > PICKLE_MAX_FRAME_SIZE)
+			die("config error: pickle_frame must be between %d and %d bytes",
+				PICKLE_BUFFER_SIZE, PICKLE_MAX_FRAME_SIZE);
+
+		carbon->chunk_size = pickle_frame;
+	}
+
+	if (carbon->backend.weight <= 0)
+		die("config error: carbon weight must be positive");
+
+	/* the ring position of a backend follows its address, not
+	 * its position in the config file */
+	if (shard_key) {
+		carbon->backend.shard_key = shard_key;
 	} else {
-		carbon->backend.sample = &plaintext_each;
-		carbon->backend.flush = NULL;
+		char *key = xmalloc(MAX_ADDR + 16);
+		snprintf(key, MAX_ADDR + 16, "%s:%d", address, port);
+		carbon->backend.shard_key = key;
 	}
 
 	carbon->backend.sample_freq = frequency;
 	carbon->backend.server = server;
 	carbon->out_sock = -1;
-	url_to_inaddr2(&carbon->out_sockaddr, address, port);
+	carbon->state = CARBON_DISCONNECTED;
+
+	carbon_add_endpoint(carbon, address, port);
+
+	if (failover) {
+		size_t idx;
+		json_t *fo;
+
+		json_array_foreach(failover, idx, fo) {
+			const char *host = json_string_value(fo);
+			if (!host)
+				die("config error: carbon failover entries must be strings");
+			carbon_add_endpoint(carbon, host, port);
+		}
+	}
+
+	if (carbon->connect_timeout <= 0)
+		carbon->connect_timeout = CARBON_CONNECT_TIMEOUT_MS;
+	if (carbon->resolve_interval <= 0)
+		carbon->resolve_interval = CARBON_RESOLVE_INTERVAL;
+
+	/* the first lookup happens before the writer starts */
+	{
+		struct sockaddr_in addrs[CARBON_MAX_ENDPOINTS];
+		bool found[CARBON_MAX_ENDPOINTS];
+
+		carbon_lookup(carbon, addrs, found);
+		carbon_apply_lookup(carbon, addrs, found);
+	}
+	carbon->out_sockaddr = carbon->endpoints[0].addr;
+
+	carbon_queue_init(carbon, queue_size > 0 ? queue_size : CARBON_QUEUE_SIZE);
+
+	if (spool) {
+		if (spool_size <= 0 || spool_rate <= 0)
+			die("config error: carbon spool_size and spool_rate must be positive");
+
+		carbon->spool = brubeck_spool_open(spool, (size_t)spool_size << 20);
+		carbon->replay.rate = (double)spool_rate * 1024.0;
+		clock_gettime(CLOCK_MONOTONIC, &carbon->replay.last);
+	}
+
+	if (compression && strcmp(compression, "none") != 0) {
+		if (strcmp(compression, "gzip") != 0)
+			die("config error: unsupported carbon compression '%s'", compression);
+
+		carbon->compression = CARBON_COMPRESS_GZIP;
+		carbon->compression_level = compression_level;
+		carbon->zstream = xcalloc(1, sizeof(z_stream));
+
+		/* windowBits + 16 to get a gzip header and trailer */
+		if (deflateInit2(carbon->zstream, compression_level, Z_DEFLATED,
+				15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			die("config error: invalid carbon compression_level %d", compression_level);
+	}
+
+	if (pthread_create(&carbon->writer, NULL, &carbon__writer, carbon) != 0)
+		die("failed to start carbon writer thread");
+
+	pthread_mutex_init(&carbon->resolver.lock, NULL);
+	if (pthread_create(&carbon->resolver.thread, NULL, &carbon__resolver, carbon) != 0)
+		die("failed to start carbon resolver thread");
 
-	brubeck_backend_run_threaded((struct brubeck_backend *)carbon);
 	log_splunk("backend=carbon event=started");
 
 	return (struct brubeck_backend *)carbon;
@@ -1,21 +1,149 @@
 #ifndef __BRUBECK_CARBON_H__
 #define __BRUBECK_CARBON_H__
 
+#include "ck_ring.h"
+#include "spool.h"
+
 #define MAX_PICKLE_SIZE 256
 #define PICKLE_BUFFER_SIZE 4096
 #define PICKLE1_SIZE(key_len) (32 + key_len)
+#define PICKLE2_SIZE(key_len) (24 + key_len)
+
+/* Protocol 2 frames are much larger, so a flush takes a handful of
+ * writes instead of one per 4K. Carbon's receiver refuses frames
+ * above 1MB. */
+#define PICKLE2_FRAME_SIZE (256 * 1024)
+#define PICKLE_MAX_FRAME_SIZE (1024 * 1024)
+
+/* Plaintext lines are batched in chunks of this size before being
+ * handed to the writer thread */
+#define CARBON_CHUNK_SIZE (64 * 1024)
+#define CARBON_LINE_SIZE(key_len) (64 + key_len)
+
+#define CARBON_QUEUE_SIZE 256
+#define CARBON_RECONNECT_MS 1000
+#define CARBON_MAX_BACKOFF_MS 32000
+#define CARBON_CONNECT_TIMEOUT_MS 1000
+#define CARBON_RESOLVE_INTERVAL 60 /* seconds */
+#define CARBON_MAX_ENDPOINTS 8
+
+#define CARBON_SPOOL_SIZE 64 /* MB */
+#define CARBON_SPOOL_RATE 1024 /* KB/s */
+
+struct carbon_chunk {
+	uint32_t len;
+	uint32_t pos;
+	char data[];
+};
+
+/* A candidate relay. Endpoints are tried in order of preference;
+ * the ones that fail are benched with an exponential backoff. */
+struct carbon_endpoint {
+	const char *host;
+	int port;
+	struct sockaddr_in addr;
+	bool resolved;
+	uint32_t failures;
+	uint64_t retry_at;
+};
+
+enum carbon_compression {
+	CARBON_COMPRESS_NONE,
+	CARBON_COMPRESS_GZIP
+};
+
+enum carbon_state {
+	CARBON_DISCONNECTED,
+	CARBON_CONNECTING,
+	CARBON_CONNECTED
+};
+
+struct pickler {
+	char *ptr;
+	uint32_t pos;
+	uint32_t items;
+	uint16_t pt;
+};
+
+/*
+ * A single-producer, single-consumer queue of chunks into a Carbon
+ * writer. Every backend thread that sends data to a writer owns a
+ * sink: the backend's own thread, plus the other backends that
+ * mirror replicated metrics to it.
+ */
+struct carbon_sink {
+	ck_ring_t ring;
+	ck_ring_buffer_t *buffer;
+
+	/* producer side: chunk being filled */
+	struct carbon_chunk *chunk;
+	struct pickler pickler;
+
+	/* all the lines of a flush share the same timestamp, so
+	 * plaintext renders it (as " <ts>\n") once per flush */
+	uint32_t ts;
+	uint8_t ts_len;
+	char ts_str[16];
+};
 
 struct brubeck_carbon {
 	struct brubeck_backend backend;
 
 	int out_sock;
 	struct sockaddr_in out_sockaddr;
-	struct pickler {
-			char *ptr;
-			uint16_t pos;
-			uint16_t pt;
-	} pickler;
+
+	struct carbon_endpoint endpoints[CARBON_MAX_ENDPOINTS];
+	size_t endpoint_count;
+	size_t endpoint;
+	enum carbon_state state;
+	uint64_t connect_deadline;
+	int connect_timeout;
+	int resolve_interval;
+	int pickle; /* pickle protocol; 0 for plaintext */
+	size_t chunk_size;
+	unsigned int queue_size;
+
+	/* indexed by the shard of the producing backend */
+	struct carbon_sink *inbound[BRUBECK_MAX_BACKENDS];
+	int event_fd;
+
+	/* endpoint addresses, looked up every `resolve_interval` seconds
+	 * by the resolver thread and swapped in by the writer */
+	struct {
+		pthread_t thread;
+		pthread_mutex_t lock;
+		int ready;
+		bool found[CARBON_MAX_ENDPOINTS];
+		struct sockaddr_in addrs[CARBON_MAX_ENDPOINTS];
+	} resolver;
+
+	/* writer thread state */
+	pthread_t writer;
+	int epoll_fd;
+	int want_write;
+	struct carbon_chunk *pending;
+
+	/* stream compression, restarted on every new connection;
+	 * `deflated` is the compressed form of `pending` */
+	enum carbon_compression compression;
+	int compression_level;
+	struct z_stream_s *zstream;
+	struct carbon_chunk *deflated;
+
+	/* chunks captured while disconnected, replayed after reconnect */
+	struct brubeck_spool *spool;
+	struct {
+		double rate;
+		double tokens;
+		struct timespec last;
+	} replay;
+
 	size_t sent;
+	size_t dropped;
+	size_t spooled;
+	size_t replayed;
+	size_t raw_bytes;
+	size_t compressed_bytes;
 };
 
 struct brubeck_backend *brubeck_carbon_new(
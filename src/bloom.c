@@ -11,58 +11,86 @@
 
 int multibloom_check(struct multibloom *bloom, int f, uint32_t a, uint32_t b)
 {
-	unsigned char *filter = bloom->filters[f];
+	struct multibloom_filter *filter = &bloom->filters[f];
+	const uint32_t n = a % bloom->blocks;
+	struct multibloom_block *block = &filter->blocks[n];
+	pthread_spinlock_t *lock = &bloom->locks[n % MULTIBLOOM_STRIPES];
+
+	const uint32_t generation = filter->generation;
+
+	/* the bits within the block come from a LCG seeded with both
+	 * hashes; its high bits are mapped to a bit without a modulo */
+	uint64_t seed = ((uint64_t)a << 32) | b;
+	uint64_t mask[MULTIBLOOM_BLOCK_WORDS], missing = 0;
+	uint32_t x;
+	int i;
 
-	int hits = 0;
-	uint32_t x, i, byte, mask;
-	unsigned char c;
+	memset(mask, 0x0, sizeof(mask));
 
 	for (i = 0; i < bloom->hashes; i++) {
-		x = (a + i*b) % bloom->bits;
-		byte = x >> 3;
-		c = filter[byte];
-		mask = 1 << (x % 8);
-
-		if (c & mask) {
-			hits++;
-		} else {
-			filter[byte] = c | mask;
-		}
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		x = (uint32_t)(((seed >> 32) * MULTIBLOOM_BLOCK_BITS) >> 32);
+		mask[x / 64] |= 1ull << (x % 64);
+	}
+
+	pthread_spin_lock(lock);
+
+	if (block->generation != generation) {
+		memset(block->bits, 0x0, sizeof(block->bits));
+		block->generation = generation;
+	}
+
+	for (i = 0; i < MULTIBLOOM_BLOCK_WORDS; i++) {
+		missing |= mask[i] & ~block->bits[i];
+		block->bits[i] |= mask[i];
 	}
 
-	return (hits == bloom->hashes);
+	pthread_spin_unlock(lock);
+
+	return (missing == 0);
 }
 
+/* O(1): the blocks are cleared lazily, by the checks that use them */
 void multibloom_reset(struct multibloom *bloom, int f)
 {
-	memset(bloom->filters[f], 0x0, bloom->bytes);
+	__sync_fetch_and_add(&bloom->filters[f].generation, 1);
 }
 
 struct multibloom *multibloom_new(int filters, int entries, double error)
 {
 	const double bpe = -(log(error) / 0.480453013918201);
+	struct multibloom *bloom = xmalloc(sizeof(struct multibloom) +
+		filters * sizeof(struct multibloom_filter));
+	double bits;
 	int i;
-	struct multibloom *bloom = xmalloc(sizeof(struct multibloom) + filters * sizeof(void *));
 
 	assert(entries > 1 && error > 0.0);
 
-	bloom->bits = (int)((double)entries * bpe);
-	bloom->bytes = (bloom->bits / 8);
+	/* keys don't spread evenly across blocks, so the fuller blocks
+	 * have a higher error rate; some extra space makes up for it */
+	bits = (double)entries * bpe * 1.2;
+	bloom->blocks = (uint32_t)ceil(bits / MULTIBLOOM_BLOCK_BITS);
+	bloom->hashes = (int)ceil(0.693147180559945 * bpe);  // ln(2)
 
-	if (bloom->bits % 8)
-		bloom->bytes++;
+	for (i = 0; i < filters; ++i) {
+		size_t size = bloom->blocks * sizeof(struct multibloom_block);
 
-	bloom->hashes = (int)ceil(0.693147180559945 * bpe);  // ln(2)
+		if (posix_memalign((void **)&bloom->filters[i].blocks, 64, size) != 0)
+			die("oom");
 
-	for (i = 0; i < filters; ++i)
-		bloom->filters[i] = xcalloc(1, bloom->bytes);
+		memset(bloom->filters[i].blocks, 0x0, size);
+		bloom->filters[i].generation = 0;
+	}
+
+	for (i = 0; i < MULTIBLOOM_STRIPES; ++i)
+		pthread_spin_init(&bloom->locks[i], PTHREAD_PROCESS_PRIVATE);
 
 	log_splunk(
-		"event=bloom_init entries=%d error=%f bits=%d bpe=%f "
-		"bytes=%d hash_funcs=%d",
-		entries, error, bloom->bits, bpe, bloom->bytes, bloom->hashes
+		"event=bloom_init entries=%d error=%f blocks=%u bpe=%f "
+		"bytes=%zu hash_funcs=%d",
+		entries, error, bloom->blocks, bpe,
+		(size_t)bloom->blocks * sizeof(struct multibloom_block), bloom->hashes
 	);
 
 	return bloom;
 }
-
@@ -2,12 +2,40 @@
 #define __BLOOM_FILTER_H
 
 #include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Blocked bloom filters: all the bits for a key are in the same
+ * cache line, so a check costs one cache miss regardless of how
+ * many hash functions the error rate requires.
+ *
+ * Checks are safe to run concurrently: checks that land on the same
+ * block are serialized by a striped lock, so only one of them can see
+ * a key as new.
+ */
+#define MULTIBLOOM_STRIPES 64
+#define MULTIBLOOM_BLOCK_WORDS 7
+#define MULTIBLOOM_BLOCK_BITS (MULTIBLOOM_BLOCK_WORDS * 64)
+
+struct multibloom_block {
+	uint64_t bits[MULTIBLOOM_BLOCK_WORDS];
+
+	/* blocks from an older generation than their filter are
+	 * stale, and get cleared the next time they're checked */
+	uint32_t generation;
+	uint32_t _unused;
+} __attribute__((aligned(64)));
+
+struct multibloom_filter {
+	struct multibloom_block *blocks;
+	uint32_t generation;
+};
 
 struct multibloom {
-	int bits;
-	int bytes;
+	uint32_t blocks;
 	int hashes;
-	unsigned char *filters[];
+	pthread_spinlock_t locks[MULTIBLOOM_STRIPES];
+	struct multibloom_filter filters[];
 };
 
 int multibloom_check(struct multibloom *bloom, int f, uint32_t a, uint32_t b);
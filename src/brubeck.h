@@ -33,12 +33,21 @@ struct brubeck_metric;
 #include "jansson.h"
 #include "log.h"
 #include "utils.h"
+#include "clock.h"
 #include "slab.h"
 #include "histogram.h"
+#include "hll.h"
+#include "tags.h"
+#include "sha256.h"
 #include "metric.h"
+#include "aggregation.h"
+#include "filter.h"
 #include "sampler.h"
 #include "backend.h"
 #include "ht.h"
+#include "sharding.h"
+#include "flow.h"
+#include "handoff.h"
 #include "server.h"
 
 #endif
@@ -0,0 +1,276 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "brubeck.h"
+
+/*
+ * Snapshot of the metrics table, so restarts don't begin with a cold
+ * table and lose the state of gauges and counters. The file is a
+ * header followed by one record per metric:
+ *
+ *	value, previous (doubles), key_len (u16), type (u8), key + NUL
+ *
+ * Records are padded to 8 bytes. Histograms and timers are restored
+ * without their samples; internal stats are not saved.
+ */
+#define CACHE_MAGIC 0x50414e534b425242ULL /* "BRBKSNAP" */
+#define CACHE_VERSION 1
+
+struct cache_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t metric_size;
+	uint64_t count;
+	uint64_t size;
+};
+
+struct cache_record {
+	value_t value;
+	value_t previous;
+	uint16_t key_len;
+	uint8_t type;
+	uint8_t _pad[5];
+	char key[];
+};
+
+#define CACHE_RECORD_SIZE(key_len) \
+	((sizeof(struct cache_record) + (key_len) + 1 + 7) & ~(size_t)7)
+
+static void cache_record_fill(struct cache_record *rec, struct brubeck_metric *metric)
+{
+	memset(rec, 0x0, sizeof(struct cache_record));
+	rec->key_len = metric->key_len;
+	rec->type = metric->type;
+
+	pthread_spin_lock(&metric->lock);
+	switch (metric->type) {
+	case BRUBECK_MT_GAUGE:
+		rec->value = metric->as.gauge.value;
+		break;
+	case BRUBECK_MT_METER:
+		rec->value = metric->as.meter.value;
+		break;
+	case BRUBECK_MT_COUNTER:
+		rec->value = metric->as.counter.value;
+		rec->previous = metric->as.counter.previous;
+		break;
+	}
+	pthread_spin_unlock(&metric->lock);
+}
+
+static void cache_record_restore(struct brubeck_metric *metric, const struct cache_record *rec)
+{
+	switch (metric->type) {
+	case BRUBECK_MT_GAUGE:
+		metric->as.gauge.value = rec->value;
+		break;
+	case BRUBECK_MT_METER:
+		metric->as.meter.value = rec->value;
+		break;
+	case BRUBECK_MT_COUNTER:
+		metric->as.counter.value = rec->value;
+		metric->as.counter.previous = rec->previous;
+		break;
+	}
+}
+
+/*
+ * Write the snapshot to a temporary file and rename it over the old
+ * one, so a crash halfway through never leaves a truncated cache.
+ */
+void brubeck_cache_save(struct brubeck_server *server)
+{
+	static const char padding[8];
+	struct brubeck_metric **metrics;
+	struct cache_header header;
+	struct cache_record rec;
+	char tmp_path[PATH_MAX];
+	size_t count, i;
+	FILE *out;
+
+	if (!server->cache_path)
+		return;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", server->cache_path);
+
+	out = fopen(tmp_path, "w");
+	if (!out) {
+		log_splunk_errno("event=cache_save_failed path=%s", tmp_path);
+		return;
+	}
+
+	memset(&header, 0x0, sizeof(header));
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.metric_size = sizeof(struct cache_record);
+
+	/* leave room for the header, which is written last */
+	fwrite(&header, sizeof(header), 1, out);
+
+	metrics = brubeck_hashtable_to_a(server->metrics, &count);
+
+	for (i = 0; i < count; ++i) {
+		struct brubeck_metric *metric = metrics[i];
+		size_t len;
+
+		/* tag ids are only meaningful to this process, and
+		 * aliases are created again by the filter */
+		if (metric->type == BRUBECK_MT_INTERNAL_STATS || metric->tag_count ||
+			(metric->flags & BRUBECK_METRIC_ALIAS))
+			continue;
+
+		cache_record_fill(&rec, metric);
+		len = CACHE_RECORD_SIZE(metric->key_len);
+
+		fwrite(&rec, sizeof(rec), 1, out);
+		fwrite(metric->key, metric->key_len + 1, 1, out);
+		fwrite(padding, len - sizeof(rec) - metric->key_len - 1, 1, out);
+
+		header.count++;
+		header.size += len;
+	}
+
+	free(metrics);
+
+	rewind(out);
+	fwrite(&header, sizeof(header), 1, out);
+
+	if (fflush(out) != 0 || fsync(fileno(out)) < 0 || ferror(out)) {
+		log_splunk_errno("event=cache_save_failed path=%s", tmp_path);
+		fclose(out);
+		unlink(tmp_path);
+		return;
+	}
+
+	fclose(out);
+
+	if (rename(tmp_path, server->cache_path) < 0) {
+		log_splunk_errno("event=cache_save_failed path=%s", server->cache_path);
+		unlink(tmp_path);
+		return;
+	}
+
+	log_splunk("event=cache_saved path=%s metrics=%llu",
+		server->cache_path, (unsigned long long)header.count);
+}
+
+static bool cache_validate(const char *data, const struct cache_header *header, size_t *alloc)
+{
+	const char *ptr = data, *end = data + header->size;
+	uint64_t i;
+
+	*alloc = 0;
+
+	for (i = 0; i < header->count; ++i) {
+		const struct cache_record *rec = (const struct cache_record *)ptr;
+
+		if ((size_t)(end - ptr) < sizeof(struct cache_record) ||
+			(size_t)(end - ptr) < CACHE_RECORD_SIZE(rec->key_len) ||
+			rec->type >= BRUBECK_MT_INTERNAL_STATS ||
+			rec->key[rec->key_len] != '\0' ||
+			strlen(rec->key) != rec->key_len)
+			return false;
+
+		*alloc += (BRUBECK_METRIC_SIZE(rec->key_len) + 15) & ~(size_t)15;
+		ptr += CACHE_RECORD_SIZE(rec->key_len);
+	}
+
+	return ptr == end;
+}
+
+static bool cache_filter_allows(struct brubeck_server *server, const struct cache_record *rec)
+{
+	char renamed[BRUBECK_FILTER_KEY_MAX];
+	size_t len;
+
+	return brubeck_filter_apply(server->filter, renamed, sizeof(renamed),
+		&len, rec->key, rec->key_len) == BRUBECK_FILTER_ALLOW;
+}
+
+/*
+ * Bulk-load the snapshot at startup, before the samplers are running.
+ * The metrics are all carved from a single allocation and inserted
+ * into the table taking its lock once, instead of paying for a slab
+ * allocation and a locked insert per key.
+ */
+void brubeck_cache_load(struct brubeck_server *server)
+{
+	struct brubeck_metric **metrics;
+	const struct cache_header *header;
+	const char *map, *ptr;
+	size_t alloc, inserted, i, n = 0;
+	char *memory;
+	struct stat st;
+	int fd;
+
+	if (!server->cache_path)
+		return;
+
+	fd = open(server->cache_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			log_splunk_errno("event=cache_load_failed path=%s", server->cache_path);
+		return;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct cache_header)) {
+		log_splunk("event=cache_load_failed path=%s error=truncated", server->cache_path);
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		log_splunk_errno("event=cache_load_failed path=%s", server->cache_path);
+		return;
+	}
+
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	header = (const struct cache_header *)map;
+
+	if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+		header->metric_size != sizeof(struct cache_record) ||
+		header->size != st.st_size - sizeof(struct cache_header) ||
+		!cache_validate(map + sizeof(struct cache_header), header, &alloc)) {
+		log_splunk("event=cache_load_failed path=%s error=corrupted", server->cache_path);
+		munmap((void *)map, st.st_size);
+		return;
+	}
+
+	metrics = xmalloc(header->count * sizeof(struct brubeck_metric *) + 1);
+	memory = xmalloc(alloc + 1);
+	ptr = map + sizeof(struct cache_header);
+
+	for (i = 0; i < header->count; ++i) {
+		const struct cache_record *rec = (const struct cache_record *)ptr;
+		struct brubeck_metric *metric = (struct brubeck_metric *)memory;
+
+		ptr += CACHE_RECORD_SIZE(rec->key_len);
+
+		/* the filter may have changed since the cache was saved */
+		if (server->filter && !cache_filter_allows(server, rec))
+			continue;
+
+		brubeck_metric_init(server, metric, rec->key, rec->key_len, rec->type);
+		cache_record_restore(metric, rec);
+		metrics[n++] = metric;
+
+		memory += (BRUBECK_METRIC_SIZE(rec->key_len) + 15) & ~(size_t)15;
+	}
+
+	inserted = brubeck_hashtable_insert_bulk(server->metrics, metrics, n);
+
+	for (i = 0; i < inserted; ++i) {
+		brubeck_metric_bind(server, metrics[i]);
+		brubeck_metric_register(server, metrics[i]);
+	}
+
+	log_splunk("event=cache_loaded path=%s metrics=%zu", server->cache_path, inserted);
+
+	free(metrics);
+	munmap((void *)map, st.st_size);
+}
@@ -0,0 +1,40 @@
+#include "brubeck.h"
+
+time_t brubeck_clock_now;
+
+static void *clock__thread(void *_unused)
+{
+	struct timespec now;
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		brubeck_clock_now = now.tv_sec;
+
+		/* sleeping until an absolute time follows the
+		 * wall clock if it's stepped */
+		now.tv_sec++;
+		now.tv_nsec = 0;
+		while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &now, NULL) == EINTR)
+			;
+	}
+
+	return NULL;
+}
+
+void brubeck_clock_init(void)
+{
+	static pthread_t thread;
+	struct timespec now;
+
+	if (brubeck_clock_now)
+		return;
+
+	/* readers never see an unset clock */
+	clock_gettime(CLOCK_REALTIME, &now);
+	brubeck_clock_now = now.tv_sec;
+
+	if (pthread_create(&thread, NULL, &clock__thread, NULL) != 0)
+		die("failed to start clock thread");
+
+	pthread_detach(thread);
+}
@@ -0,0 +1,20 @@
+#ifndef __BRUBECK_CLOCK_H__
+#define __BRUBECK_CLOCK_H__
+
+#include <time.h>
+
+/*
+ * A coarse wall clock for the hot paths. A ticker thread wakes up
+ * at every second boundary and stores the time, so reading it is a
+ * single load instead of a clock_gettime call per packet.
+ */
+extern time_t brubeck_clock_now;
+
+static inline time_t brubeck_now(void)
+{
+	return *(volatile time_t *)&brubeck_clock_now;
+}
+
+void brubeck_clock_init(void);
+
+#endif
@@ -0,0 +1,423 @@
+#include "brubeck.h"
+
+/*
+ * Shortest round-trip double formatting, using Florian Loitsch's
+ * Grisu2 algorithm (as in "Printing Floating-Point Numbers Quickly
+ * and Accurately with Integers", PLDI 2010). The output always
+ * parses back to the exact same double, and is the shortest such
+ * representation in all but a tiny fraction of cases, where it is
+ * one digit longer.
+ */
+
+struct diy_fp {
+	uint64_t f;
+	int e;
+};
+
+/* Normalized powers of ten: 10^k for k = -348, -340, ..., 340 */
+static const struct diy_fp cached_powers[] = {
+	{ 0xfa8fd5a0081c0288ULL, -1220 },
+	{ 0xbaaee17fa23ebf76ULL, -1193 },
+	{ 0x8b16fb203055ac76ULL, -1166 },
+	{ 0xcf42894a5dce35eaULL, -1140 },
+	{ 0x9a6bb0aa55653b2dULL, -1113 },
+	{ 0xe61acf033d1a45dfULL, -1087 },
+	{ 0xab70fe17c79ac6caULL, -1060 },
+	{ 0xff77b1fcbebcdc4fULL, -1034 },
+	{ 0xbe5691ef416bd60cULL, -1007 },
+	{ 0x8dd01fad907ffc3cULL, -980 },
+	{ 0xd3515c2831559a83ULL, -954 },
+	{ 0x9d71ac8fada6c9b5ULL, -927 },
+	{ 0xea9c227723ee8bcbULL, -901 },
+	{ 0xaecc49914078536dULL, -874 },
+	{ 0x823c12795db6ce57ULL, -847 },
+	{ 0xc21094364dfb5637ULL, -821 },
+	{ 0x9096ea6f3848984fULL, -794 },
+	{ 0xd77485cb25823ac7ULL, -768 },
+	{ 0xa086cfcd97bf97f4ULL, -741 },
+	{ 0xef340a98172aace5ULL, -715 },
+	{ 0xb23867fb2a35b28eULL, -688 },
+	{ 0x84c8d4dfd2c63f3bULL, -661 },
+	{ 0xc5dd44271ad3cdbaULL, -635 },
+	{ 0x936b9fcebb25c996ULL, -608 },
+	{ 0xdbac6c247d62a584ULL, -582 },
+	{ 0xa3ab66580d5fdaf6ULL, -555 },
+	{ 0xf3e2f893dec3f126ULL, -529 },
+	{ 0xb5b5ada8aaff80b8ULL, -502 },
+	{ 0x87625f056c7c4a8bULL, -475 },
+	{ 0xc9bcff6034c13053ULL, -449 },
+	{ 0x964e858c91ba2655ULL, -422 },
+	{ 0xdff9772470297ebdULL, -396 },
+	{ 0xa6dfbd9fb8e5b88fULL, -369 },
+	{ 0xf8a95fcf88747d94ULL, -343 },
+	{ 0xb94470938fa89bcfULL, -316 },
+	{ 0x8a08f0f8bf0f156bULL, -289 },
+	{ 0xcdb02555653131b6ULL, -263 },
+	{ 0x993fe2c6d07b7facULL, -236 },
+	{ 0xe45c10c42a2b3b06ULL, -210 },
+	{ 0xaa242499697392d3ULL, -183 },
+	{ 0xfd87b5f28300ca0eULL, -157 },
+	{ 0xbce5086492111aebULL, -130 },
+	{ 0x8cbccc096f5088ccULL, -103 },
+	{ 0xd1b71758e219652cULL, -77 },
+	{ 0x9c40000000000000ULL, -50 },
+	{ 0xe8d4a51000000000ULL, -24 },
+	{ 0xad78ebc5ac620000ULL, 3 },
+	{ 0x813f3978f8940984ULL, 30 },
+	{ 0xc097ce7bc90715b3ULL, 56 },
+	{ 0x8f7e32ce7bea5c70ULL, 83 },
+	{ 0xd5d238a4abe98068ULL, 109 },
+	{ 0x9f4f2726179a2245ULL, 136 },
+	{ 0xed63a231d4c4fb27ULL, 162 },
+	{ 0xb0de65388cc8ada8ULL, 189 },
+	{ 0x83c7088e1aab65dbULL, 216 },
+	{ 0xc45d1df942711d9aULL, 242 },
+	{ 0x924d692ca61be758ULL, 269 },
+	{ 0xda01ee641a708deaULL, 295 },
+	{ 0xa26da3999aef774aULL, 322 },
+	{ 0xf209787bb47d6b85ULL, 348 },
+	{ 0xb454e4a179dd1877ULL, 375 },
+	{ 0x865b86925b9bc5c2ULL, 402 },
+	{ 0xc83553c5c8965d3dULL, 428 },
+	{ 0x952ab45cfa97a0b3ULL, 455 },
+	{ 0xde469fbd99a05fe3ULL, 481 },
+	{ 0xa59bc234db398c25ULL, 508 },
+	{ 0xf6c69a72a3989f5cULL, 534 },
+	{ 0xb7dcbf5354e9beceULL, 561 },
+	{ 0x88fcf317f22241e2ULL, 588 },
+	{ 0xcc20ce9bd35c78a5ULL, 614 },
+	{ 0x98165af37b2153dfULL, 641 },
+	{ 0xe2a0b5dc971f303aULL, 667 },
+	{ 0xa8d9d1535ce3b396ULL, 694 },
+	{ 0xfb9b7cd9a4a7443cULL, 720 },
+	{ 0xbb764c4ca7a44410ULL, 747 },
+	{ 0x8bab8eefb6409c1aULL, 774 },
+	{ 0xd01fef10a657842cULL, 800 },
+	{ 0x9b10a4e5e9913129ULL, 827 },
+	{ 0xe7109bfba19c0c9dULL, 853 },
+	{ 0xac2820d9623bf429ULL, 880 },
+	{ 0x80444b5e7aa7cf85ULL, 907 },
+	{ 0xbf21e44003acdd2dULL, 933 },
+	{ 0x8e679c2f5e44ff8fULL, 960 },
+	{ 0xd433179d9c8cb841ULL, 986 },
+	{ 0x9e19db92b4e31ba9ULL, 1013 },
+	{ 0xeb96bf6ebadf77d9ULL, 1039 },
+	{ 0xaf87023b9bf0ee6bULL, 1066 }
+};
+
+static const uint64_t pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static inline struct diy_fp diy_fp_mul(struct diy_fp x, struct diy_fp y)
+{
+	struct diy_fp r;
+	unsigned __int128 p = (unsigned __int128)x.f * y.f;
+
+	/* round the low half */
+	r.f = (uint64_t)(p >> 64) + (uint64_t)(((uint64_t)p >> 63) & 1);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+static inline struct diy_fp diy_fp_normalize(struct diy_fp x)
+{
+	int shift = __builtin_clzll(x.f);
+	x.f <<= shift;
+	x.e -= shift;
+	return x;
+}
+
+static inline struct diy_fp diy_fp_from_double(double value)
+{
+	struct diy_fp r;
+	uint64_t bits, significand;
+	int biased_e;
+
+	memcpy(&bits, &value, sizeof(bits));
+	significand = bits & 0x000FFFFFFFFFFFFFULL;
+	biased_e = (int)((bits >> 52) & 0x7FF);
+
+	if (biased_e != 0) {
+		r.f = significand | 0x0010000000000000ULL;
+		r.e = biased_e - 1075;
+	} else {
+		r.f = significand;
+		r.e = -1074;
+	}
+	return r;
+}
+
+/* The boundaries m- and m+ of the interval of values that round to v */
+static void normalized_boundaries(struct diy_fp v, struct diy_fp *minus, struct diy_fp *plus)
+{
+	struct diy_fp pl, mi;
+
+	pl.f = (v.f << 1) + 1;
+	pl.e = v.e - 1;
+	pl = diy_fp_normalize(pl);
+
+	if (v.f == 0x0010000000000000ULL) {
+		mi.f = (v.f << 2) - 1;
+		mi.e = v.e - 2;
+	} else {
+		mi.f = (v.f << 1) - 1;
+		mi.e = v.e - 1;
+	}
+
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+
+	*plus = pl;
+	*minus = mi;
+}
+
+static inline struct diy_fp cached_power(int e, int *K)
+{
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int k = (int)dk;
+	unsigned int index;
+
+	if (dk - k > 0.0)
+		k++;
+
+	index = (unsigned int)((k >> 3) + 1);
+	*K = -(-348 + (int)index * 8);
+	return cached_powers[index];
+}
+
+static inline int count_digits32(uint32_t n)
+{
+	int d = 1;
+	while (n >= 10 && d < 10) {
+		n /= 10;
+		d++;
+	}
+	return d;
+}
+
+static inline void grisu_round(char *buffer, int len,
+	uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+		(rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buffer[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+static void digit_gen(struct diy_fp W, struct diy_fp Mp, uint64_t delta,
+	char *buffer, int *len, int *K)
+{
+	const struct diy_fp one = { 1ULL << -Mp.e, Mp.e };
+	const uint64_t wp_w = Mp.f - W.f;
+	uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+	uint64_t p2 = Mp.f & (one.f - 1);
+	int kappa = count_digits32(p1);
+
+	*len = 0;
+
+	while (kappa > 0) {
+		uint32_t d = p1 / (uint32_t)pow10_u64[kappa - 1];
+		uint64_t rest;
+
+		p1 %= (uint32_t)pow10_u64[kappa - 1];
+		if (d || *len)
+			buffer[(*len)++] = (char)('0' + d);
+		kappa--;
+
+		rest = ((uint64_t)p1 << -one.e) + p2;
+		if (rest <= delta) {
+			*K += kappa;
+			grisu_round(buffer, *len, delta, rest, pow10_u64[kappa] << -one.e, wp_w);
+			return;
+		}
+	}
+
+	for (;;) {
+		char d;
+
+		p2 *= 10;
+		delta *= 10;
+		d = (char)(p2 >> -one.e);
+		if (d || *len)
+			buffer[(*len)++] = (char)('0' + d);
+		p2 &= one.f - 1;
+		kappa--;
+
+		if (p2 < delta) {
+			int index = -kappa;
+			*K += kappa;
+			grisu_round(buffer, *len, delta, p2, one.f,
+				wp_w * (index < 20 ? pow10_u64[index] : 0));
+			return;
+		}
+	}
+}
+
+static void grisu2(double value, char *buffer, int *len, int *K)
+{
+	const struct diy_fp v = diy_fp_from_double(value);
+	struct diy_fp w_m, w_p, c_mk, W, Wp, Wm;
+
+	normalized_boundaries(v, &w_m, &w_p);
+
+	c_mk = cached_power(w_p.e, K);
+	W = diy_fp_mul(diy_fp_normalize(v), c_mk);
+	Wp = diy_fp_mul(w_p, c_mk);
+	Wm = diy_fp_mul(w_m, c_mk);
+	Wm.f++;
+	Wp.f--;
+
+	digit_gen(W, Wp, Wp.f - Wm.f, buffer, len, K);
+}
+
+static int write_exponent(char *p, int K)
+{
+	char *origin = p;
+
+	if (K < 0) {
+		*p++ = '-';
+		K = -K;
+	}
+
+	if (K >= 100) {
+		*p++ = (char)('0' + K / 100);
+		K %= 100;
+		memcpy(p, digit_pairs + K * 2, 2);
+		p += 2;
+	} else if (K >= 10) {
+		memcpy(p, digit_pairs + K * 2, 2);
+		p += 2;
+	} else {
+		*p++ = (char)('0' + K);
+	}
+
+	return p - origin;
+}
+
+/* Lay out the digits in `buffer` (the value being digits * 10^k) */
+static int prettify(char *buffer, int length, int k)
+{
+	const int kk = length + k; /* 10^(kk-1) <= v < 10^kk */
+	int i;
+
+	if (k >= 0 && kk <= 21) {
+		/* 1234e7 -> 12340000000 */
+		for (i = length; i < kk; i++)
+			buffer[i] = '0';
+		return kk;
+	}
+
+	if (kk > 0 && kk <= 21) {
+		/* 1234e-2 -> 12.34 */
+		memmove(&buffer[kk + 1], &buffer[kk], length - kk);
+		buffer[kk] = '.';
+		return length + 1;
+	}
+
+	if (kk > -6 && kk <= 0) {
+		/* 1234e-6 -> 0.001234 */
+		const int offset = 2 - kk;
+		memmove(&buffer[offset], &buffer[0], length);
+		buffer[0] = '0';
+		buffer[1] = '.';
+		for (i = 2; i < offset; i++)
+			buffer[i] = '0';
+		return length + offset;
+	}
+
+	if (length == 1) {
+		/* 1e30 */
+		buffer[1] = 'e';
+		return 2 + write_exponent(&buffer[2], kk - 1);
+	}
+
+	/* 1234e30 -> 1.234e33 */
+	memmove(&buffer[2], &buffer[1], length - 1);
+	buffer[1] = '.';
+	buffer[length + 1] = 'e';
+	return length + 2 + write_exponent(&buffer[length + 2], kk - 1);
+}
+
+int brubeck_utoa(char *outbuf, uint64_t number)
+{
+	char tmp[20], *p = tmp + sizeof(tmp);
+	int len;
+
+	while (number >= 100) {
+		p -= 2;
+		memcpy(p, digit_pairs + (number % 100) * 2, 2);
+		number /= 100;
+	}
+
+	if (number >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + number * 2, 2);
+	} else {
+		*--p = (char)('0' + number);
+	}
+
+	len = (int)(tmp + sizeof(tmp) - p);
+	memcpy(outbuf, p, len);
+	return len;
+}
+
+/*
+ * Write the shortest decimal representation of `value` that parses
+ * back to the same double into a buffer of BRUBECK_DTOA_SIZE bytes.
+ * The output is NUL-terminated; the returned length excludes the
+ * terminator.
+ */
+int brubeck_dtoa(char *outbuf, double value)
+{
+	char *p = outbuf;
+	int len, K;
+
+	if (unlikely(!isfinite(value))) {
+		if (isnan(value)) {
+			memcpy(p, "nan", 4);
+			return 3;
+		}
+		if (value < 0)
+			*p++ = '-';
+		memcpy(p, "inf", 4);
+		return (p - outbuf) + 3;
+	}
+
+	if (signbit(value)) {
+		value = -value;
+		if (value != 0.0)
+			*p++ = '-';
+	}
+
+	/* counters and most gauges are integral: format them exactly
+	 * without going through the floating point path */
+	if (value < 9007199254740992.0 && value == (double)(uint64_t)value) {
+		p += brubeck_utoa(p, (uint64_t)value);
+		*p = 0;
+		return p - outbuf;
+	}
+
+	grisu2(value, p, &len, &K);
+	p += prettify(p, len, K);
+	*p = 0;
+	return p - outbuf;
+}
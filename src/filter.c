@@ -0,0 +1,263 @@
+#include "brubeck.h"
+
+static uint32_t
+new_state(struct brubeck_filter *filter)
+{
+	uint32_t state = filter->state_count++;
+
+	if (state == filter->state_alloc) {
+		filter->state_alloc *= 2;
+		filter->next = xrealloc(filter->next,
+			filter->state_alloc * filter->class_count * sizeof(uint32_t));
+		filter->verdicts = xrealloc(filter->verdicts, filter->state_alloc);
+	}
+
+	memset(&filter->next[state * filter->class_count], 0x0,
+		filter->class_count * sizeof(uint32_t));
+	filter->verdicts[state] = 0;
+
+	return state;
+}
+
+static void
+add_prefix(struct brubeck_filter *filter, const char *prefix, uint8_t verdict)
+{
+	uint32_t state = 1;
+	const char *p;
+
+	for (p = prefix; *p; ++p) {
+		size_t t = state * filter->class_count + filter->classes[(uint8_t)*p];
+
+		if (filter->next[t] == 0) {
+			uint32_t next = new_state(filter);
+			filter->next[t] = next;
+		}
+
+		state = filter->next[t];
+	}
+
+	filter->verdicts[state] = verdict + 1;
+}
+
+static void
+compile_prefixes(struct brubeck_filter *filter, json_t *allow, json_t *deny)
+{
+	json_t *lists[] = { allow, deny };
+	size_t i, idx;
+	json_t *p;
+
+	/* every byte used in a prefix gets its own class */
+	filter->class_count = 1;
+
+	for (i = 0; i < 2; ++i) {
+		if (lists[i] && !json_is_array(lists[i]))
+			die("config error: filter prefixes must be an array");
+
+		json_array_foreach(lists[i], idx, p) {
+			const char *s = json_string_value(p);
+
+			if (!s)
+				die("config error: filter prefixes must be strings");
+
+			for (; *s; ++s) {
+				if (!filter->classes[(uint8_t)*s])
+					filter->classes[(uint8_t)*s] = filter->class_count++;
+			}
+		}
+	}
+
+	filter->state_alloc = 16;
+	filter->next = xmalloc(filter->state_alloc * filter->class_count * sizeof(uint32_t));
+	filter->verdicts = xmalloc(filter->state_alloc);
+
+	new_state(filter); /* dead */
+	new_state(filter); /* start */
+
+	/* deny goes last, so it wins if a prefix is in both lists */
+	json_array_foreach(allow, idx, p)
+		add_prefix(filter, json_string_value(p), BRUBECK_FILTER_ALLOW);
+	json_array_foreach(deny, idx, p)
+		add_prefix(filter, json_string_value(p), BRUBECK_FILTER_DENY);
+
+	filter->fallback = (allow && json_array_size(allow) > 0) ?
+		BRUBECK_FILTER_DENY : BRUBECK_FILTER_ALLOW;
+}
+
+static void
+compile_renames(struct brubeck_filter *filter, json_t *renames)
+{
+	size_t idx;
+	json_t *r;
+
+	if (!json_is_array(renames))
+		die("config error: filter renames must be an array");
+
+	filter->rename_count = json_array_size(renames);
+	filter->renames = xcalloc(filter->rename_count, sizeof(struct brubeck_filter_rename));
+
+	json_array_foreach(renames, idx, r) {
+		struct brubeck_filter_rename *rename = &filter->renames[idx];
+		int err;
+
+		json_unpack_or_die(r, "{s:s, s:s}",
+			"match", &rename->match,
+			"replace", &rename->replace);
+
+		err = regcomp(&rename->regex, rename->match, REG_EXTENDED);
+		if (err != 0) {
+			char error[256];
+			regerror(err, &rename->regex, error, sizeof(error));
+			die("config error: invalid filter regex '%s' (%s)", rename->match, error);
+		}
+	}
+}
+
+struct brubeck_filter *
+brubeck_filter_new(json_t *settings)
+{
+	struct brubeck_filter *filter = xcalloc(1, sizeof(struct brubeck_filter));
+	json_t *allow = NULL, *deny = NULL, *renames = NULL;
+
+	json_unpack_or_die(settings, "{s?:o, s?:o, s?:o, s?:b}",
+		"allow", &allow,
+		"deny", &deny,
+		"rename", &renames,
+		"sanitize", &filter->sanitize);
+
+	compile_prefixes(filter, allow, deny);
+	if (renames)
+		compile_renames(filter, renames);
+
+	log_splunk("event=load_filter states=%u classes=%u renames=%zu sanitize=%d",
+		filter->state_count, filter->class_count, filter->rename_count, filter->sanitize);
+
+	return filter;
+}
+
+static uint8_t
+match_prefixes(const struct brubeck_filter *filter, const char *key, size_t key_len)
+{
+	uint8_t verdict = filter->verdicts[1];
+	uint32_t state = 1;
+	size_t i;
+
+	for (i = 0; i < key_len && state != 0; ++i) {
+		state = filter->next[state * filter->class_count + filter->classes[(uint8_t)key[i]]];
+		if (filter->verdicts[state])
+			verdict = filter->verdicts[state];
+	}
+
+	return verdict ? verdict - 1 : filter->fallback;
+}
+
+/*
+ * Apply a rename rule to the NUL-terminated `key`. Returns 1 and the
+ * length of the result in `out_len`, 0 if the rule doesn't match, or
+ * -1 if the result doesn't fit.
+ */
+static int
+rename_key(const struct brubeck_filter_rename *rename,
+	char *out, size_t size, size_t *out_len, const char *key)
+{
+	regmatch_t groups[BRUBECK_FILTER_MAX_GROUPS];
+	const char *r;
+	size_t len = 0;
+
+	if (regexec(&rename->regex, key, BRUBECK_FILTER_MAX_GROUPS, groups, 0) != 0)
+		return 0;
+
+#define APPEND(src, n) do { \
+	if (len + (n) >= size) return -1; \
+	memcpy(out + len, (src), (n)); \
+	len += (n); \
+} while (0)
+
+	APPEND(key, (size_t)groups[0].rm_so);
+
+	for (r = rename->replace; *r; ++r) {
+		if (r[0] == '\\' && r[1] >= '0' && r[1] <= '9') {
+			const regmatch_t *g = &groups[r[1] - '0'];
+
+			if (g->rm_so >= 0)
+				APPEND(key + g->rm_so, (size_t)(g->rm_eo - g->rm_so));
+			r++;
+		} else {
+			APPEND(r, 1);
+		}
+	}
+
+	APPEND(key + groups[0].rm_eo, strlen(key + groups[0].rm_eo));
+
+#undef APPEND
+
+	out[len] = '\0';
+	*out_len = len;
+	return 1;
+}
+
+static inline int
+sanitized(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-';
+}
+
+/*
+ * Decide what happens to a new key. When it's renamed, the new key is
+ * written to `out` (NUL-terminated) and its length to `out_len`. Only
+ * the name of a tagged series is rewritten; its tags are carried over.
+ * Keys whose new name would be empty, or that don't fit in `out` when
+ * there are rules to rewrite them with, are denied.
+ */
+int
+brubeck_filter_apply(const struct brubeck_filter *filter,
+	char *out, size_t size, size_t *out_len, const char *key, size_t key_len)
+{
+	const size_t name_len = strnlen(key, key_len);
+	const size_t tags_len = key_len - name_len;
+	char tmp[BRUBECK_FILTER_KEY_MAX];
+	size_t i, len = name_len;
+
+	if (match_prefixes(filter, key, name_len) == BRUBECK_FILTER_DENY)
+		return BRUBECK_FILTER_DENY;
+
+	if (filter->rename_count == 0 && !filter->sanitize)
+		return BRUBECK_FILTER_ALLOW;
+
+	if (key_len >= size)
+		return BRUBECK_FILTER_DENY;
+
+	memcpy(out, key, name_len);
+	out[name_len] = '\0';
+
+	for (i = 0; i < filter->rename_count; ++i) {
+		int r = rename_key(&filter->renames[i], tmp,
+			size < sizeof(tmp) ? size : sizeof(tmp), &len, out);
+
+		if (r < 0)
+			return BRUBECK_FILTER_DENY;
+
+		if (r > 0)
+			memcpy(out, tmp, len + 1);
+	}
+
+	if (filter->sanitize) {
+		for (i = 0; i < len; ++i) {
+			if (!sanitized(out[i]))
+				out[i] = '_';
+		}
+	}
+
+	if (len == 0 || len + tags_len >= size)
+		return BRUBECK_FILTER_DENY;
+
+	if (len == name_len && !memcmp(out, key, len))
+		return BRUBECK_FILTER_ALLOW;
+
+	/* the NUL after the name and the tag ids */
+	memcpy(out + len, key + name_len, tags_len);
+	out[len + tags_len] = '\0';
+
+	*out_len = len + tags_len;
+	return BRUBECK_FILTER_RENAME;
+}
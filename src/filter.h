@@ -0,0 +1,64 @@
+#ifndef __BRUBECK_FILTER_H__
+#define __BRUBECK_FILTER_H__
+
+#include <regex.h>
+
+/*
+ * Filtering and rewriting of incoming keys. Keys are filtered the first
+ * time they are seen, before they take up a slot in the metrics table:
+ *
+ *	1. the key is checked against the `allow` and `deny` prefixes,
+ *	   compiled together into a single DFA; the longest matching prefix
+ *	   decides, and when there's an allow list, keys that match no
+ *	   prefix are denied
+ *	2. the `rename` rules (POSIX extended regexes, with `\0`-`\9` in
+ *	   the replacement) are applied in order
+ *	3. with `sanitize`, bytes other than `[A-Za-z0-9._-]` become `_`
+ *
+ * All three only look at the name of a tagged series; a renamed series
+ * keeps its tags. Keys longer than BRUBECK_FILTER_KEY_MAX can't be
+ * rewritten, so they are denied when there are rules to rewrite with.
+ */
+#define BRUBECK_FILTER_KEY_MAX 1024
+#define BRUBECK_FILTER_MAX_GROUPS 10
+
+enum brubeck_filter_verdict {
+	BRUBECK_FILTER_ALLOW,
+	BRUBECK_FILTER_DENY,
+	BRUBECK_FILTER_RENAME
+};
+
+struct brubeck_filter_rename {
+	const char *match;
+	const char *replace;
+	regex_t regex;
+};
+
+struct brubeck_filter {
+	/* input class of every byte; class 0 (bytes that appear in
+	 * no prefix) always leads to the dead state */
+	uint8_t classes[256];
+	uint32_t class_count;
+
+	/* state 0 is dead and state 1 is the start. `next` is the
+	 * transition table, with `class_count` entries per state;
+	 * `verdicts` holds 1 + the verdict of the states that end
+	 * a prefix, and 0 for the rest */
+	uint32_t *next;
+	uint8_t *verdicts;
+	uint32_t state_count;
+	uint32_t state_alloc;
+
+	/* verdict for the keys that match no prefix */
+	uint8_t fallback;
+	int sanitize;
+
+	size_t rename_count;
+	struct brubeck_filter_rename *renames;
+};
+
+struct brubeck_filter *brubeck_filter_new(json_t *settings);
+int brubeck_filter_apply(const struct brubeck_filter *filter,
+	char *out, size_t size, size_t *out_len, const char *key, size_t key_len);
+
+#endif
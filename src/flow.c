@@ -0,0 +1,321 @@
+#include "brubeck.h"
+
+__thread struct brubeck_flow_sketch *brubeck_flow_local;
+
+/* Shared by the threads past BRUBECK_FLOW_MAX_WORKERS, which don't
+ * get a sketch; only its countdown is ever used */
+static struct brubeck_flow_sketch flow_untracked;
+
+#define FLOW_INDEX_MASK (BRUBECK_FLOW_INDEX_SIZE - 1)
+
+static inline size_t flow_hash(const struct brubeck_metric *metric)
+{
+	uint64_t h = (uint64_t)(uintptr_t)metric * 0x9E3779B97F4A7C15ULL;
+	return (size_t)(h >> 40) & FLOW_INDEX_MASK;
+}
+
+static inline void flow_swap(struct brubeck_flow_sketch *sketch, size_t a, size_t b)
+{
+	struct brubeck_flow_entry tmp = sketch->heap[a];
+
+	sketch->heap[a] = sketch->heap[b];
+	sketch->heap[b] = tmp;
+
+	sketch->index[sketch->heap[a].slot] = (int16_t)a;
+	sketch->index[sketch->heap[b].slot] = (int16_t)b;
+}
+
+static void flow_sift_down(struct brubeck_flow_sketch *sketch, size_t pos)
+{
+	for (;;) {
+		size_t left = 2 * pos + 1, right = left + 1, min = pos;
+
+		if (left < sketch->len && sketch->heap[left].count < sketch->heap[min].count)
+			min = left;
+		if (right < sketch->len && sketch->heap[right].count < sketch->heap[min].count)
+			min = right;
+		if (min == pos)
+			return;
+
+		flow_swap(sketch, pos, min);
+		pos = min;
+	}
+}
+
+static void flow_sift_up(struct brubeck_flow_sketch *sketch, size_t pos)
+{
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+
+		if (sketch->heap[parent].count <= sketch->heap[pos].count)
+			return;
+
+		flow_swap(sketch, pos, parent);
+		pos = parent;
+	}
+}
+
+/*
+ * Linear probing: returns the slot holding the metric, or the empty
+ * slot where it would be inserted.
+ */
+static size_t flow_index_find(struct brubeck_flow_sketch *sketch, struct brubeck_metric *metric)
+{
+	size_t slot = flow_hash(metric);
+
+	while (sketch->index[slot] >= 0 && sketch->heap[sketch->index[slot]].metric != metric)
+		slot = (slot + 1) & FLOW_INDEX_MASK;
+
+	return slot;
+}
+
+/* Backward-shift deletion, so probe sequences stay unbroken */
+static void flow_index_remove(struct brubeck_flow_sketch *sketch, size_t slot)
+{
+	size_t hole = slot, next = slot;
+
+	for (;;) {
+		size_t home;
+
+		next = (next + 1) & FLOW_INDEX_MASK;
+		if (sketch->index[next] < 0)
+			break;
+
+		home = flow_hash(sketch->heap[sketch->index[next]].metric);
+
+		/* entries whose home is cyclically in (hole, next] stay put */
+		if ((hole <= next) ? (hole < home && home <= next) : (hole < home || home <= next))
+			continue;
+
+		sketch->index[hole] = sketch->index[next];
+		sketch->heap[sketch->index[hole]].slot = (uint16_t)hole;
+		hole = next;
+	}
+
+	sketch->index[hole] = -1;
+}
+
+/*
+ * Space-Saving update: known metrics get their count bumped; new ones
+ * take the place of the least counted entry, inheriting its count as
+ * their (over)estimation error.
+ */
+static void flow_sketch_add(struct brubeck_flow_sketch *sketch,
+	struct brubeck_metric *metric, uint64_t weight)
+{
+	size_t slot = flow_index_find(sketch, metric);
+	struct brubeck_flow_entry *entry;
+
+	if (sketch->index[slot] >= 0) {
+		size_t pos = sketch->index[slot];
+		sketch->heap[pos].count += weight;
+		flow_sift_down(sketch, pos);
+		return;
+	}
+
+	if (sketch->len < BRUBECK_FLOW_SKETCH_SIZE) {
+		size_t pos = sketch->len++;
+
+		entry = &sketch->heap[pos];
+		entry->metric = metric;
+		entry->count = weight;
+		entry->error = 0;
+		entry->slot = (uint16_t)slot;
+		sketch->index[slot] = (int16_t)pos;
+
+		flow_sift_up(sketch, pos);
+		return;
+	}
+
+	entry = &sketch->heap[0];
+	flow_index_remove(sketch, entry->slot);
+
+	/* the removal may have shifted our probe sequence */
+	slot = flow_index_find(sketch, metric);
+
+	entry->metric = metric;
+	entry->error = entry->count;
+	entry->count += weight;
+	entry->slot = (uint16_t)slot;
+	sketch->index[slot] = 0;
+
+	flow_sift_down(sketch, 0);
+}
+
+static inline uint64_t flow_decayed(uint64_t count, uint32_t halvings)
+{
+	return (halvings < 64) ? (count >> halvings) : 0;
+}
+
+/*
+ * Halve every count once per decay epoch the sketch has missed. This
+ * keeps the heap ordered, and entries that decay to zero are the
+ * first ones to be replaced.
+ */
+static void flow_sketch_decay(struct brubeck_flow_sketch *sketch, uint32_t epoch)
+{
+	const uint32_t halvings = epoch - sketch->epoch;
+	size_t i;
+
+	if (likely(halvings == 0))
+		return;
+
+	for (i = 0; i < sketch->len; ++i) {
+		sketch->heap[i].count = flow_decayed(sketch->heap[i].count, halvings);
+		sketch->heap[i].error = flow_decayed(sketch->heap[i].error, halvings);
+	}
+
+	sketch->epoch = epoch;
+}
+
+static inline uint32_t flow_rand(struct brubeck_flow_sketch *sketch)
+{
+	uint32_t x = sketch->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (sketch->rng = x);
+}
+
+static struct brubeck_flow_sketch *flow_sketch_new(struct brubeck_flows *flows)
+{
+	struct brubeck_flow_sketch *sketch = NULL;
+
+	pthread_mutex_lock(&flows->lock);
+	if (flows->count < BRUBECK_FLOW_MAX_WORKERS) {
+		sketch = xcalloc(1, sizeof(struct brubeck_flow_sketch));
+		memset(sketch->index, 0xff, sizeof(sketch->index));
+		sketch->rng = 0x9E3779B9u * (uint32_t)(flows->count + 1);
+		sketch->epoch = flows->epoch;
+
+		brubeck_barrier();
+		flows->sketches[flows->count++] = sketch;
+	}
+	pthread_mutex_unlock(&flows->lock);
+
+	if (!sketch)
+		log_splunk("event=flow_untracked_worker max=%d", BRUBECK_FLOW_MAX_WORKERS);
+
+	return sketch;
+}
+
+/*
+ * Slow path of brubeck_flow_record: the countdown to the next sampled
+ * record has expired. The gaps between samples are random (averaging
+ * `sample_rate`) so periodic senders cannot alias with the sampling,
+ * and every sample counts for `sample_rate` records.
+ */
+void brubeck_flow__sample(struct brubeck_flows *flows, struct brubeck_metric *metric)
+{
+	struct brubeck_flow_sketch *sketch = brubeck_flow_local;
+	const uint32_t rate = flows->sample_rate;
+
+	if (unlikely(sketch == NULL)) {
+		sketch = flow_sketch_new(flows);
+		if (!sketch) {
+			brubeck_flow_local = &flow_untracked;
+			flow_untracked.countdown = UINT32_MAX;
+			return;
+		}
+		brubeck_flow_local = sketch;
+	}
+
+	if (unlikely(sketch == &flow_untracked)) {
+		sketch->countdown = UINT32_MAX;
+		return;
+	}
+
+	flow_sketch_decay(sketch, flows->epoch);
+	flow_sketch_add(sketch, metric, rate);
+	sketch->countdown = (rate > 1) ? 1 + flow_rand(sketch) % (2 * rate - 1) : 1;
+}
+
+void brubeck_flows_init(struct brubeck_flows *flows, int sample_rate)
+{
+	memset(flows, 0x0, sizeof(struct brubeck_flows));
+	pthread_mutex_init(&flows->lock, NULL);
+	flows->sample_rate = (sample_rate > 0) ? (uint32_t)sample_rate : BRUBECK_FLOW_SAMPLE_RATE;
+}
+
+/* Called once per second by the server */
+void brubeck_flows_tick(struct brubeck_flows *flows)
+{
+	if (++flows->ticks < BRUBECK_FLOW_DECAY_INTERVAL)
+		return;
+
+	flows->ticks = 0;
+	brubeck_atomic_inc(&flows->epoch);
+}
+
+static int flow_top_metric_cmp(const void *a, const void *b)
+{
+	const struct brubeck_flow_top *ta = a, *tb = b;
+	if (ta->metric < tb->metric) return -1;
+	if (ta->metric > tb->metric) return 1;
+	return 0;
+}
+
+static int flow_top_count_cmp(const void *a, const void *b)
+{
+	const struct brubeck_flow_top *ta = a, *tb = b;
+	if (ta->count < tb->count) return 1;
+	if (ta->count > tb->count) return -1;
+	return 0;
+}
+
+/*
+ * Merge the sketches of all the workers and return the `max` metrics
+ * with the highest estimated record counts. The sketches are read
+ * while the workers keep updating them, so the result is approximate
+ * (as it would be anyway); the cost only depends on the number of
+ * workers, not on the number of metrics.
+ */
+size_t brubeck_flows_top(struct brubeck_flows *flows, struct brubeck_flow_top *top, size_t max)
+{
+	struct brubeck_flow_top *all;
+	size_t workers, i, j, n = 0, merged = 0;
+	uint32_t epoch;
+
+	workers = flows->count;
+	epoch = flows->epoch;
+	brubeck_barrier();
+
+	all = xmalloc(workers * BRUBECK_FLOW_SKETCH_SIZE * sizeof(struct brubeck_flow_top) + 1);
+
+	for (i = 0; i < workers; ++i) {
+		struct brubeck_flow_sketch *sketch = flows->sketches[i];
+		size_t len = sketch->len;
+
+		/* idle workers haven't decayed their sketches yet */
+		uint32_t halvings = epoch - sketch->epoch;
+
+		for (j = 0; j < len; ++j) {
+			all[n].metric = sketch->heap[j].metric;
+			all[n].count = flow_decayed(sketch->heap[j].count, halvings);
+			all[n].error = flow_decayed(sketch->heap[j].error, halvings);
+			if (all[n].metric)
+				n++;
+		}
+	}
+
+	/* the same metric may be tracked by several workers */
+	qsort(all, n, sizeof(struct brubeck_flow_top), &flow_top_metric_cmp);
+
+	for (i = 0; i < n; ++i) {
+		if (merged > 0 && all[merged - 1].metric == all[i].metric) {
+			all[merged - 1].count += all[i].count;
+			all[merged - 1].error += all[i].error;
+		} else {
+			all[merged++] = all[i];
+		}
+	}
+
+	qsort(all, merged, sizeof(struct brubeck_flow_top), &flow_top_count_cmp);
+
+	if (merged > max)
+		merged = max;
+
+	memcpy(top, all, merged * sizeof(struct brubeck_flow_top));
+	free(all);
+	return merged;
+}
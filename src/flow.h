@@ -0,0 +1,72 @@
+#ifndef __BRUBECK_FLOW_H__
+#define __BRUBECK_FLOW_H__
+
+/*
+ * Heavy hitter tracking for the metrics being ingested. Every worker
+ * thread keeps its own Space-Saving sketch of the metrics it has seen
+ * most often, fed by a random sample of 1 in `sample_rate` records;
+ * the sketches are merged when they are queried.
+ *
+ * Counts are halved every BRUBECK_FLOW_DECAY_INTERVAL seconds, so the
+ * sketches follow the current traffic instead of everything since
+ * startup. Each worker decays its own sketch the next time it samples
+ * a record. Readers scale down the counts of the sketches that are
+ * still behind.
+ */
+#define BRUBECK_FLOW_SKETCH_SIZE 256
+#define BRUBECK_FLOW_INDEX_SIZE (2 * BRUBECK_FLOW_SKETCH_SIZE)
+#define BRUBECK_FLOW_MAX_WORKERS 64
+#define BRUBECK_FLOW_SAMPLE_RATE 16
+#define BRUBECK_FLOW_DECAY_INTERVAL 60
+
+struct brubeck_flow_entry {
+	struct brubeck_metric *metric;
+	uint64_t count;
+	uint64_t error;
+	uint16_t slot;
+};
+
+struct brubeck_flow_sketch {
+	uint32_t countdown;
+	uint32_t rng;
+	uint32_t epoch;
+	size_t len;
+
+	/* min-heap on count; index maps metrics to heap positions */
+	struct brubeck_flow_entry heap[BRUBECK_FLOW_SKETCH_SIZE];
+	int16_t index[BRUBECK_FLOW_INDEX_SIZE];
+};
+
+struct brubeck_flows {
+	pthread_mutex_t lock;
+	uint32_t sample_rate;
+	uint32_t epoch;
+	uint32_t ticks;
+	size_t count;
+	struct brubeck_flow_sketch *sketches[BRUBECK_FLOW_MAX_WORKERS];
+};
+
+struct brubeck_flow_top {
+	struct brubeck_metric *metric;
+	uint64_t count;
+	uint64_t error;
+};
+
+extern __thread struct brubeck_flow_sketch *brubeck_flow_local;
+
+void brubeck_flows_init(struct brubeck_flows *flows, int sample_rate);
+void brubeck_flow__sample(struct brubeck_flows *flows, struct brubeck_metric *metric);
+void brubeck_flows_tick(struct brubeck_flows *flows);
+size_t brubeck_flows_top(struct brubeck_flows *flows, struct brubeck_flow_top *top, size_t max);
+
+static inline void brubeck_flow_record(struct brubeck_flows *flows, struct brubeck_metric *metric)
+{
+	struct brubeck_flow_sketch *sketch = brubeck_flow_local;
+
+	if (likely(sketch != NULL) && likely(--sketch->countdown > 0))
+		return;
+
+	brubeck_flow__sample(flows, metric);
+}
+
+#endif
@@ -0,0 +1,300 @@
+#include <sys/time.h>
+#include "brubeck.h"
+
+#define HANDOFF_MAGIC 0x46464f48 /* "HOFF" */
+
+struct handoff_msg {
+	uint32_t magic;
+	uint32_t pid;
+	uint32_t count;
+	uint32_t last;
+};
+
+static void handoff_set_timeout(int sock, int seconds)
+{
+	struct timeval tv;
+
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int handoff_socket(const char *path, struct sockaddr_un *addr)
+{
+	int sock;
+
+	if (strlen(path) >= sizeof(addr->sun_path))
+		die("config error: handoff path is too long");
+
+	memset(addr, 0x0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sock < 0)
+		die("failed to create handoff socket");
+
+	return sock;
+}
+
+static int handoff_sendmsg(int sock, const int *fds, uint32_t count, uint32_t last)
+{
+	char control[CMSG_SPACE(BRUBECK_HANDOFF_BATCH * sizeof(int))];
+	struct handoff_msg msg;
+	struct msghdr hdr;
+	struct iovec iov;
+
+	msg.magic = HANDOFF_MAGIC;
+	msg.pid = (uint32_t)getpid();
+	msg.count = count;
+	msg.last = last;
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+
+	memset(&hdr, 0x0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	if (count) {
+		struct cmsghdr *cmsg;
+
+		memset(control, 0x0, sizeof(control));
+		hdr.msg_control = control;
+		hdr.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	}
+
+	return (sendmsg(sock, &hdr, MSG_NOSIGNAL) == sizeof(msg)) ? 0 : -1;
+}
+
+/*
+ * Receive a message, appending any file descriptors that come with
+ * it to `handoff->fds`. Returns the message's `last` flag, or -1.
+ */
+static int handoff_recvmsg(struct brubeck_handoff *handoff, int sock, struct handoff_msg *msg)
+{
+	char control[CMSG_SPACE(BRUBECK_HANDOFF_BATCH * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr hdr;
+	struct iovec iov;
+	ssize_t n;
+
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(struct handoff_msg);
+
+	memset(&hdr, 0x0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	n = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+
+	for (cmsg = CMSG_FIRSTHDR(&hdr); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		size_t count, i;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		handoff->fds = realloc(handoff->fds, (handoff->count + count) * sizeof(int));
+		if (!handoff->fds)
+			die("failed to allocate handoff sockets");
+
+		for (i = 0; i < count; ++i)
+			memcpy(&handoff->fds[handoff->count++],
+				CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	}
+
+	if (n != sizeof(struct handoff_msg) || msg->magic != HANDOFF_MAGIC ||
+		(hdr.msg_flags & MSG_CTRUNC))
+		return -1;
+
+	return msg->last ? 1 : 0;
+}
+
+/*
+ * Take over the sockets of the instance listening on the handoff
+ * path, if there's one. That instance stops reading from them, does
+ * its final flush (and saves its cache), and hands them over; it's
+ * fine if nobody is listening, we just start cold.
+ */
+void brubeck_handoff_receive(struct brubeck_handoff *handoff)
+{
+	struct sockaddr_un addr;
+	struct handoff_msg msg;
+	int sock, last = 0;
+
+	handoff->listen_fd = -1;
+
+	if (!handoff->path)
+		return;
+
+	sock = handoff_socket(handoff->path, &addr);
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			log_splunk_errno("event=handoff_failed path=%s", handoff->path);
+		close(sock);
+		return;
+	}
+
+	handoff_set_timeout(sock, BRUBECK_HANDOFF_TIMEOUT);
+
+	if (handoff_sendmsg(sock, NULL, 0, 1) < 0) {
+		log_splunk_errno("event=handoff_failed path=%s", handoff->path);
+		close(sock);
+		return;
+	}
+
+	while (last == 0)
+		last = handoff_recvmsg(handoff, sock, &msg);
+
+	close(sock);
+
+	if (last < 0) {
+		log_splunk_errno("event=handoff_failed path=%s sockets=%zu",
+			handoff->path, handoff->count);
+		return;
+	}
+
+	log_splunk("event=handoff_received from=%d sockets=%zu",
+		(int)msg.pid, handoff->count);
+}
+
+/*
+ * Claim a received socket bound to the given address, if any.
+ */
+int brubeck_handoff_take(struct brubeck_handoff *handoff, const struct sockaddr_in *addr)
+{
+	size_t i;
+
+	for (i = 0; i < handoff->count; ++i) {
+		struct sockaddr_in bound;
+		socklen_t len = sizeof(bound);
+		int fd = handoff->fds[i];
+
+		if (fd < 0 || getsockname(fd, (struct sockaddr *)&bound, &len) < 0)
+			continue;
+
+		if (bound.sin_family == AF_INET &&
+			bound.sin_port == addr->sin_port &&
+			bound.sin_addr.s_addr == addr->sin_addr.s_addr) {
+			handoff->fds[i] = -1;
+			return fd;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Start listening for the next instance. Called once all the samplers
+ * are running: sockets inherited from the previous instance that no
+ * sampler has claimed (because of a config change) are closed here.
+ */
+void brubeck_handoff_listen(struct brubeck_handoff *handoff)
+{
+	struct sockaddr_un addr;
+	size_t i, unclaimed = 0;
+
+	for (i = 0; i < handoff->count; ++i) {
+		if (handoff->fds[i] >= 0) {
+			close(handoff->fds[i]);
+			unclaimed++;
+		}
+	}
+
+	if (unclaimed)
+		log_splunk("event=handoff_unclaimed sockets=%zu", unclaimed);
+
+	free(handoff->fds);
+	handoff->fds = NULL;
+	handoff->count = 0;
+
+	if (!handoff->path)
+		return;
+
+	handoff->listen_fd = handoff_socket(handoff->path, &addr);
+	unlink(handoff->path);
+
+	if (bind(handoff->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(handoff->listen_fd, 1) < 0)
+		die("failed to listen on handoff socket %s", handoff->path);
+
+	sock_setnonblock(handoff->listen_fd);
+	log_splunk("event=handoff_listen path=%s", handoff->path);
+}
+
+/*
+ * Accept a connection from a new instance. Returns the client socket
+ * once it has sent a valid handoff request, or -1.
+ */
+int brubeck_handoff_accept(struct brubeck_handoff *handoff)
+{
+	struct handoff_msg msg;
+	int client;
+
+	client = accept(handoff->listen_fd, NULL, NULL);
+	if (client < 0)
+		return -1;
+
+	handoff_set_timeout(client, 1);
+
+	if (recv(client, &msg, sizeof(msg), 0) != sizeof(msg) ||
+		msg.magic != HANDOFF_MAGIC) {
+		log_splunk("event=handoff_invalid_request");
+		close(client);
+		return -1;
+	}
+
+	log_splunk("event=handoff_request from=%d", (int)msg.pid);
+	return client;
+}
+
+/*
+ * Send all the sampler sockets to the new instance, in batches.
+ */
+int brubeck_handoff_send(struct brubeck_server *server, int client)
+{
+	int fds[BRUBECK_HANDOFF_BATCH];
+	uint32_t count = 0, total = 0;
+	int i, ret = 0;
+
+	handoff_set_timeout(client, BRUBECK_HANDOFF_TIMEOUT);
+
+	for (i = 0; i < server->active_samplers && ret == 0; ++i) {
+		struct brubeck_sampler *sampler = server->samplers[i];
+		unsigned int j;
+
+		for (j = 0; j < sampler->socket_count && ret == 0; ++j) {
+			fds[count++] = sampler->sockets[j];
+
+			if (count == BRUBECK_HANDOFF_BATCH) {
+				ret = handoff_sendmsg(client, fds, count, 0);
+				total += count;
+				count = 0;
+			}
+		}
+	}
+
+	if (ret == 0)
+		ret = handoff_sendmsg(client, fds, count, 1);
+	total += count;
+
+	if (ret < 0) {
+		log_splunk_errno("event=handoff_failed sockets=%u", total);
+	} else {
+		log_splunk("event=handoff_sent sockets=%u", total);
+	}
+
+	close(client);
+	return ret;
+}
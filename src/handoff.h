@@ -0,0 +1,29 @@
+#ifndef __BRUBECK_HANDOFF_H__
+#define __BRUBECK_HANDOFF_H__
+
+/*
+ * Zero-downtime restarts. A running instance listens on a Unix
+ * socket; a new instance connects to it on startup and receives all
+ * of its sampler sockets (with SCM_RIGHTS), so packets that arrive
+ * during the restart queue up in the kernel instead of being dropped.
+ */
+#define BRUBECK_HANDOFF_BATCH 64
+#define BRUBECK_HANDOFF_TIMEOUT 30 /* seconds */
+
+struct brubeck_handoff {
+	const char *path;
+	int listen_fd;
+
+	/* sockets received from the previous instance, and not yet
+	 * claimed by a sampler; -1 once taken */
+	int *fds;
+	size_t count;
+};
+
+void brubeck_handoff_receive(struct brubeck_handoff *handoff);
+int brubeck_handoff_take(struct brubeck_handoff *handoff, const struct sockaddr_in *addr);
+void brubeck_handoff_listen(struct brubeck_handoff *handoff);
+int brubeck_handoff_accept(struct brubeck_handoff *handoff);
+int brubeck_handoff_send(struct brubeck_server *server, int client);
+
+#endif
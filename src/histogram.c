@@ -28,6 +28,50 @@ void brubeck_histo_push(struct brubeck_histo *histo, value_t value, value_t samp
 	histo->values[histo->size++] = value;
 }
 
+/*
+ * Push several values at once, growing the buffer a single time.
+ */
+void brubeck_histo_push_n(struct brubeck_histo *histo,
+	const value_t *values, size_t count, value_t sample_freq)
+{
+	size_t needed = histo->size + count;
+
+	histo->count += count * sample_freq;
+
+	if (needed > USHRT_MAX)
+		needed = USHRT_MAX;
+
+	if (needed > histo->alloc) {
+		size_t new_size = histo->alloc ? histo->alloc : HISTO_INIT_SIZE;
+
+		while (new_size < needed)
+			new_size *= 2;
+		if (new_size > USHRT_MAX)
+			new_size = USHRT_MAX;
+
+		histo->alloc = (uint16_t)new_size;
+		histo->values = xrealloc(histo->values, histo->alloc * sizeof(value_t));
+	}
+
+	count = needed - histo->size;
+	memcpy(histo->values + histo->size, values, count * sizeof(value_t));
+	histo->size = (uint16_t)needed;
+}
+
+/*
+ * Add all the values of another histogram, keeping their sampled
+ * count; like any other push, the values past capacity are dropped.
+ */
+void brubeck_histo_merge(struct brubeck_histo *dst, const struct brubeck_histo *src)
+{
+	uint32_t count = dst->count + src->count;
+
+	if (src->size > 0)
+		brubeck_histo_push_n(dst, src->values, src->size, 1.0);
+
+	dst->count = count;
+}
+
 static inline value_t histo_percentile(struct brubeck_histo *histo, float rank)
 {
 	size_t irank = floor((rank * histo->size) + 0.5f);
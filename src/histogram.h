@@ -21,6 +21,9 @@ struct brubeck_histo_sample {
 enum { PC_75, PC_95, PC_98, PC_99, PC_999 };
 
 void brubeck_histo_push(struct brubeck_histo *histo, value_t value, value_t sample_rate);
+void brubeck_histo_push_n(struct brubeck_histo *histo,
+	const value_t *values, size_t count, value_t sample_rate);
+void brubeck_histo_merge(struct brubeck_histo *dst, const struct brubeck_histo *src);
 void brubeck_histo_sample(
 		struct brubeck_histo_sample *sample,
 		struct brubeck_histo *histo);
@@ -0,0 +1,183 @@
+#include "brubeck.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HLL_INIT_SIZE 16
+#define HLL_INDEX(entry) ((entry) >> 8)
+#define HLL_RANK(entry) ((uint8_t)((entry) & 0xFF))
+
+static inline uint64_t mix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * HyperLogLog needs all 64 bits of the hash to be well mixed; the
+ * 32-bit CityHash we use for sharding is not enough for large sets.
+ */
+uint64_t brubeck_hll_hash(const char *member, size_t len)
+{
+	uint64_t h = mix64(len);
+	uint64_t k;
+
+	while (len >= 8) {
+		memcpy(&k, member, 8);
+		h = mix64(h ^ k);
+		member += 8;
+		len -= 8;
+	}
+
+	k = 0;
+	memcpy(&k, member, len);
+	return mix64(h ^ k);
+}
+
+static void hll_densify(struct brubeck_hll *hll)
+{
+	uint8_t *registers = xcalloc(BRUBECK_HLL_REGISTERS, 1);
+	uint16_t i;
+
+	for (i = 0; i < hll->len; ++i)
+		registers[HLL_INDEX(hll->as.sparse[i])] = HLL_RANK(hll->as.sparse[i]);
+
+	free(hll->as.sparse);
+	hll->as.registers = registers;
+	hll->dense = true;
+	hll->len = hll->alloc = 0;
+}
+
+static void hll_set(struct brubeck_hll *hll, uint32_t index, uint8_t rank)
+{
+	uint16_t lo = 0, hi;
+
+	if (hll->dense) {
+		if (hll->as.registers[index] < rank)
+			hll->as.registers[index] = rank;
+		return;
+	}
+
+	/* binary search for the register in the sparse list */
+	hi = hll->len;
+	while (lo < hi) {
+		uint16_t mid = (lo + hi) / 2;
+
+		if (HLL_INDEX(hll->as.sparse[mid]) < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < hll->len && HLL_INDEX(hll->as.sparse[lo]) == index) {
+		if (HLL_RANK(hll->as.sparse[lo]) < rank)
+			hll->as.sparse[lo] = (index << 8) | rank;
+		return;
+	}
+
+	if (hll->len == BRUBECK_HLL_SPARSE_MAX) {
+		hll_densify(hll);
+		hll->as.registers[index] = rank;
+		return;
+	}
+
+	if (hll->len == hll->alloc) {
+		hll->alloc = hll->alloc ? hll->alloc * 2 : HLL_INIT_SIZE;
+		hll->as.sparse = xrealloc(hll->as.sparse, hll->alloc * sizeof(uint32_t));
+	}
+
+	memmove(&hll->as.sparse[lo + 1], &hll->as.sparse[lo],
+		(hll->len - lo) * sizeof(uint32_t));
+	hll->as.sparse[lo] = (index << 8) | rank;
+	hll->len++;
+}
+
+void brubeck_hll_add(struct brubeck_hll *hll, uint64_t hash)
+{
+	/* the top bits pick the register; the rank is the position of
+	 * the first set bit in the rest (the sentinel caps it at 51) */
+	const uint32_t index = (uint32_t)(hash >> (64 - BRUBECK_HLL_PRECISION));
+	const uint64_t rest = (hash << BRUBECK_HLL_PRECISION) |
+		(1ULL << (BRUBECK_HLL_PRECISION - 1));
+
+	hll_set(hll, index, (uint8_t)(__builtin_clzll(rest) + 1));
+}
+
+/*
+ * Register-wise maximum of two sets; `dst` becomes the union of both.
+ */
+void brubeck_hll_merge(struct brubeck_hll *dst, const struct brubeck_hll *src)
+{
+	size_t i = 0;
+
+	if (!src->dense) {
+		for (i = 0; i < src->len; ++i)
+			hll_set(dst, HLL_INDEX(src->as.sparse[i]), HLL_RANK(src->as.sparse[i]));
+		return;
+	}
+
+	if (!dst->dense)
+		hll_densify(dst);
+
+#ifdef __SSE2__
+	for (; i < BRUBECK_HLL_REGISTERS; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(dst->as.registers + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src->as.registers + i));
+		_mm_storeu_si128((__m128i *)(dst->as.registers + i), _mm_max_epu8(a, b));
+	}
+#endif
+
+	for (; i < BRUBECK_HLL_REGISTERS; ++i) {
+		if (dst->as.registers[i] < src->as.registers[i])
+			dst->as.registers[i] = src->as.registers[i];
+	}
+}
+
+double brubeck_hll_estimate(const struct brubeck_hll *hll)
+{
+	const double m = (double)BRUBECK_HLL_REGISTERS;
+	const double alpha = 0.7213 / (1.0 + 1.079 / m);
+	double pow2neg[64], sum = 0.0, estimate;
+	size_t i, zeros;
+
+	for (i = 0; i < 64; ++i)
+		pow2neg[i] = 1.0 / (double)(1ULL << i);
+
+	if (hll->dense) {
+		zeros = 0;
+		for (i = 0; i < BRUBECK_HLL_REGISTERS; ++i) {
+			sum += pow2neg[hll->as.registers[i]];
+			zeros += (hll->as.registers[i] == 0);
+		}
+	} else {
+		/* registers missing from the list are zero */
+		zeros = BRUBECK_HLL_REGISTERS - hll->len;
+		sum = (double)zeros;
+		for (i = 0; i < hll->len; ++i)
+			sum += pow2neg[HLL_RANK(hll->as.sparse[i])];
+	}
+
+	estimate = alpha * m * m / sum;
+
+	/* small range correction: linear counting */
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / (double)zeros);
+
+	return estimate;
+}
+
+/* back to an empty sparse set, releasing the registers */
+void brubeck_hll_reset(struct brubeck_hll *hll)
+{
+	if (hll->dense) {
+		free(hll->as.registers);
+		hll->as.sparse = NULL;
+		hll->dense = false;
+		hll->alloc = 0;
+	}
+
+	hll->len = 0;
+}
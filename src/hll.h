@@ -0,0 +1,31 @@
+#ifndef __BRUBECK_HLL_H__
+#define __BRUBECK_HLL_H__
+
+/*
+ * HyperLogLog cardinality estimator for set metrics. Small sets are
+ * kept sparse, as a sorted list of (register, rank) pairs; they are
+ * converted to a full array of registers once the list would take
+ * more than a fraction of it. Either way, the memory per set is
+ * bounded regardless of how many distinct members it sees.
+ */
+#define BRUBECK_HLL_PRECISION 14
+#define BRUBECK_HLL_REGISTERS (1 << BRUBECK_HLL_PRECISION)
+#define BRUBECK_HLL_SPARSE_MAX 512
+
+struct brubeck_hll {
+	union {
+		uint32_t *sparse; /* (register << 8) | rank, sorted */
+		uint8_t *registers;
+	} as;
+	uint16_t len, alloc;
+	bool dense;
+};
+
+void brubeck_hll_add(struct brubeck_hll *hll, uint64_t hash);
+void brubeck_hll_merge(struct brubeck_hll *dst, const struct brubeck_hll *src);
+double brubeck_hll_estimate(const struct brubeck_hll *hll);
+void brubeck_hll_reset(struct brubeck_hll *hll);
+
+uint64_t brubeck_hll_hash(const char *member, size_t len);
+
+#endif
@@ -79,6 +79,39 @@ brubeck_hashtable_insert(brubeck_hashtable_t *ht, const char *key, uint16_t key_
 	return result;
 }
 
+/*
+ * Insert many metrics while taking the write lock only once. The
+ * metrics that were inserted (i.e. whose key wasn't in the table
+ * already) are compacted at the front of the array; returns how
+ * many there are.
+ */
+size_t
+brubeck_hashtable_insert_bulk(brubeck_hashtable_t *ht, struct brubeck_metric **metrics, size_t count)
+{
+	size_t i, inserted = 0;
+
+	pthread_mutex_lock(&ht->write_mutex);
+
+	/* size the table for all the new keys upfront, instead
+	 * of rehashing several times along the way */
+	ck_ht_grow_spmc(&ht->table, 2 * (ck_ht_count(&ht->table) + count));
+
+	for (i = 0; i < count; ++i) {
+		struct brubeck_metric *metric = metrics[i];
+		ck_ht_hash_t h;
+		ck_ht_entry_t entry;
+
+		ck_ht_hash(&h, &ht->table, metric->key, metric->key_len);
+		ck_ht_entry_set(&entry, h, metric->key, metric->key_len, metric);
+
+		if (ck_ht_put_spmc(&ht->table, h, &entry))
+			metrics[inserted++] = metric;
+	}
+
+	pthread_mutex_unlock(&ht->write_mutex);
+	return inserted;
+}
+
 size_t
 brubeck_hashtable_size(brubeck_hashtable_t *ht)
 {
@@ -4,53 +4,30 @@
 #include "microhttpd.h"
 #include "jansson.h"
 
-#ifdef BRUBECK_METRICS_FLOW
-
-static int flow_cmp(const void *a, const void *b)
-{
-	const struct brubeck_metric *ma = *(const struct brubeck_metric **)a;
-	const struct brubeck_metric *mb = *(const struct brubeck_metric **)b;
-	if (ma->flow < mb->flow) return 1;
-	if (ma->flow > mb->flow) return -1;
-	return 0;
-}
+#define FLOW_STATS_TOP 32
 
 static struct MHD_Response *
 flow_stats(struct brubeck_server *server)
 {
-	size_t metric_count, i, topn;
-	struct brubeck_metric **metrics;
+	struct brubeck_flow_top top[FLOW_STATS_TOP];
+	size_t topn, i;
 	json_t *top_metrics_j;
 	char *jsonr;
 
-	metrics = brubeck_hashtable_to_a(server->metrics, &metric_count);
-	qsort(metrics, metric_count, sizeof(struct brubeck_metric *), &flow_cmp);
-
-	topn = (metric_count < 32) ? metric_count : 32;
+	topn = brubeck_flows_top(&server->flows, top, FLOW_STATS_TOP);
 	top_metrics_j = json_object();
 
 	for (i = 0; i < topn; ++i) {
-		struct brubeck_metric *m = metrics[i];
-		json_object_set_new(top_metrics_j, m->key, json_integer(m->flow));
+		json_object_set_new(top_metrics_j, top[i].metric->key,
+			json_integer((json_int_t)top[i].count));
 	}
 
-	free(metrics);
 	jsonr = json_dumps(top_metrics_j, JSON_INDENT(4) | JSON_PRESERVE_ORDER);
 	json_decref(top_metrics_j);
 
 	return MHD_create_response_from_data(strlen(jsonr), jsonr, 1, 0);
 }
 
-#else
-
-static struct MHD_Response *
-flow_stats(struct brubeck_server *server)
-{
-	return NULL;
-}
-
-#endif
-
 static struct brubeck_metric *safe_lookup_metric(struct brubeck_server *server, const char *key)
 {
 	return brubeck_hashtable_find(server->metrics, key, (uint16_t)strlen(key));
@@ -63,7 +40,8 @@ expire_metric(struct brubeck_server *server, const char *url)
 			server, url + strlen("/expire/"));
 
 	if (metric) {
-		metric->expire = BRUBECK_EXPIRE_DISABLED;
+		/* disabled until it gets recorded again */
+		metric->seen = server->expire_epoch - BRUBECK_EXPIRE_EPOCHS;
 		return MHD_create_response_from_data(
 				0, "", 0, 0);
 	}
@@ -74,7 +52,7 @@ static struct MHD_Response *
 send_metric(struct brubeck_server *server, const char *url)
 {
 	static const char *metric_types[] = {
-		"gauge", "meter", "counter", "histogram", "timer", "internal"
+		"gauge", "meter", "counter", "histogram", "timer", "set", "internal"
 	};
 	static const char *expire_status[] = {
 		"disabled", "inactive", "active"
@@ -92,7 +70,7 @@ send_metric(struct brubeck_server *server, const char *url)
 #else
 			"shard", 0,
 #endif
-			"expire", expire_status[metric->expire]
+			"expire", expire_status[brubeck_metric_expire(metric, server->expire_epoch)]
 		);
 
 		char *jsonr = json_dumps(mj, JSON_INDENT(4) | JSON_PRESERVE_ORDER);
@@ -120,16 +98,50 @@ send_stats(struct brubeck_server *brubeck)
 			struct brubeck_carbon *carbon = (struct brubeck_carbon *)backend;
 			struct sockaddr_in *address = &carbon->out_sockaddr;
 			char addr[INET_ADDRSTRLEN];
-
-			json_array_append_new(backends,
-				json_pack("{s:s, s:i, s:b, s:s, s:i, s:I}",
-						"type", "carbon",
-						"sample_freq", (int)carbon->backend.sample_freq,
-						"connected", (carbon->out_sock >= 0),
-						"address", inet_ntop(AF_INET, &address->sin_addr.s_addr, addr, INET_ADDRSTRLEN),
-						"port", (int)ntohs(address->sin_port),
-						"sent", (json_int_t)carbon->sent
+			json_t *endpoints_j = json_array();
+			size_t j;
+
+			json_t *carbon_j = json_pack("{s:s, s:i, s:b, s:s, s:i, s:I, s:I}",
+					"type", "carbon",
+					"sample_freq", (int)carbon->backend.sample_freq,
+					"connected", (carbon->state == CARBON_CONNECTED),
+					"address", inet_ntop(AF_INET, &address->sin_addr.s_addr, addr, INET_ADDRSTRLEN),
+					"port", (int)ntohs(address->sin_port),
+					"sent", (json_int_t)carbon->sent,
+					"dropped", (json_int_t)carbon->dropped
+			);
+
+			for (j = 0; j < carbon->endpoint_count; ++j) {
+				struct carbon_endpoint *ep = &carbon->endpoints[j];
+				json_array_append_new(endpoints_j, json_pack("{s:s, s:i, s:b, s:b, s:i}",
+					"host", ep->host,
+					"port", ep->port,
+					"resolved", ep->resolved,
+					"active", (j == carbon->endpoint && carbon->state == CARBON_CONNECTED),
+					"failures", (int)ep->failures
+				));
+			}
+			json_object_set_new(carbon_j, "endpoints", endpoints_j);
+
+			if (carbon->spool) {
+				json_object_set_new(carbon_j, "spool", json_pack("{s:I, s:I, s:I, s:I}",
+					"spooled", (json_int_t)carbon->spooled,
+					"replayed", (json_int_t)carbon->replayed,
+					"evicted", (json_int_t)carbon->spool->evicted,
+					"pending", (json_int_t)carbon->spool->header->records
 				));
+			}
+
+			if (carbon->zstream) {
+				json_object_set_new(carbon_j, "compression", json_pack("{s:s, s:i, s:I, s:I}",
+					"type", "gzip",
+					"level", carbon->compression_level,
+					"raw", (json_int_t)carbon->raw_bytes,
+					"compressed", (json_int_t)carbon->compressed_bytes
+				));
+			}
+
+			json_array_append_new(backends, carbon_j);
 		}
 	}
 
@@ -144,6 +156,7 @@ send_stats(struct brubeck_server *brubeck)
 		switch (sampler->type) {
 		case BRUBECK_SAMPLER_STATSD: sampler_name = "statsd"; break;
 		case BRUBECK_SAMPLER_STATSD_SECURE: sampler_name = "statsd_secure"; break;
+		case BRUBECK_SAMPLER_BINARY: sampler_name = "binary"; break;
 		default: assert(0);
 		}
 
@@ -163,11 +176,12 @@ send_stats(struct brubeck_server *brubeck)
 		"replayed", brubeck_stats_sample(brubeck, secure.replayed)
 	);
 
-	stats = json_pack("{s:s, s:i, s:i, s:i, s:o, s:o, s:o}",
+	stats = json_pack("{s:s, s:i, s:i, s:i, s:i, s:o, s:o, s:o}",
 		"version", "brubeck " GIT_SHA,
 		"metrics", brubeck_stats_sample(brubeck, metrics),
 		"errors", brubeck_stats_sample(brubeck, errors),
 		"unique_keys", brubeck_stats_sample(brubeck, unique_keys),
+		"filtered", brubeck_stats_sample(brubeck, filtered),
 		"secure", secure,
 		"backends", backends,
 		"samplers", samplers);
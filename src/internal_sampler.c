@@ -1,64 +1,65 @@
 #include "brubeck.h"
 
-#define INTERNAL_LONGEST_KEY ".secure.from_future"
+static const char * const internal_suffixes[] = {
+	".metrics",
+	".errors",
+	".unique_keys",
+	".secure.failed",
+	".secure.from_future",
+	".secure.delayed",
+	".secure.replayed",
+	".filtered"
+};
 
 void
 brubeck_internal__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opaque)
 {
+	struct brubeck_backend *backend = opaque;
 	struct brubeck_internal_stats *stats = metric->as.other;
+	const struct brubeck_key *keys;
 	uint32_t value;
 
-	char *key = alloca(metric->key_len + strlen(INTERNAL_LONGEST_KEY) + 1);
-	memcpy(key, metric->key, metric->key_len);
+	keys = brubeck_metric_keys(metric, &backend->server->slab,
+		internal_suffixes, sizeof(internal_suffixes) / sizeof(internal_suffixes[0]));
 
-	WITH_SUFFIX(".metrics") {
-		value = brubeck_atomic_swap(&stats->live.metrics, 0);
-		stats->sample.metrics = value;
-		sample(key, (value_t)value, opaque);
-	}
+	value = brubeck_atomic_swap(&stats->live.metrics, 0);
+	stats->sample.metrics = value;
+	sample(keys[0].key, keys[0].len, (value_t)value, opaque);
 
-	WITH_SUFFIX(".errors") {
-		value = brubeck_atomic_swap(&stats->live.errors, 0);
-		stats->sample.errors = value;
-		sample(key, (value_t)value, opaque);
-	}
+	value = brubeck_atomic_swap(&stats->live.errors, 0);
+	stats->sample.errors = value;
+	sample(keys[1].key, keys[1].len, (value_t)value, opaque);
 
-	WITH_SUFFIX(".unique_keys") {
-		value = brubeck_atomic_fetch(&stats->live.unique_keys);
-		stats->sample.unique_keys = value;
-		sample(key, (value_t)value, opaque);
-	}
+	value = brubeck_atomic_fetch(&stats->live.unique_keys);
+	stats->sample.unique_keys = value;
+	sample(keys[2].key, keys[2].len, (value_t)value, opaque);
 
 	/* Secure statsd endpoint */
-	WITH_SUFFIX(".secure.failed") {
-		value = brubeck_atomic_swap(&stats->live.secure.failed, 0);
-		stats->sample.secure.failed = value;
-		sample(key, (value_t)value, opaque);
-	}
-
-	WITH_SUFFIX(".secure.from_future") {
-		value = brubeck_atomic_swap(&stats->live.secure.from_future, 0);
-		stats->sample.secure.from_future = value;
-		sample(key, (value_t)value, opaque);
-	}
-
-	WITH_SUFFIX(".secure.delayed") {
-		value = brubeck_atomic_swap(&stats->live.secure.delayed, 0);
-		stats->sample.secure.delayed = value;
-		sample(key, (value_t)value, opaque);
-	}
-
-	WITH_SUFFIX(".secure.replayed") {
-		value = brubeck_atomic_swap(&stats->live.secure.replayed, 0);
-		stats->sample.secure.replayed = value;
-		sample(key, (value_t)value, opaque);
-	}
+	value = brubeck_atomic_swap(&stats->live.secure.failed, 0);
+	stats->sample.secure.failed = value;
+	sample(keys[3].key, keys[3].len, (value_t)value, opaque);
+
+	value = brubeck_atomic_swap(&stats->live.secure.from_future, 0);
+	stats->sample.secure.from_future = value;
+	sample(keys[4].key, keys[4].len, (value_t)value, opaque);
+
+	value = brubeck_atomic_swap(&stats->live.secure.delayed, 0);
+	stats->sample.secure.delayed = value;
+	sample(keys[5].key, keys[5].len, (value_t)value, opaque);
+
+	value = brubeck_atomic_swap(&stats->live.secure.replayed, 0);
+	stats->sample.secure.replayed = value;
+	sample(keys[6].key, keys[6].len, (value_t)value, opaque);
+
+	value = brubeck_atomic_swap(&stats->live.filtered, 0);
+	stats->sample.filtered = value;
+	sample(keys[7].key, keys[7].len, (value_t)value, opaque);
 
 	/*
 	 * Mark the metric as active so it doesn't get disabled
 	 * by the inactive metrics pruner
 	 */
-	metric->expire = BRUBECK_EXPIRE_ACTIVE;
+	metric->seen = backend->server->expire_epoch;
 }
 
 void brubeck_internal__init(struct brubeck_server *server)
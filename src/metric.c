@@ -1,37 +1,116 @@
 #include "brubeck.h"
 
-static inline struct brubeck_metric *
-new_metric(struct brubeck_server *server, const char *key, size_t key_len, uint8_t type)
+void brubeck_metric_init(struct brubeck_server *server,
+	struct brubeck_metric *metric, const char *key, size_t key_len, uint8_t type)
 {
-	struct brubeck_metric *metric;
-
-	/* slab allocation cannot fail */
-	metric = brubeck_slab_alloc(&server->slab,
-		sizeof(struct brubeck_metric) + key_len + 1);
-
 	memset(metric, 0x0, sizeof(struct brubeck_metric));
 
 	memcpy(metric->key, key, key_len);
 	metric->key[key_len] = '\0';
 	metric->key_len = (uint16_t)key_len;
 
-	metric->expire = BRUBECK_EXPIRE_ACTIVE;
+	metric->seen = server->expire_epoch;
 	metric->type = type;
+
+	/* the key of a tagged series is its name, a NUL byte
+	 * and the ids of its tags; see brubeck_tags_series */
+	if (strnlen(key, key_len) < key_len) {
+		metric->tag_count = (uint8_t)((key_len - strlen(key) - 1) /
+			sizeof(struct brubeck_tag));
+	}
 	pthread_spin_init(&metric->lock, PTHREAD_PROCESS_PRIVATE);
 
-#ifdef BRUBECK_METRICS_FLOW
-	metric->flow = 0;
-#else
-	/* Compile time assert: ensure that the metric struct can be packed
-	 * in a single slab */
-	ct_assert(sizeof(struct brubeck_metric) <= (SLAB_SIZE));
-#endif
+	/* Compile time assert: the small per-metric fields (seen,
+	 * replicas, tag_count) must pack into a single word, so the
+	 * header is one slab for the original fields and one for the
+	 * rendered keys, rollups and aggregates pointers */
+	ct_assert(offsetof(struct brubeck_metric, keys) == 3 * sizeof(void *));
+	ct_assert(sizeof(struct brubeck_metric) <= (2 * SLAB_SIZE));
+}
+
+static inline struct brubeck_metric *
+new_metric(struct brubeck_server *server, const char *key, size_t key_len, uint8_t type)
+{
+	struct brubeck_metric *metric;
+
+	/* slab allocation cannot fail */
+	metric = brubeck_slab_alloc(&server->slab, BRUBECK_METRIC_SIZE(key_len));
+	brubeck_metric_init(server, metric, key, key_len, type);
 
 	return metric;
 }
 
 typedef void (*mt_prototype_record)(struct brubeck_metric *, value_t, value_t, uint8_t);
 typedef void (*mt_prototype_sample)(struct brubeck_metric *, brubeck_sample_cb, void *);
+typedef void (*mt_prototype_record_values)(struct brubeck_metric *, const value_t *, size_t, value_t, uint8_t);
+typedef void (*mt_prototype_sample_rollup)(struct brubeck_metric *, int, brubeck_sample_cb, void *);
+
+/*
+ * Tagged series are rendered in Graphite's tagged format every time
+ * they are sampled, so their text doesn't take up memory in between.
+ */
+static void
+sample_tagged(struct brubeck_metric *metric, const char *suffix,
+	value_t value, brubeck_sample_cb sample, void *opaque)
+{
+	struct brubeck_backend *backend = opaque;
+	char key[BRUBECK_TAGS_RENDER_MAX];
+	size_t len;
+
+	len = brubeck_tags_render(backend->server->tags, key, sizeof(key),
+		metric->key, metric->key_len, metric->tag_count, suffix);
+	if (len > 0)
+		sample(key, len, value, opaque);
+}
+
+static inline void
+sample_value(struct brubeck_metric *metric, const char *suffix,
+	value_t value, brubeck_sample_cb sample, void *opaque)
+{
+	if (unlikely(metric->tag_count != 0))
+		sample_tagged(metric, suffix, value, sample, opaque);
+	else
+		sample(metric->key, metric->key_len, value, opaque);
+}
+
+/*
+ * The rollup state of a metric. Backends with rollups fold every
+ * interval into it, with the metric locked, right before the state
+ * of the interval is reset.
+ */
+static inline struct brubeck_rollup *
+metric_rollups(struct brubeck_metric *metric)
+{
+	if (unlikely(metric->rollups == NULL))
+		metric->rollups = xcalloc(BRUBECK_MAX_ROLLUPS, sizeof(struct brubeck_rollup));
+	return metric->rollups;
+}
+
+static inline void
+rollup_sum(struct brubeck_metric *metric, const struct brubeck_backend *backend, value_t value)
+{
+	struct brubeck_rollup *rollups = metric_rollups(metric);
+	int i;
+
+	for (i = 0; i < backend->rollup_count; ++i)
+		rollups[i].as.value += value;
+}
+
+/* meters and counters: the sum of the intervals in the window */
+static void
+sum__sample_rollup(struct brubeck_metric *metric, int n, brubeck_sample_cb sample, void *opaque)
+{
+	value_t value = 0.0;
+
+	pthread_spin_lock(&metric->lock);
+	if (metric->rollups) {
+		value = metric->rollups[n].as.value;
+		metric->rollups[n].as.value = 0.0;
+	}
+	pthread_spin_unlock(&metric->lock);
+
+	sample_value(metric, "", value, sample, opaque);
+}
 
 
 /*********************************************
@@ -53,6 +132,23 @@ gauge__record(struct brubeck_metric *metric, value_t value, value_t sample_freq,
 	pthread_spin_unlock(&metric->lock);
 }
 
+static void
+gauge__record_values(struct brubeck_metric *metric,
+	const value_t *values, size_t count, value_t sample_freq, uint8_t modifiers)
+{
+	pthread_spin_lock(&metric->lock);
+	{
+		if (modifiers & BRUBECK_MOD_RELATIVE_VALUE) {
+			size_t i;
+			for (i = 0; i < count; ++i)
+				metric->as.gauge.value += values[i];
+		} else {
+			metric->as.gauge.value = values[count - 1];
+		}
+	}
+	pthread_spin_unlock(&metric->lock);
+}
+
 static void
 gauge__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opaque)
 {
@@ -64,7 +160,14 @@ gauge__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opa
 	}
 	pthread_spin_unlock(&metric->lock);
 
-	sample(metric->key, value, opaque);
+	sample_value(metric, "", value, sample, opaque);
+}
+
+/* gauges keep their last value, whatever the resolution */
+static void
+gauge__sample_rollup(struct brubeck_metric *metric, int n, brubeck_sample_cb sample, void *opaque)
+{
+	gauge__sample(metric, sample, opaque);
 }
 
 
@@ -86,19 +189,36 @@ meter__record(struct brubeck_metric *metric, value_t value, value_t sample_freq,
 	pthread_spin_unlock(&metric->lock);
 }
 
+static void
+meter__record_values(struct brubeck_metric *metric,
+	const value_t *values, size_t count, value_t sample_freq, uint8_t modifiers)
+{
+	value_t sum = 0.0;
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		sum += values[i];
+
+	meter__record(metric, sum, sample_freq, modifiers);
+}
+
 static void
 meter__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opaque)
 {
+	struct brubeck_backend *backend = opaque;
 	value_t value;
 
 	pthread_spin_lock(&metric->lock);
 	{
 		value = metric->as.meter.value;
 		metric->as.meter.value = 0.0;
+
+		if (unlikely(backend->rollup_count != 0))
+			rollup_sum(metric, backend, value);
 	}
 	pthread_spin_unlock(&metric->lock);
 
-	sample(metric->key, value, opaque);
+	sample_value(metric, "", value, sample, opaque);
 }
 
 
@@ -107,6 +227,20 @@ meter__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opa
  *
  * ALLOC: mt + 4 + 4 + 4
  *********************************************/
+static inline void
+counter__push(struct brubeck_metric *metric, value_t value)
+{
+	if (metric->as.counter.previous > 0.0) {
+		value_t diff = (value >= metric->as.counter.previous) ?
+			(value - metric->as.counter.previous) :
+			(value);
+
+		metric->as.counter.value += diff;
+	}
+
+	metric->as.counter.previous = value;
+}
+
 static void
 counter__record(struct brubeck_metric *metric, value_t value, value_t sample_freq, uint8_t modifiers)
 {
@@ -115,15 +249,21 @@ counter__record(struct brubeck_metric *metric, value_t value, value_t sample_fre
 
 	pthread_spin_lock(&metric->lock);
 	{
-		if (metric->as.counter.previous > 0.0) {
-			value_t diff = (value >= metric->as.counter.previous) ?
-				(value - metric->as.counter.previous) :
-				(value);
+		counter__push(metric, value);
+	}
+	pthread_spin_unlock(&metric->lock);
+}
 
-			metric->as.counter.value += diff;
-		}
+static void
+counter__record_values(struct brubeck_metric *metric,
+	const value_t *values, size_t count, value_t sample_freq, uint8_t modifiers)
+{
+	size_t i;
 
-		metric->as.counter.previous = value;
+	pthread_spin_lock(&metric->lock);
+	{
+		for (i = 0; i < count; ++i)
+			counter__push(metric, values[i] * sample_freq);
 	}
 	pthread_spin_unlock(&metric->lock);
 }
@@ -131,16 +271,20 @@ counter__record(struct brubeck_metric *metric, value_t value, value_t sample_fre
 static void
 counter__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opaque)
 {
+	struct brubeck_backend *backend = opaque;
 	value_t value;
 
 	pthread_spin_lock(&metric->lock);
 	{
 		value = metric->as.counter.value;
 		metric->as.counter.value = 0.0;
+
+		if (unlikely(backend->rollup_count != 0))
+			rollup_sum(metric, backend, value);
 	}
 	pthread_spin_unlock(&metric->lock);
 
-	sample(metric->key, value, opaque);
+	sample_value(metric, "", value, sample, opaque);
 }
 
 
@@ -159,78 +303,210 @@ histogram__record(struct brubeck_metric *metric, value_t value, value_t sample_f
 	pthread_spin_unlock(&metric->lock);
 }
 
+static void
+histogram__record_values(struct brubeck_metric *metric,
+	const value_t *values, size_t count, value_t sample_freq, uint8_t modifiers)
+{
+	pthread_spin_lock(&metric->lock);
+	{
+		brubeck_histo_push_n(&metric->as.histogram, values, count, sample_freq);
+	}
+	pthread_spin_unlock(&metric->lock);
+}
+
+static const char * const histogram_suffixes[] = {
+	".count",
+	".count_ps",
+	".min",
+	".max",
+	".sum",
+	".mean",
+	".median",
+	".percentile.75",
+	".percentile.95",
+	".percentile.98",
+	".percentile.99",
+	".percentile.999"
+};
+
+static void
+histogram__emit(struct brubeck_metric *metric, const struct brubeck_histo_sample *hsample,
+	brubeck_sample_cb sample, void *opaque)
+{
+	const size_t count = sizeof(histogram_suffixes) / sizeof(histogram_suffixes[0]);
+
+	struct brubeck_backend *backend = opaque;
+	const struct brubeck_key *keys;
+	value_t values[sizeof(histogram_suffixes) / sizeof(histogram_suffixes[0])];
+	size_t i, n = count;
+
+	values[0] = hsample->count;
+	values[1] = hsample->count / (double)backend->sample_freq;
+	values[2] = hsample->min;
+	values[3] = hsample->max;
+	values[4] = hsample->sum;
+	values[5] = hsample->mean;
+	values[6] = hsample->median;
+	values[7] = hsample->percentile[PC_75];
+	values[8] = hsample->percentile[PC_95];
+	values[9] = hsample->percentile[PC_98];
+	values[10] = hsample->percentile[PC_99];
+	values[11] = hsample->percentile[PC_999];
+
+	/* if there have been no metrics during this sampling period,
+	 * we don't need to report any of the histogram samples */
+	if (hsample->count == 0.0)
+		n = 2;
+
+	if (unlikely(metric->tag_count != 0)) {
+		for (i = 0; i < n; ++i)
+			sample_tagged(metric, histogram_suffixes[i], values[i], sample, opaque);
+		return;
+	}
+
+	keys = brubeck_metric_keys(metric, &backend->server->slab, histogram_suffixes, count);
+
+	for (i = 0; i < n; ++i)
+		sample(keys[i].key, keys[i].len, values[i], opaque);
+}
+
 static void
 histogram__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opaque)
 {
+	struct brubeck_backend *backend = opaque;
 	struct brubeck_histo_sample hsample;
-	char *key;
 
 	pthread_spin_lock(&metric->lock);
 	{
+		if (unlikely(backend->rollup_count != 0)) {
+			struct brubeck_rollup *rollups = metric_rollups(metric);
+			int i;
+
+			for (i = 0; i < backend->rollup_count; ++i)
+				brubeck_histo_merge(&rollups[i].as.histogram, &metric->as.histogram);
+		}
+
 		brubeck_histo_sample(&hsample, &metric->as.histogram);
 	}
 	pthread_spin_unlock(&metric->lock);
 
-	/* alloc space for this on the stack. we need enough for:
-	 * key_length + longest_suffix + null terminator
-	 */
-	key = alloca(metric->key_len + strlen(".percentile.999") + 1);
-	memcpy(key, metric->key, metric->key_len);
+	histogram__emit(metric, &hsample, sample, opaque);
+}
+
+/* all the values of the window, as if it had been a single interval */
+static void
+histogram__sample_rollup(struct brubeck_metric *metric, int n, brubeck_sample_cb sample, void *opaque)
+{
+	struct brubeck_histo_sample hsample;
 
+	memset(&hsample, 0x0, sizeof(hsample));
 
-	WITH_SUFFIX(".count") {
-		sample(key, hsample.count, opaque);
-	}
+	pthread_spin_lock(&metric->lock);
+	if (metric->rollups)
+		brubeck_histo_sample(&hsample, &metric->rollups[n].as.histogram);
+	pthread_spin_unlock(&metric->lock);
 
-	WITH_SUFFIX(".count_ps") {
-		struct brubeck_backend *backend = opaque;
-		sample(key, hsample.count / (double)backend->sample_freq, opaque);
-	}
+	histogram__emit(metric, &hsample, sample, opaque);
+}
 
-	/* if there have been no metrics during this sampling period,
-	 * we don't need to report any of the histogram samples */
-	if (hsample.count == 0.0)
-		return;
 
-	WITH_SUFFIX(".min") {
-		sample(key, hsample.min, opaque);
-	}
+/*********************************************
+ * Set
+ *
+ * ALLOC: mt + 16 + up to 16k of registers
+ *********************************************/
+static void
+set__record(struct brubeck_metric *metric, value_t value, value_t sample_freq, uint8_t modifiers)
+{
+	/* numeric members, when not recorded through the statsd
+	 * parser: each distinct value is a member */
+	uint64_t hash = brubeck_hll_hash((const char *)&value, sizeof(value));
 
-	WITH_SUFFIX(".max") {
-		sample(key, hsample.max, opaque);
+	pthread_spin_lock(&metric->lock);
+	{
+		brubeck_hll_add(&metric->as.set, hash);
 	}
+	pthread_spin_unlock(&metric->lock);
+}
 
-	WITH_SUFFIX(".sum") {
-		sample(key, hsample.sum, opaque);
-	}
+static void
+set__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void *opaque)
+{
+	struct brubeck_backend *backend = opaque;
+	value_t value;
 
-	WITH_SUFFIX(".mean") {
-		sample(key, hsample.mean, opaque);
-	}
+	pthread_spin_lock(&metric->lock);
+	{
+		if (unlikely(backend->rollup_count != 0)) {
+			struct brubeck_rollup *rollups = metric_rollups(metric);
+			int i;
 
-	WITH_SUFFIX(".median") {
-		sample(key, hsample.median, opaque);
-	}
+			for (i = 0; i < backend->rollup_count; ++i)
+				brubeck_hll_merge(&rollups[i].as.set, &metric->as.set);
+		}
 
-	WITH_SUFFIX(".percentile.75") {
-		sample(key, hsample.percentile[PC_75], opaque);
+		value = round(brubeck_hll_estimate(&metric->as.set));
+		brubeck_hll_reset(&metric->as.set);
 	}
+	pthread_spin_unlock(&metric->lock);
 
-	WITH_SUFFIX(".percentile.95") {
-		sample(key, hsample.percentile[PC_95], opaque);
-	}
+	sample_value(metric, "", value, sample, opaque);
+}
+
+/* distinct members over the whole window, not a sum of intervals */
+static void
+set__sample_rollup(struct brubeck_metric *metric, int n, brubeck_sample_cb sample, void *opaque)
+{
+	value_t value = 0.0;
 
-	WITH_SUFFIX(".percentile.98") {
-		sample(key, hsample.percentile[PC_98], opaque);
+	pthread_spin_lock(&metric->lock);
+	if (metric->rollups) {
+		value = round(brubeck_hll_estimate(&metric->rollups[n].as.set));
+		brubeck_hll_reset(&metric->rollups[n].as.set);
 	}
+	pthread_spin_unlock(&metric->lock);
 
-	WITH_SUFFIX(".percentile.99") {
-		sample(key, hsample.percentile[PC_99], opaque);
+	sample_value(metric, "", value, sample, opaque);
+}
+
+static inline void
+set__add(struct brubeck_metric *metric, uint64_t hash)
+{
+	pthread_spin_lock(&metric->lock);
+	{
+		brubeck_hll_add(&metric->as.set, hash);
 	}
+	pthread_spin_unlock(&metric->lock);
+}
+
+/*
+ * Record a set member. Keys keep the type of their first record, so a
+ * member sent for a key that isn't a set is refused: returns -1.
+ */
+int brubeck_metric_record_member(struct brubeck_metric *metric, const char *member, size_t len)
+{
+	/* hashed outside of the lock, once for the aggregates too */
+	uint64_t hash;
+
+	if (unlikely(metric->flags & BRUBECK_METRIC_ALIAS))
+		return brubeck_metric_record_member(metric->aggregates[0], member, len);
+
+	if (unlikely(metric->type != BRUBECK_MT_SET))
+		return -1;
+
+	hash = brubeck_hll_hash(member, len);
+
+	if (likely(!(metric->flags & BRUBECK_METRIC_DROPPED)))
+		set__add(metric, hash);
+
+	if (unlikely(metric->aggregates != NULL)) {
+		struct brubeck_metric **ag;
 
-	WITH_SUFFIX(".percentile.999") {
-		sample(key, hsample.percentile[PC_999], opaque);
+		for (ag = metric->aggregates; *ag; ++ag)
+			set__add(*ag, hash);
 	}
+
+	return 0;
 }
 
 /********************************************************/
@@ -238,41 +514,63 @@ histogram__sample(struct brubeck_metric *metric, brubeck_sample_cb sample, void
 static struct brubeck_metric__proto {
 	mt_prototype_record record;
 	mt_prototype_sample sample;
+	mt_prototype_record_values record_values;
+	mt_prototype_sample_rollup sample_rollup;
 } _prototypes[] = {
 	/* Gauge */
 	{
 		&gauge__record,
-		&gauge__sample
+		&gauge__sample,
+		&gauge__record_values,
+		&gauge__sample_rollup
 	},
 
 	/* Meter */
 	{
 		&meter__record,
-		&meter__sample
+		&meter__sample,
+		&meter__record_values,
+		&sum__sample_rollup
 	},
 
 	/* Counter */
 	{
 		&counter__record,
-		&counter__sample
+		&counter__sample,
+		&counter__record_values,
+		&sum__sample_rollup
 	},
 
 	/* Histogram */
 	{
 		&histogram__record,
-		&histogram__sample
+		&histogram__sample,
+		&histogram__record_values,
+		&histogram__sample_rollup
 	},
 
 	/* Timer -- uses same implementation as histogram */
 	{
 		&histogram__record,
-		&histogram__sample
+		&histogram__sample,
+		&histogram__record_values,
+		&histogram__sample_rollup
+	},
+
+	/* Set */
+	{
+		&set__record,
+		&set__sample,
+		NULL,
+		&set__sample_rollup
 	},
 
 	/* Internal -- used for sampling brubeck itself */
 	{
 		NULL, /* recorded manually */
-		brubeck_internal__sample
+		brubeck_internal__sample,
+		NULL,
+		NULL /* only at the resolution of its backend */
 	}
 };
 
@@ -281,18 +579,169 @@ void brubeck_metric_sample(struct brubeck_metric *metric, brubeck_sample_cb cb,
 	_prototypes[metric->type].sample(metric, cb, backend);
 }
 
+/* Sample what the metric has accumulated for rollup `n` of its backend */
+void brubeck_metric_sample_rollup(struct brubeck_metric *metric, int n, brubeck_sample_cb cb, void *backend)
+{
+	if (_prototypes[metric->type].sample_rollup)
+		_prototypes[metric->type].sample_rollup(metric, n, cb, backend);
+}
+
+/*
+ * Records go to the metric itself (unless it has been dropped in favour
+ * of its aggregates) and then to each one of its aggregates, which
+ * always have the same type. An alias records into the metric it was
+ * renamed to, exactly as if the record had been sent for that key.
+ */
 void brubeck_metric_record(struct brubeck_metric *metric, value_t value, value_t sample_freq, uint8_t modifiers)
 {
-	_prototypes[metric->type].record(metric, value, sample_freq, modifiers);
+	const struct brubeck_metric__proto *proto = &_prototypes[metric->type];
+
+	if (unlikely(metric->flags & BRUBECK_METRIC_ALIAS)) {
+		brubeck_metric_record(metric->aggregates[0], value, sample_freq, modifiers);
+		return;
+	}
+
+	if (likely(!(metric->flags & BRUBECK_METRIC_DROPPED)))
+		proto->record(metric, value, sample_freq, modifiers);
+
+	if (unlikely(metric->aggregates != NULL)) {
+		struct brubeck_metric **ag;
+
+		for (ag = metric->aggregates; *ag; ++ag)
+			proto->record(*ag, value, sample_freq, modifiers);
+	}
+}
+
+static void
+record_values(const struct brubeck_metric__proto *proto, struct brubeck_metric *metric,
+	const value_t *values, size_t count, value_t sample_freq, uint8_t modifiers)
+{
+	size_t i;
+
+	if (count > 1 && proto->record_values) {
+		proto->record_values(metric, values, count, sample_freq, modifiers);
+		return;
+	}
+
+	for (i = 0; i < count; ++i)
+		proto->record(metric, values[i], sample_freq, modifiers);
+}
+
+/*
+ * Record a list of values for the same metric, taking its lock once
+ * when the type supports it.
+ */
+void brubeck_metric_record_values(struct brubeck_metric *metric,
+	const value_t *values, size_t count, value_t sample_freq, uint8_t modifiers)
+{
+	const struct brubeck_metric__proto *proto = &_prototypes[metric->type];
+
+	if (unlikely(metric->flags & BRUBECK_METRIC_ALIAS)) {
+		brubeck_metric_record_values(metric->aggregates[0], values, count, sample_freq, modifiers);
+		return;
+	}
+
+	if (likely(!(metric->flags & BRUBECK_METRIC_DROPPED)))
+		record_values(proto, metric, values, count, sample_freq, modifiers);
+
+	if (unlikely(metric->aggregates != NULL)) {
+		struct brubeck_metric **ag;
+
+		for (ag = metric->aggregates; *ag; ++ag)
+			record_values(proto, *ag, values, count, sample_freq, modifiers);
+	}
+}
+
+/*
+ * The output keys of a metric (its key followed by each one of the
+ * suffixes for its type) are rendered once, the first time the metric
+ * is sampled, and live in slab memory for as long as the metric does.
+ * The backend and its rollup threads can sample the metric at the same
+ * time, so the table is published with a CAS: whoever loses the race
+ * uses the winner's table. A losing slab allocation stays wasted, since
+ * slabs are never freed, but that only happens once per metric.
+ */
+const struct brubeck_key *
+brubeck_metric_keys(
+	struct brubeck_metric *metric, struct brubeck_slab *slab,
+	const char * const *suffixes, size_t count)
+{
+	struct brubeck_key *keys;
+	size_t i, need = count * sizeof(struct brubeck_key);
+	char *ptr;
+
+	if (likely(metric->keys != NULL))
+		return metric->keys;
+
+	for (i = 0; i < count; ++i)
+		need += metric->key_len + strlen(suffixes[i]) + 1;
+
+	/* slabs cannot hold more than one node */
+	if (need <= NODE_SIZE)
+		keys = brubeck_slab_alloc(slab, need);
+	else
+		keys = xmalloc(need);
+
+	ptr = (char *)(keys + count);
+
+	for (i = 0; i < count; ++i) {
+		size_t suffix_len = strlen(suffixes[i]);
+
+		memcpy(ptr, metric->key, metric->key_len);
+		memcpy(ptr + metric->key_len, suffixes[i], suffix_len + 1);
+
+		keys[i].key = ptr;
+		keys[i].len = (uint16_t)(metric->key_len + suffix_len);
+		ptr += keys[i].len + 1;
+	}
+
+	if (!brubeck_atomic_cas(&metric->keys, NULL, keys)) {
+		if (need > NODE_SIZE)
+			free(keys);
+		return metric->keys;
+	}
+
+	return keys;
 }
 
 struct brubeck_backend *
 brubeck_metric_shard(struct brubeck_server *server, struct brubeck_metric *metric)
 {
-	int shard = 0;
-	if (server->active_backends > 1)
-		shard = CityHash32(metric->key, metric->key_len) % server->active_backends;
-	return server->backends[shard];
+	uint8_t shards[BRUBECK_MAX_BACKENDS];
+	const char *key = metric->key;
+	size_t key_len = metric->key_len;
+	char rendered[BRUBECK_TAGS_RENDER_MAX];
+	int i, n;
+
+	/* tag ids differ between runs; shard on the text of the series
+	 * so it keeps going to the same backend across restarts */
+	if (metric->tag_count) {
+		size_t len = brubeck_tags_render(server->tags, rendered, sizeof(rendered),
+			metric->key, metric->key_len, metric->tag_count, "");
+		if (len > 0) {
+			key = rendered;
+			key_len = len;
+		}
+	}
+
+	n = brubeck_sharding_lookup(&server->sharding,
+		key, key_len, shards, BRUBECK_MAX_BACKENDS);
+
+	metric->replicas = 0;
+	for (i = 1; i < n; ++i)
+		metric->replicas |= (1 << shards[i]);
+
+	return server->backends[shards[0]];
+}
+
+static struct brubeck_metric *
+insert_metric(struct brubeck_server *server, struct brubeck_metric *metric)
+{
+	if (!brubeck_hashtable_insert(server->metrics, metric->key, metric->key_len, metric))
+		return brubeck_hashtable_find(server->metrics, metric->key, metric->key_len);
+
+	brubeck_metric_register(server, metric);
+	return metric;
 }
 
 struct brubeck_metric *
@@ -304,14 +753,159 @@ brubeck_metric_new(struct brubeck_server *server, const char *key, size_t key_le
 	if (!metric)
 		return NULL;
 
-	if (!brubeck_hashtable_insert(server->metrics, metric->key, metric->key_len, metric))
-		return brubeck_hashtable_find(server->metrics, key, key_len);
+	/* bound before the metric is visible to other workers */
+	brubeck_metric_bind(server, metric);
+	return insert_metric(server, metric);
+}
+
+/*
+ * Aggregates are created like any other metric, but the rules are
+ * not evaluated for them: they only ever aggregate one level deep.
+ */
+static struct brubeck_metric *
+find_aggregate(struct brubeck_server *server, const char *key, size_t key_len, uint8_t type)
+{
+	struct brubeck_metric *aggregate;
+
+	aggregate = brubeck_hashtable_find(server->metrics, key, (uint16_t)key_len);
+
+	if (aggregate == NULL) {
+		if (server->at_capacity)
+			return NULL;
+
+		aggregate = insert_metric(server, new_metric(server, key, key_len, type));
+	}
+
+	if (aggregate && aggregate->type != type) {
+		log_splunk("event=aggregate_type_mismatch target=%s type=%d expected=%d",
+			aggregate->key, aggregate->type, type);
+		return NULL;
+	}
+
+	return aggregate;
+}
+
+/*
+ * Only the types whose records can be applied to another metric as-is
+ * can be aggregated: gauges would just take the last value of any of
+ * their sources, and counters would diff the values of different ones.
+ */
+static inline int
+aggregatable(uint8_t type)
+{
+	return type == BRUBECK_MT_METER || type == BRUBECK_MT_HISTO ||
+		type == BRUBECK_MT_TIMER || type == BRUBECK_MT_SET;
+}
+
+/*
+ * Evaluate the aggregation rules for a new metric, once, and keep
+ * the aggregates it matched on the metric itself. Tagged series are
+ * not aggregated.
+ */
+void brubeck_metric_bind(struct brubeck_server *server, struct brubeck_metric *metric)
+{
+	const struct brubeck_aggregation *aggregation = server->aggregation;
+	struct brubeck_metric *targets[BRUBECK_MAX_AGGREGATES];
+	char key[BRUBECK_AGGREGATE_KEY_MAX];
+	size_t i, j, n = 0;
+
+	if (aggregation == NULL || metric->tag_count != 0 || !aggregatable(metric->type))
+		return;
+
+	for (i = 0; i < aggregation->count && n < BRUBECK_MAX_AGGREGATES; ++i) {
+		const struct brubeck_aggregation_rule *rule = &aggregation->rules[i];
+		struct brubeck_metric *target;
+		size_t len;
+
+		len = brubeck_aggregation_target(rule, key, sizeof(key), metric->key, metric->key_len);
+		if (len == 0)
+			continue;
+
+		/* the aggregate matches its own pattern */
+		if (len == metric->key_len && !memcmp(key, metric->key, len))
+			continue;
+
+		target = find_aggregate(server, key, len, metric->type);
+		if (target == NULL)
+			continue;
+
+		for (j = 0; j < n && targets[j] != target; ++j)
+			;
+		if (j == n)
+			targets[n++] = target;
+
+		/* only once the aggregate exists, so no data is lost */
+		if (rule->drop)
+			metric->flags |= BRUBECK_METRIC_DROPPED;
+	}
+
+	if (n == 0)
+		return;
+
+	metric->aggregates = brubeck_slab_alloc(&server->slab,
+		(n + 1) * sizeof(struct brubeck_metric *));
+	memcpy(metric->aggregates, targets, n * sizeof(struct brubeck_metric *));
+	metric->aggregates[n] = NULL;
+}
+
+/*
+ * Hand a metric that has just been added to the table to its backend;
+ * dropped metrics are never sampled, so they don't get one.
+ */
+void brubeck_metric_register(struct brubeck_server *server, struct brubeck_metric *metric)
+{
+	if (metric->flags & BRUBECK_METRIC_DROPPED) {
+		if (!(metric->flags & BRUBECK_METRIC_ALIAS))
+			brubeck_stats_inc(server, unique_keys);
+		return;
+	}
 
+	pthread_rwlock_rdlock(&server->shard_lock);
 	brubeck_backend_register_metric(brubeck_metric_shard(server, metric), metric);
+	pthread_rwlock_unlock(&server->shard_lock);
 
 	/* Record internal stats */
 	brubeck_stats_inc(server, unique_keys);
-	return metric;
+}
+
+/*
+ * Keys are filtered the first time they are seen. Denied keys never
+ * make it into the table, so they are filtered again every time they
+ * come in, which only costs a walk of the prefix DFA. A renamed key
+ * is added to the table as an alias that forwards its records to the
+ * metric it was renamed to, so its rules never run again.
+ */
+static struct brubeck_metric *
+filter_metric(struct brubeck_server *server, const char *key, size_t key_len, uint8_t type)
+{
+	char renamed[BRUBECK_FILTER_KEY_MAX];
+	struct brubeck_metric *target, *alias;
+	size_t len;
+
+	switch (brubeck_filter_apply(server->filter, renamed, sizeof(renamed), &len, key, key_len)) {
+	case BRUBECK_FILTER_DENY:
+		brubeck_stats_inc(server, filtered);
+		return NULL;
+
+	case BRUBECK_FILTER_ALLOW:
+		return brubeck_metric_new(server, key, key_len, type);
+	}
+
+	target = brubeck_hashtable_find(server->metrics, renamed, (uint16_t)len);
+	if (target == NULL)
+		target = brubeck_metric_new(server, renamed, len, type);
+	else
+		brubeck_metric_touch(server, target);
+
+	/* records go through the alias as if they had been sent for
+	 * the target, so it takes the type of the target */
+	alias = new_metric(server, key, key_len, target->type);
+	alias->flags |= (BRUBECK_METRIC_DROPPED | BRUBECK_METRIC_ALIAS);
+	alias->aggregates = brubeck_slab_alloc(&server->slab, 2 * sizeof(struct brubeck_metric *));
+	alias->aggregates[0] = target;
+	alias->aggregates[1] = NULL;
+
+	return insert_metric(server, alias);
 }
 
 struct brubeck_metric *
@@ -326,13 +920,49 @@ brubeck_metric_find(struct brubeck_server *server, const char *key, size_t key_l
 		if (server->at_capacity)
 			return NULL;
 
+		if (server->filter)
+			return filter_metric(server, key, key_len, type);
+
 		return brubeck_metric_new(server, key, key_len, type);
 	}
 
-#ifdef BRUBECK_METRICS_FLOW
-	brubeck_atomic_inc(&metric->flow);
-#endif
-
-	metric->expire = BRUBECK_EXPIRE_ACTIVE;
+	brubeck_metric_touch(server, metric);
 	return metric;
 }
+
+/*
+ * A metric's aggregates stay alive for as long as any of their sources.
+ * The aggregates of an alias are the metric it was renamed to, whose
+ * own aggregates are one more level down.
+ */
+static void
+mark_seen(struct brubeck_metric *metric, uint32_t epoch)
+{
+	metric->seen = epoch;
+
+	if (metric->aggregates) {
+		struct brubeck_metric **ag;
+
+		for (ag = metric->aggregates; *ag; ++ag) {
+			if ((*ag)->seen != epoch)
+				mark_seen(*ag, epoch);
+		}
+	}
+}
+
+/*
+ * Bookkeeping for a metric that is about to be recorded; samplers
+ * that keep their own references to metrics (instead of looking them
+ * up with brubeck_metric_find) must call it for every record.
+ */
+void brubeck_metric_touch(struct brubeck_server *server, struct brubeck_metric *metric)
+{
+	uint32_t epoch;
+
+	brubeck_flow_record(&server->flows, metric);
+
+	/* only dirty the metric's cache line once per epoch */
+	epoch = server->expire_epoch;
+	if (unlikely(metric->seen != epoch))
+		mark_seen(metric, epoch);
+}
@@ -7,6 +7,7 @@ enum brubeck_metric_t {
 	BRUBECK_MT_COUNTER, /** C */
 	BRUBECK_MT_HISTO, /** h */
 	BRUBECK_MT_TIMER, /** ms */
+	BRUBECK_MT_SET, /** s */
 	BRUBECK_MT_INTERNAL_STATS
 };
 
@@ -14,6 +15,15 @@ enum brubeck_metric_mod_t {
 	BRUBECK_MOD_RELATIVE_VALUE = 1
 };
 
+enum brubeck_metric_flag_t {
+	/* only feeds its aggregates; see aggregation.h */
+	BRUBECK_METRIC_DROPPED = 1,
+
+	/* a key that was renamed by the filter; it only feeds
+	 * the metric it was renamed to. See filter.h */
+	BRUBECK_METRIC_ALIAS = 2
+};
+
 enum brubeck_aggregate_t {
 	BRUBECK_AG_LAST,
 	BRUBECK_AG_SUM,
@@ -28,17 +38,58 @@ enum {
 	BRUBECK_EXPIRE_ACTIVE = 2
 };
 
+/* Epochs without records after which a metric stops being sampled */
+#define BRUBECK_EXPIRE_EPOCHS 2
+
+/* A fully rendered output key (metric key + type suffix) */
+struct brubeck_key {
+	const char *key;
+	uint16_t len;
+};
+
+/*
+ * What a metric has accumulated for one of the rollups of its backend
+ * since that rollup last sampled it: the intervals of the backend,
+ * merged (counts summed, histogram values and sets combined).
+ */
+struct brubeck_rollup {
+	union {
+		value_t value;
+		struct brubeck_histo histogram;
+		struct brubeck_hll set;
+	} as;
+};
+
 struct brubeck_metric {
 	struct brubeck_metric *next;
 
-#ifdef BRUBECK_METRICS_FLOW
-	uint64_t flow;
-#endif
-
 	pthread_spinlock_t lock;
 	uint16_t key_len;
 	uint8_t type;
-	uint8_t expire;
+	uint8_t flags;
+
+	/* last expiry epoch in which the metric was recorded */
+	uint32_t seen;
+
+	/* bitmask of the extra shards this metric is replicated to;
+	 * shares the word after `seen` with tag_count, which would
+	 * otherwise be padding */
+	uint8_t replicas;
+
+	/* number of tag ids after the name in the key; see tags.h */
+	uint8_t tag_count;
+
+	/* output keys, rendered the first time the metric is sampled */
+	const struct brubeck_key *keys;
+
+	/* BRUBECK_MAX_ROLLUPS slots, allocated the first time the metric
+	 * is sampled by a backend with rollups */
+	struct brubeck_rollup *rollups;
+
+	/* NULL-terminated list of the aggregates this metric feeds,
+	 * bound when it's created (see aggregation.h), or of the
+	 * metric an alias was renamed to */
+	struct brubeck_metric **aggregates;
 
 	union {
 		struct {
@@ -48,6 +99,7 @@ struct brubeck_metric {
 			value_t value, previous;
 		} counter;
 		struct brubeck_histo histogram;
+		struct brubeck_hll set;
 		void *other;
 	} as;
 
@@ -56,17 +108,47 @@ struct brubeck_metric {
 
 typedef void (*brubeck_sample_cb)(
 	const char *key,
+	size_t key_len,
 	value_t value,
 	void *backend);
 
 void brubeck_metric_sample(struct brubeck_metric *metric, brubeck_sample_cb cb, void *backend);
+void brubeck_metric_sample_rollup(struct brubeck_metric *metric, int n, brubeck_sample_cb cb, void *backend);
 void brubeck_metric_record(struct brubeck_metric *metric, value_t value, value_t sample_rate, uint8_t modifiers);
+void brubeck_metric_record_values(struct brubeck_metric *metric,
+	const value_t *values, size_t count, value_t sample_rate, uint8_t modifiers);
+int brubeck_metric_record_member(struct brubeck_metric *metric, const char *member, size_t len);
+
+#define BRUBECK_METRIC_SIZE(key_len) (sizeof(struct brubeck_metric) + (key_len) + 1)
+
+void brubeck_metric_init(struct brubeck_server *server,
+	struct brubeck_metric *metric, const char *key, size_t key_len, uint8_t type);
+void brubeck_metric_register(struct brubeck_server *server, struct brubeck_metric *metric);
+void brubeck_metric_bind(struct brubeck_server *server, struct brubeck_metric *metric);
 
 struct brubeck_metric *brubeck_metric_new(struct brubeck_server *server, const char *, size_t, uint8_t);
 struct brubeck_metric *brubeck_metric_find(struct brubeck_server *server, const char *, size_t, uint8_t);
+void brubeck_metric_touch(struct brubeck_server *server, struct brubeck_metric *metric);
 struct brubeck_backend *brubeck_metric_shard(struct brubeck_server *server, struct brubeck_metric *);
 
-#define WITH_SUFFIX(suffix) memcpy(key + metric->key_len, suffix, strlen(suffix) + 1);
+/*
+ * Metrics are not swept when they expire: their state is derived
+ * from how many expiry epochs ago they were last recorded.
+ */
+static inline uint8_t brubeck_metric_expire(const struct brubeck_metric *metric, uint32_t epoch)
+{
+	uint32_t age = epoch - metric->seen;
+
+	if (age == 0)
+		return BRUBECK_EXPIRE_ACTIVE;
+	if (age < BRUBECK_EXPIRE_EPOCHS)
+		return BRUBECK_EXPIRE_INACTIVE;
+	return BRUBECK_EXPIRE_DISABLED;
+}
+
+const struct brubeck_key *brubeck_metric_keys(
+	struct brubeck_metric *metric, struct brubeck_slab *slab,
+	const char * const *suffixes, size_t count);
 
 #endif
 
@@ -1,5 +1,8 @@
+#include <time.h>
 #include "brubeck.h"
 
+#define DRAIN_PACKET_SIZE 8192
+
 void
 brubeck_sampler_init_inet(struct brubeck_sampler *sampler, struct brubeck_server *server, const char *url, int port)
 {
@@ -12,8 +15,13 @@ brubeck_sampler_init_inet(struct brubeck_sampler *sampler, struct brubeck_server
 
 int brubeck_sampler_socket(struct brubeck_sampler *sampler, int multisock)
 {
-	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	int sock = brubeck_handoff_take(&sampler->server->handoff, &sampler->addr);
+
+	/* already bound by the previous instance */
+	if (sock >= 0)
+		return sock;
 
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	assert(sock >= 0);
 
 	sock_enlarge_in(sock);
@@ -27,3 +35,70 @@ int brubeck_sampler_socket(struct brubeck_sampler *sampler, int multisock)
 
 	return sock;
 }
+
+void brubeck_sampler_open(struct brubeck_sampler *sampler, unsigned int count, int multisock)
+{
+	unsigned int i;
+
+	sampler->sockets = xmalloc(count * sizeof(int));
+	sampler->socket_count = count;
+
+	for (i = 0; i < count; ++i)
+		sampler->sockets[i] = brubeck_sampler_socket(sampler, multisock);
+
+	sampler->in_sock = sampler->sockets[0];
+}
+
+void brubeck_sampler_close(struct brubeck_sampler *sampler)
+{
+	unsigned int i;
+
+	for (i = 0; i < sampler->socket_count; ++i)
+		close(sampler->sockets[i]);
+
+	sampler->socket_count = 0;
+	sampler->in_sock = -1;
+}
+
+/*
+ * Parse whatever is left in the sampler's socket buffers once its
+ * workers have been stopped, until they're empty or the deadline
+ * passes (clients may well keep sending while we shut down).
+ */
+size_t brubeck_sampler_drain(struct brubeck_sampler *sampler, const struct timespec *deadline)
+{
+	char buffer[DRAIN_PACKET_SIZE];
+	size_t drained = 0;
+	unsigned int i;
+
+	if (!sampler->parse)
+		return 0;
+
+	for (i = 0; i < sampler->socket_count; ++i) {
+		for (;;) {
+			ssize_t res = recv(sampler->sockets[i], buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+
+			if (res < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			sampler->parse(sampler, buffer, (size_t)res);
+
+			if ((++drained % 64) == 0) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+
+				if (now.tv_sec > deadline->tv_sec ||
+					(now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+					goto out;
+			}
+		}
+	}
+
+out:
+	log_splunk("sampler=%s event=drained packets=%zu",
+		brubeck_sampler_name(sampler), drained);
+	return drained;
+}
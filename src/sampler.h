@@ -1,25 +1,40 @@
 #ifndef __BRUBECK_SAMPLER_H__
 #define __BRUBECK_SAMPLER_H__
 
+#define BRUBECK_MAX_SAMPLERS 8
+
 enum brubeck_sampler_t {
 	BRUBECK_SAMPLER_STATSD,
 	BRUBECK_SAMPLER_STATSD_SECURE,
+	BRUBECK_SAMPLER_BINARY,
 };
 
 struct brubeck_sampler {
 	enum brubeck_sampler_t type;
 	struct brubeck_server *server;
+	json_t *settings;
 
 	int in_sock;
 	struct sockaddr_in addr;
 
+	/* all the sockets bound by the sampler (more than one
+	 * with `multisock`), handed over on restarts */
+	int *sockets;
+	unsigned int socket_count;
+
 	size_t inflow;
 	size_t current_flow;
 
 	void (*shutdown)(struct brubeck_sampler *);
+
+	/* handle a single packet; used to drain the sockets on shutdown */
+	void (*parse)(struct brubeck_sampler *, char *, size_t);
 };
 
 int brubeck_sampler_socket(struct brubeck_sampler *sampler, int multisock);
+void brubeck_sampler_open(struct brubeck_sampler *sampler, unsigned int count, int multisock);
+void brubeck_sampler_close(struct brubeck_sampler *sampler);
+size_t brubeck_sampler_drain(struct brubeck_sampler *sampler, const struct timespec *deadline);
 void brubeck_sampler_init_inet(
 	struct brubeck_sampler *sampler,
 	struct brubeck_server *server,
@@ -30,11 +45,13 @@ static inline const char *brubeck_sampler_name(struct brubeck_sampler *sampler)
 	switch (sampler->type) {
 		case BRUBECK_SAMPLER_STATSD: return "statsd";
 		case BRUBECK_SAMPLER_STATSD_SECURE: return "statsd-secure";
+		case BRUBECK_SAMPLER_BINARY: return "binary";
 		default: return NULL;
 	}
 }
 
 #include "samplers/statsd.h"
+#include "samplers/binary.h"
 
 #endif
 
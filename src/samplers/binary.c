@@ -0,0 +1,371 @@
+#include <stddef.h>
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <endian.h>
+#include <time.h>
+#include "brubeck.h"
+
+#define MAX_PACKET_SIZE 8192
+#define KEYS_INIT_SIZE 64
+#define VALUES_BATCH 256
+
+static inline const uint8_t *
+read_varint(const uint8_t *ptr, const uint8_t *end, uint64_t *result)
+{
+	uint64_t value = 0;
+	int shift;
+
+	for (shift = 0; ptr < end && shift < 64; shift += 7) {
+		uint8_t b = *ptr++;
+		value |= (uint64_t)(b & 0x7F) << shift;
+
+		if (!(b & 0x80)) {
+			*result = value;
+			return ptr;
+		}
+	}
+
+	return NULL;
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline uint32_t
+sender_idle(struct brubeck_binary_sender *sender, uint32_t now)
+{
+	return sender->id ? now - sender->last_seen : UINT32_MAX;
+}
+
+/*
+ * Find the dictionary of a sender and lock it. Senders live in an
+ * open-addressed table; a new sender takes the first free slot in its
+ * probe window, or evicts the one that has been idle for the longest.
+ */
+static struct brubeck_binary_sender *
+sender_lock(struct brubeck_binary *binary, uint64_t id, uint32_t now)
+{
+	const unsigned int mask = binary->sender_count - 1;
+	const unsigned int start = (unsigned int)((id * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+	struct brubeck_binary_sender *sender, *victim = NULL;
+	unsigned int i;
+
+	for (i = 0; i < BRUBECK_BINARY_PROBE; ++i) {
+		sender = &binary->senders[(start + i) & mask];
+
+		if (sender->id == id) {
+			pthread_spin_lock(&sender->lock);
+			if (likely(sender->id == id))
+				return sender;
+
+			/* evicted while we were waiting */
+			pthread_spin_unlock(&sender->lock);
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&binary->claim_lock);
+
+	for (i = 0; i < BRUBECK_BINARY_PROBE; ++i) {
+		sender = &binary->senders[(start + i) & mask];
+
+		if (sender->id == id) {
+			victim = sender;
+			break;
+		}
+
+		if (!victim || sender_idle(sender, now) > sender_idle(victim, now))
+			victim = sender;
+	}
+
+	pthread_spin_lock(&victim->lock);
+
+	if (victim->id != id) {
+		if (victim->id) {
+			log_splunk("sampler=binary event=evict_sender sender=%016llx",
+				(unsigned long long)victim->id);
+		}
+
+		victim->id = id;
+		if (victim->keys)
+			memset(victim->keys, 0x0, victim->key_alloc * sizeof(struct brubeck_metric *));
+	}
+
+	pthread_mutex_unlock(&binary->claim_lock);
+	return victim;
+}
+
+static int
+binary_define(struct brubeck_binary *binary, struct brubeck_binary_sender *sender,
+	const uint8_t *ptr, const uint8_t *end)
+{
+	char name[MAX_PACKET_SIZE];
+	uint64_t key;
+	uint8_t type;
+	size_t len;
+
+	ptr = read_varint(ptr, end, &key);
+	if (!ptr || ptr == end || key >= binary->max_keys)
+		return -1;
+
+	type = *ptr++;
+	len = end - ptr;
+
+	/* same rules as statsd keys */
+	if (type >= BRUBECK_MT_INTERNAL_STATS || len == 0 || len >= sizeof(name) ||
+		memchr(ptr, '\0', len) || memchr(ptr, ' ', len) || ptr[len - 1] == '.')
+		return -1;
+
+	memcpy(name, ptr, len);
+	name[len] = '\0';
+
+	if (key >= sender->key_alloc) {
+		uint32_t alloc = sender->key_alloc ? sender->key_alloc : KEYS_INIT_SIZE;
+
+		while (alloc <= key)
+			alloc *= 2;
+		if (alloc > binary->max_keys)
+			alloc = binary->max_keys;
+
+		sender->keys = xrealloc(sender->keys, alloc * sizeof(struct brubeck_metric *));
+		memset(sender->keys + sender->key_alloc, 0x0,
+			(alloc - sender->key_alloc) * sizeof(struct brubeck_metric *));
+		sender->key_alloc = alloc;
+	}
+
+	sender->keys[key] = brubeck_metric_find(binary->sampler.server, name, len, type);
+	return sender->keys[key] ? 0 : -1;
+}
+
+static int
+binary_values(struct brubeck_binary *binary, struct brubeck_binary_sender *sender,
+	uint8_t op, const uint8_t *ptr, const uint8_t *end)
+{
+	struct brubeck_server *server = binary->sampler.server;
+	struct brubeck_metric *metric;
+	value_t values[VALUES_BATCH];
+	uint64_t key;
+
+	ptr = read_varint(ptr, end, &key);
+	if (!ptr || ptr == end || key >= sender->key_alloc)
+		return -1;
+
+	metric = sender->keys[key];
+	if (!metric)
+		return -1;
+
+	brubeck_metric_touch(server, metric);
+
+	while (ptr < end) {
+		size_t n = 0;
+
+		while (ptr < end && n < VALUES_BATCH) {
+			uint64_t v;
+
+			if (op == BRUBECK_BINARY_DOUBLES) {
+				if (end - ptr < 8)
+					return -1;
+
+				memcpy(&v, ptr, 8);
+				v = le64toh(v);
+				memcpy(&values[n++], &v, 8);
+				ptr += 8;
+			} else {
+				ptr = read_varint(ptr, end, &v);
+				if (!ptr)
+					return -1;
+
+				values[n++] = (value_t)unzigzag(v);
+			}
+		}
+
+		brubeck_metric_record_values(metric, values, n, 1.0, 0);
+		brubeck_atomic_add(&server->internal_stats.live.metrics, n);
+	}
+
+	return 0;
+}
+
+void brubeck_binary_packet_parse(struct brubeck_binary *binary, const uint8_t *buffer, size_t len)
+{
+	struct brubeck_server *server = binary->sampler.server;
+	const uint8_t *ptr = buffer + BRUBECK_BINARY_HEADER_SIZE;
+	const uint8_t *end = buffer + len;
+	struct brubeck_binary_sender *sender;
+	uint64_t sender_id;
+	uint32_t now;
+
+	if (len < BRUBECK_BINARY_HEADER_SIZE ||
+		buffer[0] != BRUBECK_BINARY_MAGIC0 ||
+		buffer[1] != BRUBECK_BINARY_MAGIC1 ||
+		buffer[2] != BRUBECK_BINARY_VERSION) {
+		brubeck_stats_inc(server, errors);
+		log_splunk("sampler=binary event=bad_header");
+		return;
+	}
+
+	memcpy(&sender_id, buffer + 4, sizeof(sender_id));
+	sender_id = le64toh(sender_id);
+
+	/* zero marks free slots */
+	if (sender_id == 0) {
+		brubeck_stats_inc(server, errors);
+		log_splunk("sampler=binary event=bad_sender");
+		return;
+	}
+
+	now = (uint32_t)brubeck_now();
+	sender = sender_lock(binary, sender_id, now);
+	sender->last_seen = now;
+
+	while (ptr < end) {
+		uint8_t op = *ptr++;
+		const uint8_t *body;
+		uint64_t body_len;
+		int res = 0;
+
+		body = read_varint(ptr, end, &body_len);
+		if (!body || body_len > (uint64_t)(end - body)) {
+			brubeck_stats_inc(server, errors);
+			log_splunk("sampler=binary event=truncated_record");
+			break;
+		}
+
+		ptr = body + body_len;
+
+		switch (op) {
+		case BRUBECK_BINARY_DEFINE:
+			res = binary_define(binary, sender, body, ptr);
+			break;
+
+		case BRUBECK_BINARY_VALUES:
+		case BRUBECK_BINARY_DOUBLES:
+			res = binary_values(binary, sender, op, body, ptr);
+			break;
+
+		default:
+			/* newer opcodes can be skipped */
+			break;
+		}
+
+		if (res < 0) {
+			brubeck_stats_inc(server, errors);
+			log_splunk("sampler=binary event=bad_record op=%d", (int)op);
+		}
+	}
+
+	pthread_spin_unlock(&sender->lock);
+}
+
+static void *binary__thread(void *_in)
+{
+	struct brubeck_binary *binary = _in;
+	unsigned int n = brubeck_atomic_inc(&binary->next_socket) - 1;
+	int sock = binary->sampler.sockets[n % binary->sampler.socket_count];
+	uint8_t *buffer = xmalloc(MAX_PACKET_SIZE);
+
+	assert(sock >= 0);
+	log_splunk("sampler=binary event=worker_online socket=%d", sock);
+
+	for (;;) {
+		ssize_t res = recv(sock, buffer, MAX_PACKET_SIZE, 0);
+
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+
+			log_splunk_errno("sampler=binary event=failed_read");
+			brubeck_stats_inc(binary->sampler.server, errors);
+			continue;
+		}
+
+		brubeck_atomic_inc(&binary->sampler.inflow);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		brubeck_binary_packet_parse(binary, buffer, (size_t)res);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	return NULL;
+}
+
+static void parse_packet(struct brubeck_sampler *sampler, char *buffer, size_t len)
+{
+	brubeck_binary_packet_parse((struct brubeck_binary *)sampler, (uint8_t *)buffer, len);
+}
+
+static void shutdown_sampler(struct brubeck_sampler *sampler)
+{
+	struct brubeck_binary *binary = (struct brubeck_binary *)sampler;
+	size_t i;
+
+	for (i = 0; i < binary->worker_count; ++i) {
+		pthread_cancel(binary->workers[i]);
+	}
+
+	for (i = 0; i < binary->worker_count; ++i) {
+		pthread_join(binary->workers[i], NULL);
+	}
+}
+
+struct brubeck_sampler *
+brubeck_binary_new(struct brubeck_server *server, json_t *settings)
+{
+	struct brubeck_binary *binary = xcalloc(1, sizeof(struct brubeck_binary));
+
+	char *address;
+	int port;
+	int multisock = 0;
+	int senders = 1024;
+	int max_keys = 65536;
+	unsigned int i;
+
+	binary->sampler.type = BRUBECK_SAMPLER_BINARY;
+	binary->sampler.shutdown = &shutdown_sampler;
+	binary->sampler.parse = &parse_packet;
+	binary->sampler.in_sock = -1;
+	binary->worker_count = 4;
+
+	json_unpack_or_die(settings,
+		"{s:s, s:i, s?:i, s?:b, s?:i, s?:i}",
+		"address", &address,
+		"port", &port,
+		"workers", &binary->worker_count,
+		"multisock", &multisock,
+		"senders", &senders,
+		"max_keys", &max_keys);
+
+	if (senders <= 0 || max_keys <= 0)
+		die("binary sampler: `senders` and `max_keys` must be positive");
+
+	/* power of two, and at least one probe window */
+	binary->sender_count = BRUBECK_BINARY_PROBE;
+	while (binary->sender_count < (unsigned int)senders)
+		binary->sender_count *= 2;
+
+	binary->senders = xcalloc(binary->sender_count, sizeof(struct brubeck_binary_sender));
+	for (i = 0; i < binary->sender_count; ++i)
+		pthread_spin_init(&binary->senders[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+	binary->max_keys = (uint32_t)max_keys;
+	pthread_mutex_init(&binary->claim_lock, NULL);
+
+	brubeck_sampler_init_inet(&binary->sampler, server, address, port);
+
+#ifndef SO_REUSEPORT
+	multisock = 0;
+#endif
+
+	brubeck_sampler_open(&binary->sampler,
+		multisock ? binary->worker_count : 1, multisock);
+
+	binary->workers = xmalloc(binary->worker_count * sizeof(pthread_t));
+	for (i = 0; i < binary->worker_count; ++i) {
+		if (pthread_create(&binary->workers[i], NULL, &binary__thread, binary) != 0)
+			die("failed to start sampler thread");
+	}
+
+	return &binary->sampler;
+}
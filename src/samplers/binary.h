@@ -0,0 +1,61 @@
+#ifndef __BRUBECK_BINARY_H__
+#define __BRUBECK_BINARY_H__
+
+/*
+ * Binary ingest protocol. Every packet starts with a header:
+ *
+ *	magic ('B' 'K') | version (1) | flags (0) | sender id (u64, LE)
+ *
+ * followed by any number of records, each one an opcode byte, the
+ * length of its body as a varint, and the body itself (so records
+ * with unknown opcodes can be skipped):
+ *
+ *	DEFINE   key id (varint) | metric type (u8) | metric name
+ *	VALUES   key id (varint) | one or more zigzag varint values
+ *	DOUBLES  key id (varint) | one or more IEEE 754 doubles (LE)
+ *
+ * Key ids are picked by each sender, which must define them before
+ * sending values for them. Senders should pick a random sender id
+ * every time they start, and re-send their definitions every now and
+ * then, since packets can be lost and dictionaries can be evicted.
+ */
+#define BRUBECK_BINARY_MAGIC0 'B'
+#define BRUBECK_BINARY_MAGIC1 'K'
+#define BRUBECK_BINARY_VERSION 1
+#define BRUBECK_BINARY_HEADER_SIZE 12
+
+enum {
+	BRUBECK_BINARY_DEFINE = 1,
+	BRUBECK_BINARY_VALUES = 2,
+	BRUBECK_BINARY_DOUBLES = 3
+};
+
+/* senders are looked up within a window of this many slots */
+#define BRUBECK_BINARY_PROBE 8
+
+struct brubeck_binary_sender {
+	pthread_spinlock_t lock;
+	uint64_t id;
+	uint32_t last_seen;
+
+	/* key id -> metric; NULL when the id hasn't been defined */
+	struct brubeck_metric **keys;
+	uint32_t key_alloc;
+};
+
+struct brubeck_binary {
+	struct brubeck_sampler sampler;
+	pthread_t *workers;
+	unsigned int worker_count;
+	unsigned int next_socket;
+
+	struct brubeck_binary_sender *senders;
+	unsigned int sender_count;
+	uint32_t max_keys;
+	pthread_mutex_t claim_lock;
+};
+
+void brubeck_binary_packet_parse(struct brubeck_binary *binary, const uint8_t *buffer, size_t len);
+struct brubeck_sampler *brubeck_binary_new(struct brubeck_server *server, json_t *settings);
+
+#endif
@@ -1,10 +1,17 @@
 #include <stddef.h>
+#define _GNU_SOURCE
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <time.h>
-#include <openssl/hmac.h>
 #include "brubeck.h"
 
-#define SHA_SIZE 32
-#define SHA_FUNCTION EVP_sha256
+#ifdef __GLIBC__
+#	if ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 12)))
+#		define HAVE_RECVMMSG 1
+#	endif
+#endif
+
+#define SHA_SIZE BRUBECK_SHA256_SIZE
 
 #define MAX_PACKET_SIZE 1024
 #define MIN_PACKET_SIZE (SHA_SIZE + 12)
@@ -46,21 +53,21 @@ verify_token(struct brubeck_server *server, struct brubeck_statsd_secure *statsd
 {
 	uint32_t ha, hb;
 	uint64_t timestamp;
-	struct timespec now;
+	time_t now = brubeck_now(), last;
 
 	memcpy(&timestamp, buffer + SHA_SIZE, 8);
-	clock_gettime(CLOCK_REALTIME, &now);
 
-	if (now.tv_sec != statsd->now) {
-		statsd->now = now.tv_sec;
-		multibloom_reset(statsd->replays, statsd->now % statsd->drift);
-	}
+	/* the first worker to see a new second recycles its filter */
+	last = statsd->now;
+	if (now > last &&
+		__sync_bool_compare_and_swap(&statsd->now, last, now))
+		multibloom_reset(statsd->replays, now % statsd->drift);
 
 	/* token from the future? */
-	if (statsd->now < timestamp) {
+	if ((uint64_t)now < timestamp) {
 		log_splunk(
 				"sampler=statsd-secure event=fail_future now=%llu timestamp=%llu",
-				(long long unsigned int)statsd->now,
+				(long long unsigned int)now,
 				(long long unsigned int)timestamp
 		);
 		brubeck_stats_inc(server, secure.from_future);
@@ -68,12 +75,12 @@ verify_token(struct brubeck_server *server, struct brubeck_statsd_secure *statsd
 	}
 
 	/* delayed */
-	if (statsd->now - timestamp > statsd->drift) {
+	if ((uint64_t)now - timestamp > statsd->drift) {
 		log_splunk(
 				"sampler=statsd-secure event=fail_delayed now=%llu timestamp=%llu drift=%d",
-				(long long unsigned int)statsd->now,
+				(long long unsigned int)now,
 				(long long unsigned int)timestamp,
-				(int)(statsd->now - timestamp)
+				(int)(now - timestamp)
 		);
 		brubeck_stats_inc(server, secure.delayed);
 		return -1;
@@ -91,28 +98,134 @@ verify_token(struct brubeck_server *server, struct brubeck_statsd_secure *statsd
 	return 0;
 }
 
-static void *statsd_secure__thread(void *_in)
+/* `hmac` is the HMAC computed for the packet; unused for short packets */
+static void
+statsd_secure__packet(struct brubeck_statsd_secure *statsd,
+	char *buffer, int res, const uint8_t *hmac)
 {
-	struct brubeck_statsd_secure *statsd = _in;
 	struct brubeck_server *server = statsd->sampler.server;
 
-	char buffer[MAX_PACKET_SIZE];
+	if (res < MIN_PACKET_SIZE) {
+		log_splunk("sampler=statsd-secure event=short_pkt len=%d", res);
+		brubeck_stats_inc(server, secure.failed);
+		return;
+	}
+
+	if (memcmpct(buffer, hmac, SHA_SIZE) != 0) {
+		log_splunk("sampler=statsd-secure event=fail_auth hmac=%s", hmactos(buffer));
+		brubeck_stats_inc(server, secure.failed);
+		return;
+	}
+
+	if (verify_token(server, statsd, buffer) < 0)
+		return;
+
+	brubeck_statsd_packet_parse(server, buffer + MIN_PACKET_SIZE, buffer + res);
+}
+
+static void
+statsd_secure__verify(struct brubeck_statsd_secure *statsd, char *buffer, int res)
+{
+	uint8_t hmac[SHA_SIZE];
+
+	if (res >= MIN_PACKET_SIZE) {
+		brubeck_hmac_sha256(&statsd->hmac,
+			(uint8_t *)buffer + SHA_SIZE, res - SHA_SIZE, hmac);
+	}
+
+	statsd_secure__packet(statsd, buffer, res, hmac);
+}
+
+#ifdef HAVE_RECVMMSG
+
+#ifndef MSG_WAITFORONE
+#	define MSG_WAITFORONE 0x0
+#endif
+
+static void
+statsd_secure_run_recvmmsg(struct brubeck_statsd_secure *statsd, int sock)
+{
+	const unsigned int SIM_PACKETS = statsd->mmsg_count;
+	struct brubeck_server *server = statsd->sampler.server;
+
+	unsigned int i, n;
+	struct iovec iovecs[SIM_PACKETS];
+	struct mmsghdr msgs[SIM_PACKETS];
+
+	/* the signed part of every packet in the batch, and its HMAC */
+	const uint8_t *signed_data[SIM_PACKETS];
+	size_t signed_len[SIM_PACKETS];
+	uint8_t hmacs[SIM_PACKETS][SHA_SIZE];
+
+	memset(msgs, 0x0, sizeof(msgs));
+
+	for (i = 0; i < SIM_PACKETS; ++i) {
+		iovecs[i].iov_base = xmalloc(MAX_PACKET_SIZE);
+		iovecs[i].iov_len = MAX_PACKET_SIZE - 1;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	HMAC_CTX ctx;
-	unsigned char hmac_buffer[SHA_SIZE];
-	unsigned int hmac_len;
+	log_splunk("sampler=statsd-secure event=worker_online syscall=recvmmsg socket=%d", sock);
+
+	for (;;) {
+		int res = recvmmsg(sock, msgs, SIM_PACKETS, MSG_WAITFORONE, NULL);
+
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+
+			log_splunk_errno("sampler=statsd-secure event=failed_read");
+			brubeck_stats_inc(server, errors);
+			continue;
+		}
+
+		brubeck_atomic_add(&statsd->sampler.inflow, res);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* hash the whole batch at once so it can be spread
+		 * across SIMD lanes; short packets are skipped */
+		for (i = 0, n = 0; i < (unsigned int)res; ++i) {
+			if (msgs[i].msg_len < MIN_PACKET_SIZE)
+				continue;
+			signed_data[n] = (uint8_t *)msgs[i].msg_hdr.msg_iov->iov_base + SHA_SIZE;
+			signed_len[n] = msgs[i].msg_len - SHA_SIZE;
+			n++;
+		}
+
+		brubeck_hmac_sha256_batch(&statsd->hmac, signed_data, signed_len, n, hmacs);
+
+		for (i = 0, n = 0; i < (unsigned int)res; ++i) {
+			int len = (int)msgs[i].msg_len;
+
+			statsd_secure__packet(statsd,
+				msgs[i].msg_hdr.msg_iov->iov_base, len, hmacs[n]);
+
+			if (len >= MIN_PACKET_SIZE)
+				n++;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+}
+#endif
+
+static void
+statsd_secure_run_recvmsg(struct brubeck_statsd_secure *statsd, int sock)
+{
+	struct brubeck_server *server = statsd->sampler.server;
+
+	char buffer[MAX_PACKET_SIZE];
 
 	struct sockaddr_in reporter;
 	socklen_t reporter_len = sizeof(reporter);
 	memset(&reporter, 0, reporter_len);
 
-	log_splunk("sampler=statsd-secure event=worker_online");
-
-	HMAC_CTX_init(&ctx);
-	HMAC_Init_ex(&ctx, statsd->hmac_key, strlen(statsd->hmac_key), SHA_FUNCTION(), NULL);
+	log_splunk("sampler=statsd-secure event=worker_online syscall=recvmsg socket=%d", sock);
 
 	for (;;) {
-		int res = recvfrom(statsd->sampler.in_sock, buffer,
+		int res = recvfrom(sock, buffer,
 			sizeof(buffer) - 1, 0, (struct sockaddr *)&reporter, &reporter_len);
 
 		if (res < 0) {
@@ -127,64 +240,109 @@ static void *statsd_secure__thread(void *_in)
 
 		brubeck_atomic_inc(&statsd->sampler.inflow);
 
-		if (res < MIN_PACKET_SIZE) {
-			log_splunk("sampler=statsd-secure event=short_pkt len=%d", res);
-			brubeck_stats_inc(server, secure.failed);
-			continue;
-		}
-
-		HMAC_Init_ex(&ctx, NULL, 0, NULL, NULL);
-		HMAC_Update(&ctx, (unsigned char *)buffer + SHA_SIZE, res - SHA_SIZE);
-		HMAC_Final(&ctx, hmac_buffer, &hmac_len);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		statsd_secure__verify(statsd, buffer, res);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+}
 
-		if (memcmpct(buffer, hmac_buffer, SHA_SIZE) != 0) {
-			log_splunk("sampler=statsd-secure event=fail_auth hmac=%s", hmactos(buffer));
-			brubeck_stats_inc(server, secure.failed);
-			continue;
-		}
+static void *statsd_secure__thread(void *_in)
+{
+	struct brubeck_statsd_secure *statsd = _in;
+	unsigned int n = brubeck_atomic_inc(&statsd->next_socket) - 1;
+	int sock = statsd->sampler.sockets[n % statsd->sampler.socket_count];
 
-		if (verify_token(server, statsd, buffer) < 0)
-			continue;
+	assert(sock >= 0);
 
-		brubeck_statsd_packet_parse(server, buffer + MIN_PACKET_SIZE, buffer + res);
+#ifdef HAVE_RECVMMSG
+	if (statsd->mmsg_count > 1) {
+		statsd_secure_run_recvmmsg(statsd, sock);
+		return NULL;
 	}
+#endif
 
-	HMAC_CTX_cleanup(&ctx);
+	statsd_secure_run_recvmsg(statsd, sock);
 	return NULL;
 }
 
+static void parse_packet(struct brubeck_sampler *sampler, char *buffer, size_t len)
+{
+	struct brubeck_statsd_secure *statsd = (struct brubeck_statsd_secure *)sampler;
+
+	if (len > MAX_PACKET_SIZE - 1)
+		len = MAX_PACKET_SIZE - 1;
+
+	statsd_secure__verify(statsd, buffer, (int)len);
+}
+
 static void shutdown_sampler(struct brubeck_sampler *sampler)
 {
 	struct brubeck_statsd_secure *statsd = (struct brubeck_statsd_secure *)sampler;
-	pthread_cancel(statsd->thread);
+	size_t i;
+
+	for (i = 0; i < statsd->worker_count; ++i) {
+		pthread_cancel(statsd->workers[i]);
+	}
+
+	for (i = 0; i < statsd->worker_count; ++i) {
+		pthread_join(statsd->workers[i], NULL);
+	}
 }
 
+static const char *sha256_impl_names[] = {
+	"scalar", "avx2", "shani"
+};
+
 struct brubeck_sampler *
 brubeck_statsd_secure_new(struct brubeck_server *server, json_t *settings)
 {
 	struct brubeck_statsd_secure *std = xmalloc(sizeof(struct brubeck_statsd_secure));
 	char *address;
 	int port, replay_len, drift;
+	int multisock = 0;
+	unsigned int i;
 
 	std->sampler.shutdown = &shutdown_sampler;
+	std->sampler.parse = &parse_packet;
 	std->sampler.type = BRUBECK_SAMPLER_STATSD_SECURE;
 	std->now = 0;
+	std->worker_count = 1;
+	std->mmsg_count = 1;
+	std->next_socket = 0;
 
 	json_unpack_or_die(settings,
-		"{s:s, s:i, s:s, s:i, s:i}",
+		"{s:s, s:i, s:s, s:i, s:i, s?:i, s?:i, s?:b}",
 		"address", &address,
 		"port", &port,
 		"hmac_key", &std->hmac_key,
 		"max_drift", &drift,
-		"replay_len", &replay_len);
+		"replay_len", &replay_len,
+		"workers", &std->worker_count,
+		"multimsg", &std->mmsg_count,
+		"multisock", &multisock);
 
 	brubeck_sampler_init_inet((struct brubeck_sampler *)std, server, address, port);
 	std->drift = (time_t)drift;
 	std->replays = multibloom_new(std->drift, replay_len, 0.001);
-	std->sampler.in_sock = brubeck_sampler_socket(&std->sampler, 0);
 
-	if (pthread_create(&std->thread, NULL, &statsd_secure__thread, std) != 0)
-		die("failed to start sampler thread");
+	/* the key pads are hashed once; workers share the result */
+	brubeck_hmac_sha256_init(&std->hmac, std->hmac_key, strlen(std->hmac_key));
+	log_splunk("sampler=statsd-secure event=hmac impl=%s",
+		sha256_impl_names[brubeck_sha256_impl()]);
+
+#ifndef SO_REUSEPORT
+	multisock = 0;
+#endif
+
+	/* with multisock, every worker gets its own socket */
+	brubeck_sampler_open(&std->sampler,
+		multisock ? std->worker_count : 1, multisock);
+
+	std->workers = xmalloc(std->worker_count * sizeof(pthread_t));
+	for (i = 0; i < std->worker_count; ++i) {
+		if (pthread_create(&std->workers[i], NULL, &statsd_secure__thread, std) != 0)
+			die("failed to start sampler thread");
+	}
 
 	return (struct brubeck_sampler *)std;
 }
@@ -53,11 +53,16 @@ static void statsd_run_recvmmsg(struct brubeck_statsd *statsd, int sock)
 		/* store stats */
 		brubeck_atomic_add(&statsd->sampler.inflow, SIM_PACKETS);
 
+		/* packets we've read are always parsed before shutting down */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
 		for (i = 0; i < SIM_PACKETS; ++i) {
 			char *buf = msgs[i].msg_hdr.msg_iov->iov_base;
 			char *end = buf + msgs[i].msg_len;
 			brubeck_statsd_packet_parse(server, buf, end);
 		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	}
 }
 #endif
@@ -88,7 +93,10 @@ static void statsd_run_recvmsg(struct brubeck_statsd *statsd, int sock)
 		}
 
 		brubeck_atomic_inc(&statsd->sampler.inflow);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		brubeck_statsd_packet_parse(server, buffer, buffer + res);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	}
 }
 
@@ -137,8 +145,44 @@ parse_float(char *buffer, value_t *result, uint8_t *mods)
 	return buffer;
 }
 
+/*
+ * Validate a list of `key:value` tags; returns the end of the list,
+ * or NULL if it's malformed. Graphite reserves ';' and '=' in tags.
+ */
+static char *
+parse_tags(char *buffer)
+{
+	int count = 0;
+
+	for (;;) {
+		char *start = buffer;
+		char *colon = NULL;
+
+		while (*buffer != ',' && *buffer != '|' && *buffer != '\0' && *buffer != '\n') {
+			if (*buffer == ';' || *buffer == '=' || *buffer == ' ')
+				return NULL;
+			if (*buffer == ':' && !colon)
+				colon = buffer;
+			++buffer;
+		}
+
+		if (!colon || colon == start || colon + 1 == buffer ||
+			colon - start > BRUBECK_TAG_MAX_LEN ||
+			buffer - colon - 1 > BRUBECK_TAG_MAX_LEN ||
+			++count > BRUBECK_MAX_TAGS)
+			return NULL;
+
+		if (*buffer != ',')
+			return buffer;
+
+		++buffer;
+	}
+}
+
 int brubeck_statsd_msg_parse(struct brubeck_statsd_msg *msg, char *buffer, char *end)
 {
+	int numeric = 1, uniform = 1;
+
 	*end = '\0';
 
 	/**
@@ -173,20 +217,62 @@ int brubeck_statsd_msg_parse(struct brubeck_statsd_msg *msg, char *buffer, char
 	 *
 	 *      gaugor:333|g
 	 *             ^^^
+	 *
+	 * Several values for the same key can be packed in a single
+	 * line, separated by ':'. Packed gauges must be either all
+	 * absolute or all relative, since a gauge can't apply both.
+	 *
+	 *      response_time:12:9:33|ms
+	 *                    ^^^^^^^
+	 *
+	 * Set members can be any string, so the raw value is kept
+	 * around until we know the type of the message.
+	 *
+	 *      users:jdoe|s
+	 *            ^^^^
 	 */
 	{
+		msg->member = buffer;
 		msg->modifiers = 0;
-		buffer = parse_float(buffer, &msg->value, &msg->modifiers);
+		msg->value_count = 0;
 
-		if (*buffer != '|')
-			return -1;
+		for (;;) {
+			char *start = buffer;
+			uint8_t mods = 0;
+
+			buffer = parse_float(buffer, &msg->values[msg->value_count], &mods);
+
+			/* only a lone value can be empty */
+			if (buffer == start && (msg->value_count || *buffer == ':'))
+				numeric = 0;
+
+			if (msg->value_count++ == 0)
+				msg->modifiers = mods;
+			else if (mods != msg->modifiers)
+				uniform = 0;
+
+			if (*buffer != ':' || msg->value_count == BRUBECK_STATSD_MAX_VALUES)
+				break;
+
+			buffer++;
+		}
+
+		if (*buffer != '|') {
+			numeric = 0;
+			while (*buffer != '|' && *buffer != '\0')
+				++buffer;
 
+			if (*buffer == '\0')
+				return -1;
+		}
+
+		msg->member_len = buffer - msg->member;
 		buffer++;
 	}
 
 	/**
 	 * Message type: one or two char identifier with the
-	 * message type. Valid values: g, c, C, h, ms
+	 * message type. Valid values: g, c, C, h, ms, s
 	 *
 	 *      gaugor:333|g
 	 *                 ^
@@ -197,6 +283,7 @@ int brubeck_statsd_msg_parse(struct brubeck_statsd_msg *msg, char *buffer, char
 			case 'c': msg->type = BRUBECK_MT_METER; break;
 			case 'C': msg->type = BRUBECK_MT_COUNTER; break;
 			case 'h': msg->type = BRUBECK_MT_HISTO; break;
+			case 's': msg->type = BRUBECK_MT_SET; break;
 			case 'm':
 					  ++buffer;
 					  if (*buffer == 's') {
@@ -209,30 +296,59 @@ int brubeck_statsd_msg_parse(struct brubeck_statsd_msg *msg, char *buffer, char
 		}
 
 		buffer++;
+
+		if (msg->type == BRUBECK_MT_SET ? msg->member_len == 0 : !numeric)
+			return -1;
+
+		if (msg->type == BRUBECK_MT_GAUGE && !uniform)
+			return -1;
 	}
 
 	/**
-	 * Sample rate: parse the sample rate trailer if it exists.
-	 * It must be a floating point number between 0.0 and 1.0
+	 * Trailers: the sample rate and the DogStatsD tags, both optional
+	 * and in any order.
+	 *
+	 * The sample rate must be a floating point number between 0.0
+	 * and 1.0
 	 *
 	 *      gorets:1|c|@0.1
 	 *                 ^^^^----
+	 *
+	 * Tags are a comma separated list of `key:value` pairs
+	 *
+	 *      gorets:1|c|#host:web1,role:app
+	 *                 ^^^^^^^^^^^^^^^^^^^
 	 */
 	{
-		if (buffer[0] == '|' && buffer[1] == '@') {
-			double sample_rate;
-			uint8_t dummy;
-
-			buffer = parse_float(buffer + 2, &sample_rate, &dummy);
-			if (sample_rate <= 0.0 || sample_rate > 1.0)
+		int has_rate = 0;
+
+		msg->sample_freq = 1.0;
+		msg->tags = NULL;
+		msg->tags_len = 0;
+
+		while (buffer[0] == '|') {
+			if (buffer[1] == '@' && !has_rate) {
+				double sample_rate;
+				uint8_t dummy;
+
+				buffer = parse_float(buffer + 2, &sample_rate, &dummy);
+				if (sample_rate <= 0.0 || sample_rate > 1.0)
+					return -1;
+
+				msg->sample_freq = (1.0 / sample_rate);
+				has_rate = 1;
+			} else if (buffer[1] == '#' && !msg->tags) {
+				msg->tags = buffer + 2;
+				buffer = parse_tags(msg->tags);
+				if (!buffer)
+					return -1;
+
+				msg->tags_len = buffer - msg->tags;
+			} else {
 				return -1;
-
-			msg->sample_freq = (1.0 / sample_rate);
-		} else {
-			msg->sample_freq = 1.0;
+			}
 		}
 
-
 		if (buffer[0] == '\0' || (buffer[0] == '\n' && buffer[1] == '\0'))
 			return 0;
 			
@@ -244,22 +360,50 @@ void brubeck_statsd_packet_parse(struct brubeck_server *server, char *buffer, ch
 {
 	struct brubeck_statsd_msg msg;
 	struct brubeck_metric *metric;
+	char series[MAX_PACKET_SIZE + BRUBECK_TAGS_SERIES_MAX + 1];
 
 	while (buffer < end) {
 		char *stat_end = memchr(buffer, '\n', end - buffer);
+		const char *key;
+		int key_len;
+
 		if (!stat_end)
 			stat_end = end;
 
 		if (brubeck_statsd_msg_parse(&msg, buffer, stat_end) < 0) {
 			brubeck_stats_inc(server, errors);
 			log_splunk("sampler=statsd event=packet_drop");
-		} else {
-			brubeck_stats_inc(server, metrics);
-			metric = brubeck_metric_find(server, msg.key, msg.key_len, msg.type);
-			if (metric != NULL)
-				brubeck_metric_record(metric, msg.value, msg.sample_freq, msg.modifiers);
+			goto next;
 		}
 
+		key = msg.key;
+		key_len = msg.key_len;
+
+		if (msg.tags) {
+			key = series;
+			key_len = brubeck_tags_series(server->tags, series,
+				msg.key, msg.key_len, msg.tags, msg.tags_len);
+
+			if (key_len < 0) {
+				brubeck_stats_inc(server, errors);
+				log_splunk("sampler=statsd event=tags_full");
+				goto next;
+			}
+		}
+
+		brubeck_stats_inc(server, metrics);
+		metric = brubeck_metric_find(server, key, key_len, msg.type);
+		if (metric != NULL) {
+			if (msg.type == BRUBECK_MT_SET) {
+				if (brubeck_metric_record_member(metric, msg.member, msg.member_len) < 0)
+					brubeck_stats_inc(server, errors);
+			} else {
+				brubeck_metric_record_values(metric, msg.values,
+					msg.value_count, msg.sample_freq, msg.modifiers);
+			}
+		}
+
+next:
 		/* move buf past this stat */
 		buffer = stat_end + 1;
 	}
@@ -268,13 +412,8 @@ void brubeck_statsd_packet_parse(struct brubeck_server *server, char *buffer, ch
 static void *statsd__thread(void *_in)
 {
 	struct brubeck_statsd *statsd = _in;
-	int sock = statsd->sampler.in_sock;
-
-#ifdef SO_REUSEPORT
-	if (sock < 0) {
-		sock = brubeck_sampler_socket(&statsd->sampler, 1);
-	}
-#endif
+	unsigned int n = brubeck_atomic_inc(&statsd->next_socket) - 1;
+	int sock = statsd->sampler.sockets[n % statsd->sampler.socket_count];
 
 	assert(sock >= 0);
 
@@ -300,6 +439,11 @@ static void run_worker_threads(struct brubeck_statsd *statsd)
 	}
 }
 
+static void parse_packet(struct brubeck_sampler *sampler, char *buffer, size_t len)
+{
+	brubeck_statsd_packet_parse(sampler->server, buffer, buffer + len);
+}
+
 static void shutdown_sampler(struct brubeck_sampler *sampler)
 {
 	struct brubeck_statsd *statsd = (struct brubeck_statsd *)sampler;
@@ -308,6 +452,10 @@ static void shutdown_sampler(struct brubeck_sampler *sampler)
 	for (i = 0; i < statsd->worker_count; ++i) {
 		pthread_cancel(statsd->workers[i]);
 	}
+
+	for (i = 0; i < statsd->worker_count; ++i) {
+		pthread_join(statsd->workers[i], NULL);
+	}
 }
 
 struct brubeck_sampler *
@@ -321,9 +469,11 @@ brubeck_statsd_new(struct brubeck_server *server, json_t *settings)
 
 	std->sampler.type = BRUBECK_SAMPLER_STATSD;
 	std->sampler.shutdown = &shutdown_sampler;
+	std->sampler.parse = &parse_packet;
 	std->sampler.in_sock = -1;
 	std->worker_count = 4;
 	std->mmsg_count = 1;
+	std->next_socket = 0;
 
 	json_unpack_or_die(settings,
 		"{s:s, s:i, s?:i, s?:i, s?:b}",
@@ -339,8 +489,9 @@ brubeck_statsd_new(struct brubeck_server *server, json_t *settings)
 	multisock = 0;
 #endif
 
-	if (!multisock)
-		std->sampler.in_sock = brubeck_sampler_socket(&std->sampler, 0);
+	/* with multisock, every worker gets its own socket */
+	brubeck_sampler_open(&std->sampler,
+		multisock ? std->worker_count : 1, multisock);
 
 	run_worker_threads(std);
 	return &std->sampler;
@@ -3,13 +3,21 @@
 
 #include "bloom.h"
 
+/* values in a single packed `key:1:2:3|ms` line */
+#define BRUBECK_STATSD_MAX_VALUES 512
+
 struct brubeck_statsd_msg {
 	char *key;      /* The key of the message, NULL terminated */
 	uint16_t key_len; /* length of the key */
 	uint16_t type;	/* type of the messaged, as a brubeck_mt_t */
-	value_t value;	/* floating point value of the message */
+	uint16_t value_count; /* number of values in the message */
+	value_t values[BRUBECK_STATSD_MAX_VALUES]; /* floating point values of the message */
 	value_t sample_freq; /* floating poit sample freq (1.0 / sample_rate) */
 	uint8_t modifiers; /* modifiers, as a brubeck_metric_mod_t */
+	char *member; /* for sets, the raw value between ':' and '|' */
+	uint16_t member_len;
+	char *tags; /* DogStatsD tags, `key:value,...`, or NULL */
+	uint16_t tags_len;
 };
 
 struct brubeck_statsd {
@@ -17,17 +25,22 @@ struct brubeck_statsd {
 	pthread_t *workers;
 	unsigned int worker_count;
 	unsigned int mmsg_count;
+	unsigned int next_socket;
 };
 
 struct brubeck_statsd_secure {
 	struct brubeck_sampler sampler;
 	const char *hmac_key;
+	struct brubeck_hmac_sha256 hmac;
 
 	struct multibloom *replays;
 	time_t now;
 	time_t drift;
 
-	pthread_t thread;
+	pthread_t *workers;
+	unsigned int worker_count;
+	unsigned int mmsg_count;
+	unsigned int next_socket;
 };
 
 void brubeck_statsd_packet_parse(struct brubeck_server *server, char *buffer, char *end);
@@ -2,6 +2,7 @@
 #include <sys/signal.h>
 #include <sys/timerfd.h>
 #include <poll.h>
+#include <time.h>
 
 #include "brubeck.h"
 
@@ -18,6 +19,8 @@ update_flows(struct brubeck_server *server)
 		sampler->current_flow = sampler->inflow;
 		sampler->inflow = 0;
 	}
+
+	brubeck_flows_tick(&server->flows);
 }
 
 #define UTF8_UPARROW "\xE2\x86\x91"
@@ -45,7 +48,7 @@ update_proctitle(struct brubeck_server *server)
 			PUTS("%s #%d %.1f%s%s",
 				(i > 0) ? "," : "",
 				i + 1, sent, size_suffix[j],
-				(carbon->out_sock >= 0) ? "" : " (dc)");
+				(carbon->state == CARBON_CONNECTED) ? "" : " (dc)");
 		}
 	}
 
@@ -63,20 +66,10 @@ update_proctitle(struct brubeck_server *server)
 	setproctitle("brubeck", buf);
 }
 
-static void
-expire_metric(struct brubeck_metric *mt, void *_)
-{
-	/* If this metric is not disabled, turn "inactive"
-	 * into "disabled" and "active" into "inactive"
-	 */
-	if (mt->expire > BRUBECK_EXPIRE_DISABLED)
-		mt->expire = mt->expire - 1;
-}
-
 static void
 dump_metric(struct brubeck_metric *mt, void *out_file)
 {
-	static const char *METRIC_NAMES[] = {"g", "c", "C", "h", "ms", "internal"};
+	static const char *METRIC_NAMES[] = {"g", "c", "C", "h", "ms", "s", "internal"};
 	fprintf((FILE *)out_file, "%s|%s\n", mt->key, METRIC_NAMES[mt->type]);
 }
 
@@ -99,39 +92,171 @@ dump_all_metrics(struct brubeck_server *server)
 	fclose(dump);
 }
 
+static struct brubeck_backend *
+new_backend(struct brubeck_server *server, json_t *settings, int shard_n);
+
+/*
+ * Rollups are configured inline, as a list of overrides for the
+ * settings of their backend: typically, a longer frequency and the
+ * address of the cluster that stores that resolution.
+ */
+static void load_rollups(struct brubeck_server *server,
+	struct brubeck_backend *backend, json_t *rollups, int shard_n)
+{
+	size_t idx;
+	json_t *r;
+
+	if (!json_is_array(rollups))
+		die("config error: backend rollups must be an array");
+
+	json_array_foreach(rollups, idx, r) {
+		struct brubeck_backend *rollup;
+		json_t *settings;
+
+		if (!json_is_object(r))
+			die("config error: backend rollups must be objects");
+
+		if (backend->rollup_count == BRUBECK_MAX_ROLLUPS)
+			die("too many rollups (max %d)", BRUBECK_MAX_ROLLUPS);
+
+		settings = json_copy(backend->settings);
+		json_object_update(settings, r);
+		json_object_del(settings, "rollups");
+
+		rollup = new_backend(server, settings, shard_n);
+		json_decref(settings);
+
+		if (rollup->sample_freq <= backend->sample_freq)
+			die("config error: rollup frequency (%d) must be longer than its backend's (%d)",
+				rollup->sample_freq, backend->sample_freq);
+
+		rollup->parent = backend;
+		rollup->rollup_n = backend->rollup_count;
+		backend->rollups[backend->rollup_count++] = rollup;
+
+		log_splunk("backend=%s event=rollup frequency=%d parent_frequency=%d",
+			brubeck_backend_name(rollup), rollup->sample_freq, backend->sample_freq);
+	}
+}
+
+static struct brubeck_backend *
+new_backend(struct brubeck_server *server, json_t *settings, int shard_n)
+{
+	const char *type = json_string_value(json_object_get(settings, "type"));
+	json_t *rollups = json_object_get(settings, "rollups");
+	struct brubeck_backend *backend;
+
+	if (type && !strcmp(type, "carbon")) {
+		backend = brubeck_carbon_new(server, settings, shard_n);
+	} else {
+		log_splunk("backend=%s event=invalid_backend", type);
+		return NULL;
+	}
+
+	backend->settings = json_incref(settings);
+
+	if (rollups)
+		load_rollups(server, backend, rollups, shard_n);
+
+	return backend;
+}
+
 static void load_backends(struct brubeck_server *server, json_t *backends)
 {
 	size_t idx;
 	json_t *b;
 
 	json_array_foreach(backends, idx, b) {
-		const char *type = json_string_value(json_object_get(b, "type"));
-		struct brubeck_backend *backend = NULL;
+		struct brubeck_backend *backend;
 
-		if (type && !strcmp(type, "carbon")) {
-			backend = brubeck_carbon_new(server, b, server->active_backends);
-			server->backends[server->active_backends++] = backend; 
-		} else {
-			log_splunk("backend=%s event=invalid_backend", type);
+		if (server->active_backends == BRUBECK_MAX_BACKENDS)
+			die("too many backends (max %d)", BRUBECK_MAX_BACKENDS);
+
+		backend = new_backend(server, b, server->active_backends);
+		if (backend) {
+			server->backends[server->active_backends++] = backend;
+			brubeck_backend_run_threaded(backend);
 		}
 	}
 }
 
+static int sharding_mode(json_t *sharding, enum brubeck_shard_mode *mode)
+{
+	*mode = BRUBECK_SHARD_MODULO;
+
+	/* legacy configs use `"sharding" : false` */
+	if (sharding && json_is_string(sharding))
+		return brubeck_sharding_mode(json_string_value(sharding), mode);
+
+	return 0;
+}
+
+static void init_sharding(struct brubeck_sharding *sharding,
+	enum brubeck_shard_mode mode, int replicas,
+	struct brubeck_backend **backends, int count)
+{
+	const char *keys[BRUBECK_MAX_BACKENDS];
+	int weights[BRUBECK_MAX_BACKENDS];
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		keys[i] = backends[i]->shard_key;
+		weights[i] = backends[i]->weight;
+	}
+
+	brubeck_sharding_init(sharding, mode, replicas, keys, weights, count);
+}
+
+static void load_sharding(struct brubeck_server *server, json_t *sharding, int replicas)
+{
+	enum brubeck_shard_mode mode;
+
+	if (sharding_mode(sharding, &mode) < 0)
+		die("config error: invalid sharding mode '%s'", json_string_value(sharding));
+
+	init_sharding(&server->sharding, mode, replicas,
+		server->backends, server->active_backends);
+
+	log_splunk("event=sharding mode=%s shards=%d replicas=%d",
+		json_is_string(sharding) ? json_string_value(sharding) : "modulo",
+		server->sharding.shards, server->sharding.replicas);
+}
+
+static struct brubeck_sampler *
+new_sampler(struct brubeck_server *server, json_t *settings)
+{
+	const char *type = json_string_value(json_object_get(settings, "type"));
+	struct brubeck_sampler *sampler;
+
+	if (type && !strcmp(type, "statsd")) {
+		sampler = brubeck_statsd_new(server, settings);
+	} else if (type && !strcmp(type, "statsd-secure")) {
+		sampler = brubeck_statsd_secure_new(server, settings);
+	} else if (type && !strcmp(type, "binary")) {
+		sampler = brubeck_binary_new(server, settings);
+	} else {
+		log_splunk("sampler=%s event=invalid_sampler", type);
+		return NULL;
+	}
+
+	sampler->settings = json_incref(settings);
+	return sampler;
+}
+
 static void load_samplers(struct brubeck_server *server, json_t *samplers)
 {
 	size_t idx;
 	json_t *s;
 
 	json_array_foreach(samplers, idx, s) {
-		const char *type = json_string_value(json_object_get(s, "type"));
-
-		if (type && !strcmp(type, "statsd")) {
-			server->samplers[server->active_samplers++] = brubeck_statsd_new(server, s);
-		} else if (type && !strcmp(type, "statsd-secure")) {
-			server->samplers[server->active_samplers++] = brubeck_statsd_secure_new(server, s);
-		} else {
-			log_splunk("sampler=%s event=invalid_sampler", type);
-		}
+		struct brubeck_sampler *sampler;
+
+		if (server->active_samplers == BRUBECK_MAX_SAMPLERS)
+			die("too many samplers (max %d)", BRUBECK_MAX_SAMPLERS);
+
+		sampler = new_sampler(server, s);
+		if (sampler)
+			server->samplers[server->active_samplers++] = sampler;
 	}
 }
 
@@ -163,6 +288,7 @@ static int load_signalfd(void)
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
 	sigaddset(&mask, SIGUSR2);
 
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
@@ -194,10 +320,18 @@ static void load_config(struct brubeck_server *server, const char *path)
 	/* optional */
 	int expire = 0;
 	char *http = NULL;
+	json_t *sharding = NULL;
+	json_t *aggregates = NULL;
+	json_t *filter = NULL;
+	int replicas = 1;
+	int flow_sample_rate = BRUBECK_FLOW_SAMPLE_RATE;
+	int shutdown_timeout = BRUBECK_SHUTDOWN_TIMEOUT;
 
 	server->name = "brubeck";
 	server->config_name = get_config_name(path);
+	server->config_path = path;
 	server->dump_path = NULL;
+	server->cache_path = NULL;
 	server->config = json_load_file(path, 0, &error);
 	if (!server->config) {
 		die("failed to load config file, %s (%s:%d:%d)",
@@ -205,14 +339,22 @@ static void load_config(struct brubeck_server *server, const char *path)
 	}
 
 	json_unpack_or_die(server->config,
-		"{s?:s, s:s, s:i, s:o, s:o, s?:s, s?:i}",
+		"{s?:s, s:s, s:i, s:o, s:o, s?:s, s?:i, s?:o, s?:i, s?:i, s?:s, s?:s, s?:i, s?:o, s?:o}",
 		"server_name", &server->name,
 		"dumpfile", &server->dump_path,
 		"capacity", &capacity,
 		"backends", &backends,
 		"samplers", &samplers,
 		"http", &http,
-		"expire", &expire);
+		"expire", &expire,
+		"sharding", &sharding,
+		"replicas", &replicas,
+		"flow_sample_rate", &flow_sample_rate,
+		"cache", &server->cache_path,
+		"handoff", &server->handoff.path,
+		"shutdown_timeout", &shutdown_timeout,
+		"aggregates", &aggregates,
+		"filter", &filter);
 
 	gh_log_set_instance(server->name);
 
@@ -220,8 +362,31 @@ static void load_config(struct brubeck_server *server, const char *path)
 	if (!server->metrics)
 	    die("failed to initialize hash table (size: %lu)", 1ul << capacity);
 
+	server->tags = brubeck_tags_new(&server->slab);
+	if (!server->tags)
+		die("failed to initialize tag dictionary");
+
+	if (filter)
+		server->filter = brubeck_filter_new(filter);
+
+	if (aggregates)
+		server->aggregation = brubeck_aggregation_new(aggregates);
+
+	brubeck_flows_init(&server->flows, flow_sample_rate);
+	server->shutdown_timeout = shutdown_timeout;
+
 	load_backends(server, backends);
+	load_sharding(server, sharding, replicas);
+
+	/* take over the sockets of the instance we're replacing, which
+	 * saves its cache right before handing them over */
+	brubeck_handoff_receive(&server->handoff);
+
+	/* warm the table before any samples come in */
+	brubeck_cache_load(server);
+
 	load_samplers(server, samplers);
+	brubeck_handoff_listen(&server->handoff);
 
 	if (http) brubeck_http_endpoint_init(server, http);
 	if (expire) server->fd_expire = load_timerfd(expire);
@@ -235,12 +400,16 @@ void brubeck_server_init(struct brubeck_server *server, const char *config)
 	 * backends get disconnected */
 	signal(SIGPIPE, SIG_IGN);
 
+	/* samplers read the clock as soon as they start */
+	brubeck_clock_init();
+
 	server->fd_signal = load_signalfd();
 	server->fd_update = load_timerfd(1);
 	server->fd_expire = -1;
 
 	/* init the memory allocator */
 	brubeck_slab_init(&server->slab);
+	pthread_rwlock_init(&server->shard_lock, NULL);
 
 	/* init the samplers and backends */
 	load_config(server, config);
@@ -270,11 +439,467 @@ static int signal_triggered(struct pollfd *fd)
 	return -1;
 }
 
+static void stop_samplers(struct brubeck_server *server)
+{
+	int i;
+
+	for (i = 0; i < server->active_samplers; ++i) {
+		struct brubeck_sampler *sampler = server->samplers[i];
+		if (sampler->shutdown)
+			sampler->shutdown(sampler);
+	}
+}
+
+static void drain_samplers(struct brubeck_server *server, const struct timespec *deadline)
+{
+	int i;
+
+	for (i = 0; i < server->active_samplers; ++i)
+		brubeck_sampler_drain(server->samplers[i], deadline);
+}
+
+/*
+ * Stop the backend threads and sample all the metrics one last
+ * time, so the partial interval since the last flush isn't lost.
+ */
+static void flush_backends(struct brubeck_server *server)
+{
+	int i;
+
+	for (i = 0; i < server->active_backends; ++i)
+		brubeck_backend_stop(server->backends[i]);
+
+	/* rollups go after their backend, so their last window
+	 * includes its last interval, even if it's incomplete */
+	for (i = 0; i < server->active_backends; ++i) {
+		struct brubeck_backend *backend = server->backends[i];
+		int j;
+
+		brubeck_backend_flush(backend);
+		for (j = 0; j < backend->rollup_count; ++j)
+			brubeck_backend_flush(backend->rollups[j]);
+	}
+}
+
+static bool backend_drained(struct brubeck_backend *backend)
+{
+	int i;
+
+	if (backend->drained && !backend->drained(backend))
+		return false;
+
+	for (i = 0; i < backend->rollup_count; ++i) {
+		if (!backend_drained(backend->rollups[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Wait for the backends to send out everything that has been
+ * flushed, until the deadline.
+ */
+static void drain_backends(struct brubeck_server *server, const struct timespec *deadline)
+{
+	struct timespec now;
+	int i, pending;
+
+	for (;;) {
+		for (i = 0, pending = 0; i < server->active_backends; ++i) {
+			if (!backend_drained(server->backends[i]))
+				pending++;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (!pending || now.tv_sec > deadline->tv_sec ||
+			(now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+			log_splunk("event=final_flush pending_backends=%d", pending);
+			return;
+		}
+
+		usleep(10000);
+	}
+}
+
+static void shutdown_deadline(struct brubeck_server *server, struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += server->shutdown_timeout;
+}
+
+/*
+ * Config reloads (on SIGHUP). Samplers and backends whose settings
+ * haven't changed are kept as they are; backends can also change
+ * their flush frequency in place. Everything else is started or torn
+ * down, without touching the metrics table.
+ */
+struct reload {
+	struct brubeck_server *server;
+	struct brubeck_backend *backends[BRUBECK_MAX_BACKENDS];
+	struct brubeck_backend *removed[BRUBECK_MAX_BACKENDS];
+	int count, removed_count;
+	struct brubeck_sharding sharding;
+};
+
+static void reload_internal_stats(struct brubeck_server *server)
+{
+	struct brubeck_metric *internal = brubeck_hashtable_find(
+		server->metrics, server->name, (uint16_t)strlen(server->name));
+
+	if (internal) {
+		pthread_rwlock_rdlock(&server->shard_lock);
+		server->internal_stats.sample_freq =
+			brubeck_metric_shard(server, internal)->sample_freq;
+		pthread_rwlock_unlock(&server->shard_lock);
+	}
+}
+
+static void renumber_backend(struct brubeck_backend *backend, const int *shard_map)
+{
+	const int shard_n = shard_map[backend->shard_n];
+
+	if (backend->renumber)
+		backend->renumber(backend, shard_map);
+	backend->shard_n = shard_n;
+}
+
+/*
+ * Moving metrics between backends can take a while with a large
+ * table, so it happens in the background. Flushing is paused in
+ * the meantime, but ingest carries on: new metrics go straight to
+ * their new backend.
+ */
+static void *reload__thread(void *_ptr)
+{
+	struct reload *reload = _ptr;
+	struct brubeck_server *server = reload->server;
+	struct brubeck_backend *old[BRUBECK_MAX_BACKENDS];
+	struct brubeck_metric *queues[BRUBECK_MAX_BACKENDS];
+	int shard_map[BRUBECK_MAX_BACKENDS];
+	struct brubeck_sharding old_sharding;
+	struct timespec deadline;
+	int i, j, old_count = server->active_backends;
+	size_t moved = 0;
+
+	memcpy(old, server->backends, sizeof(old));
+
+	for (i = 0; i < old_count; ++i)
+		brubeck_backend_stop(old[i]);
+
+	/* what has been flushed already is queued by shard number
+	 * of the producer, so send it out before renumbering */
+	shutdown_deadline(server, &deadline);
+	drain_backends(server, &deadline);
+
+	for (i = 0; i < BRUBECK_MAX_BACKENDS; ++i) {
+		shard_map[i] = -1;
+		for (j = 0; i < old_count && j < reload->count; ++j) {
+			if (reload->backends[j] == old[i])
+				shard_map[i] = j;
+		}
+	}
+
+	for (i = 0; i < old_count; ++i) {
+		if (shard_map[i] >= 0) {
+			renumber_backend(old[i], shard_map);
+			for (j = 0; j < old[i]->rollup_count; ++j)
+				renumber_backend(old[i]->rollups[j], shard_map);
+		}
+	}
+
+	pthread_rwlock_wrlock(&server->shard_lock);
+	old_sharding = server->sharding;
+	memcpy(server->backends, reload->backends, sizeof(reload->backends));
+	server->active_backends = reload->count;
+	server->sharding = reload->sharding;
+	pthread_rwlock_unlock(&server->shard_lock);
+
+	brubeck_sharding_free(&old_sharding);
+
+	for (i = 0; i < reload->removed_count; ++i) {
+		struct brubeck_backend *backend = reload->removed[i];
+
+		if (backend->shutdown)
+			backend->shutdown(backend);
+
+		for (j = 0; j < backend->rollup_count; ++j) {
+			if (backend->rollups[j]->shutdown)
+				backend->rollups[j]->shutdown(backend->rollups[j]);
+		}
+	}
+
+	/* take all the queues first, so that no metric is moved twice */
+	for (i = 0; i < old_count; ++i)
+		queues[i] = brubeck_atomic_swap(&old[i]->queue, NULL);
+
+	for (i = 0; i < old_count; ++i) {
+		struct brubeck_metric *mt = queues[i];
+
+		while (mt) {
+			struct brubeck_metric *next = mt->next;
+			brubeck_backend_register_metric(brubeck_metric_shard(server, mt), mt);
+			mt = next;
+			moved++;
+		}
+	}
+
+	for (i = 0; i < reload->count; ++i)
+		brubeck_backend_run_threaded(reload->backends[i]);
+
+	reload_internal_stats(server);
+
+	log_splunk("event=reload_backends backends=%d removed=%d metrics=%zu",
+		reload->count, reload->removed_count, moved);
+
+	free(reload);
+	brubeck_barrier();
+	server->reloading = 0;
+	return NULL;
+}
+
+/* the flush frequency is the only setting that changes in place */
+static bool same_backend(json_t *a, json_t *b)
+{
+	json_t *ca = json_deep_copy(a);
+	json_t *cb = json_deep_copy(b);
+	bool same;
+
+	json_object_del(ca, "frequency");
+	json_object_del(cb, "frequency");
+	same = json_equal(ca, cb);
+
+	json_decref(ca);
+	json_decref(cb);
+	return same;
+}
+
+static void reload_backends(struct brubeck_server *server,
+	json_t *backends, enum brubeck_shard_mode mode, int replicas)
+{
+	bool kept[BRUBECK_MAX_BACKENDS] = { false };
+	struct reload *reload;
+	pthread_t thread;
+	bool changed = false;
+	size_t idx;
+	json_t *b;
+	int i;
+
+	reload = xcalloc(1, sizeof(struct reload));
+	reload->server = server;
+
+	json_array_foreach(backends, idx, b) {
+		struct brubeck_backend *backend = NULL;
+
+		if (reload->count == BRUBECK_MAX_BACKENDS) {
+			log_splunk("event=reload_too_many_backends max=%d", BRUBECK_MAX_BACKENDS);
+			break;
+		}
+
+		for (i = 0; i < server->active_backends; ++i) {
+			if (!kept[i] && same_backend(server->backends[i]->settings, b)) {
+				backend = server->backends[i];
+				kept[i] = true;
+
+				json_unpack(b, "{s:i}", "frequency", &backend->sample_freq);
+				json_decref(backend->settings);
+				backend->settings = json_incref(b);
+				break;
+			}
+		}
+
+		if (!backend) {
+			backend = new_backend(server, b, reload->count);
+			if (!backend)
+				continue;
+		}
+
+		if (reload->count >= server->active_backends ||
+			server->backends[reload->count] != backend)
+			changed = true;
+
+		reload->backends[reload->count++] = backend;
+	}
+
+	for (i = 0; i < server->active_backends; ++i) {
+		if (!kept[i]) {
+			reload->removed[reload->removed_count++] = server->backends[i];
+			changed = true;
+		}
+	}
+
+	init_sharding(&reload->sharding, mode, replicas, reload->backends, reload->count);
+
+	if (!changed &&
+		reload->sharding.mode == server->sharding.mode &&
+		reload->sharding.replicas == server->sharding.replicas) {
+		brubeck_sharding_free(&reload->sharding);
+		free(reload);
+		reload_internal_stats(server);
+		return;
+	}
+
+	server->reloading = 1;
+
+	if (pthread_create(&thread, NULL, &reload__thread, reload) != 0)
+		die("failed to start reload thread");
+
+	pthread_detach(thread);
+}
+
+static void reload_samplers(struct brubeck_server *server, json_t *samplers)
+{
+	struct brubeck_sampler *next[BRUBECK_MAX_SAMPLERS];
+	bool kept[BRUBECK_MAX_SAMPLERS] = { false };
+	struct timespec deadline;
+	int i, count = 0, removed = 0;
+	size_t idx;
+	json_t *s;
+
+	json_array_foreach(samplers, idx, s) {
+		struct brubeck_sampler *sampler = NULL;
+
+		if (count == BRUBECK_MAX_SAMPLERS) {
+			log_splunk("event=reload_too_many_samplers max=%d", BRUBECK_MAX_SAMPLERS);
+			break;
+		}
+
+		for (i = 0; i < server->active_samplers; ++i) {
+			if (!kept[i] && json_equal(server->samplers[i]->settings, s)) {
+				sampler = server->samplers[i];
+				kept[i] = true;
+				break;
+			}
+		}
+
+		if (!sampler)
+			sampler = new_sampler(server, s);
+
+		if (sampler)
+			next[count++] = sampler;
+	}
+
+	/* the replacements are already listening, so whatever the old
+	 * samplers still have in their sockets can be drained */
+	shutdown_deadline(server, &deadline);
+
+	for (i = 0; i < server->active_samplers; ++i) {
+		struct brubeck_sampler *sampler = server->samplers[i];
+
+		if (kept[i])
+			continue;
+
+		if (sampler->shutdown)
+			sampler->shutdown(sampler);
+
+		brubeck_sampler_drain(sampler, &deadline);
+		brubeck_sampler_close(sampler);
+		removed++;
+	}
+
+	memcpy(server->samplers, next, count * sizeof(struct brubeck_sampler *));
+	server->active_samplers = count;
+
+	log_splunk("event=reload_samplers samplers=%d removed=%d", count, removed);
+}
+
+static void reload_config(struct brubeck_server *server)
+{
+	enum brubeck_shard_mode mode;
+	json_t *config, *backends, *samplers, *sharding = NULL;
+	int replicas = 1, shutdown_timeout = BRUBECK_SHUTDOWN_TIMEOUT;
+	json_error_t error;
+
+	if (server->reloading) {
+		log_splunk("event=reload_busy");
+		return;
+	}
+
+	config = json_load_file(server->config_path, 0, &error);
+	if (!config) {
+		log_splunk("event=reload_failed error=\"%s\" line=%d", error.text, error.line);
+		return;
+	}
+
+	if (json_unpack_ex(config, &error, 0, "{s:o, s:o, s?:o, s?:i, s?:i}",
+			"backends", &backends,
+			"samplers", &samplers,
+			"sharding", &sharding,
+			"replicas", &replicas,
+			"shutdown_timeout", &shutdown_timeout) < 0) {
+		log_splunk("event=reload_failed error=\"%s\"", error.text);
+		json_decref(config);
+		return;
+	}
+
+	if (!json_is_array(backends) || json_array_size(backends) == 0 ||
+		!json_is_array(samplers) || sharding_mode(sharding, &mode) < 0) {
+		log_splunk("event=reload_failed error=\"invalid backends, samplers or sharding\"");
+		json_decref(config);
+		return;
+	}
+
+	log_splunk("event=reload_config path=%s", server->config_path);
+
+	server->shutdown_timeout = shutdown_timeout;
+	reload_backends(server, backends, mode, replicas);
+	reload_samplers(server, samplers);
+
+	/* strings from the previous config (server name, paths) are
+	 * still in use, so it is never freed */
+	server->config = config;
+}
+
+static void wait_reload(struct brubeck_server *server)
+{
+	while (brubeck_atomic_fetch(&server->reloading))
+		usleep(10000);
+}
+
+/*
+ * Hand the sampler sockets over to a new instance. Packets keep
+ * queueing up in the sockets while we finish up, and the new
+ * instance will read them.
+ */
+static void hand_off(struct brubeck_server *server, int client)
+{
+	struct timespec deadline;
+
+	wait_reload(server);
+	stop_samplers(server);
+	flush_backends(server);
+	brubeck_cache_save(server);
+
+	if (brubeck_handoff_send(server, client) == 0) {
+		shutdown_deadline(server, &deadline);
+		drain_backends(server, &deadline);
+	}
+}
+
+/*
+ * Stop receiving, parse whatever is still sitting in the socket
+ * buffers, and send out one last flush from all the backends; all
+ * of it within `shutdown_timeout` seconds.
+ */
+static void shut_down(struct brubeck_server *server)
+{
+	struct timespec deadline;
+
+	wait_reload(server);
+	shutdown_deadline(server, &deadline);
+
+	stop_samplers(server);
+	drain_samplers(server, &deadline);
+	flush_backends(server);
+	brubeck_cache_save(server);
+	drain_backends(server, &deadline);
+}
+
 int brubeck_server_run(struct brubeck_server *server)
 {
-	struct pollfd fds[3];
-	int nfd = 2;
-	size_t i;
+	struct pollfd fds[4];
+	bool handed_off = false;
 
 	memset(fds, 0x0, sizeof(fds));
 
@@ -284,23 +909,28 @@ int brubeck_server_run(struct brubeck_server *server)
 	fds[1].fd = server->fd_update;
 	fds[1].events = POLLIN;
 
-	if (server->fd_expire >= 0) {
-		fds[2].fd = server->fd_expire;
-		fds[2].events = POLLIN;
-		nfd++;
-	}
+	/* poll skips the optional ones when their fd is -1 */
+	fds[2].fd = server->fd_expire;
+	fds[2].events = POLLIN;
+
+	fds[3].fd = server->handoff.listen_fd;
+	fds[3].events = POLLIN;
 
 	server->running = 1;
 	log_splunk("event=listening");
 
 	while (server->running) {
-		if (poll(fds, nfd, -1) < 0)
+		if (poll(fds, 4, -1) < 0)
 			continue;
 
 		switch (signal_triggered(&fds[0])) {
 		case SIGHUP:
 			gh_log_reopen();
 			log_splunk("event=reload_log");
+			reload_config(server);
+			break;
+		case SIGUSR1:
+			brubeck_cache_save(server);
 			break;
 		case SIGUSR2:
 			dump_all_metrics(server);
@@ -317,20 +947,26 @@ int brubeck_server_run(struct brubeck_server *server)
 		}
 
 		if (timer_elapsed(&fds[2])) {
+			/* ages every metric at once: "active" metrics become
+			 * "inactive", and "inactive" ones become "disabled" */
 			log_splunk("event=expire_metrics");
-			brubeck_hashtable_foreach(server->metrics, &expire_metric, NULL);
+			brubeck_atomic_inc(&server->expire_epoch);
 		}
-	}
 
-	for (i = 0; i < server->active_backends; ++i)
-		pthread_cancel(server->backends[i]->thread);
+		if (fds[3].revents & POLLIN) {
+			int client = brubeck_handoff_accept(&server->handoff);
 
-	for (i = 0; i < server->active_samplers; ++i) {
-		struct brubeck_sampler *sampler = server->samplers[i];
-		if (sampler->shutdown)
-			sampler->shutdown(sampler);
+			if (client >= 0) {
+				hand_off(server, client);
+				handed_off = true;
+				server->running = 0;
+			}
+		}
 	}
 
+	if (!handed_off)
+		shut_down(server);
+
 	log_splunk("event=shutdown");
 	return 0;
 }
@@ -1,12 +1,15 @@
 #ifndef __BRUBECK_SERVER_H__
 #define __BRUBECK_SERVER_H__
 
+#define BRUBECK_SHUTDOWN_TIMEOUT 5 /* seconds */
+
 struct brubeck_internal_stats {
 	int sample_freq;
 	struct {
 		uint32_t metrics;
 		uint32_t errors;
 		uint32_t unique_keys;
+		uint32_t filtered;
 
 		struct {
 			uint32_t failed;
@@ -21,7 +24,9 @@ struct brubeck_internal_stats {
 struct brubeck_server {
 	const char *name;
 	const char *dump_path;
+	const char *cache_path;
 	const char *config_name;
+	const char *config_path;
 	int running;
 	int active_backends;
 	int active_samplers;
@@ -33,10 +38,28 @@ struct brubeck_server {
 	struct brubeck_slab slab;
 
 	brubeck_hashtable_t *metrics;
+	brubeck_tags_t *tags;
+	struct brubeck_aggregation *aggregation;
+	struct brubeck_filter *filter;
 	int at_capacity;
 
-	struct brubeck_sampler *samplers[8];
-	struct brubeck_backend *backends[8];
+	/* advanced every `expire` seconds; see brubeck_metric_expire */
+	uint32_t expire_epoch;
+
+	struct brubeck_sampler *samplers[BRUBECK_MAX_SAMPLERS];
+	struct brubeck_backend *backends[BRUBECK_MAX_BACKENDS];
+	struct brubeck_sharding sharding;
+
+	/* read-locked while picking the backend of a new metric;
+	 * a config reload write-locks it to swap the backends */
+	pthread_rwlock_t shard_lock;
+	int reloading;
+	struct brubeck_flows flows;
+	struct brubeck_handoff handoff;
+
+	/* how long to wait for the backends to send out
+	 * their final flush, in seconds */
+	int shutdown_timeout;
 
 	json_t *config;
 	struct brubeck_internal_stats internal_stats;
@@ -0,0 +1,422 @@
+#include "brubeck.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define HAVE_X86_SIMD 1
+#	include <cpuid.h>
+#	include <immintrin.h>
+#endif
+
+#define SHA256_BLOCK 64
+#define LANES 8
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+/*
+ * Block `j` of a message that follows `prefix` bytes that have already
+ * been hashed (the key pad), padded as SHA-256 requires. Full blocks
+ * are read straight from the message.
+ */
+static inline const uint8_t *
+message_block(const uint8_t *msg, size_t len, size_t prefix, size_t j, uint8_t *tmp)
+{
+	const size_t blocks = (len + 8) / SHA256_BLOCK + 1;
+	const size_t off = j * SHA256_BLOCK;
+	uint64_t bits;
+	int i;
+
+	if (off + SHA256_BLOCK <= len)
+		return msg + off;
+
+	memset(tmp, 0x0, SHA256_BLOCK);
+
+	if (off < len)
+		memcpy(tmp, msg + off, len - off);
+	if (off <= len)
+		tmp[len - off] = 0x80;
+
+	if (j == blocks - 1) {
+		bits = (uint64_t)(prefix + len) * 8;
+		for (i = 0; i < 8; ++i)
+			tmp[SHA256_BLOCK - 1 - i] = (uint8_t)(bits >> (i * 8));
+	}
+
+	return tmp;
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+compress_scalar(uint32_t state[8], const uint8_t *block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = load_be32(block + i * 4);
+
+	for (i = 16; i < 64; ++i) {
+		uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; ++i) {
+		uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+			((e & f) ^ (~e & g)) + K[i] + w[i];
+		uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Intel's SHA extensions: four rounds per pair of instructions */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+compress_shani(uint32_t state[8], const uint8_t *block)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, tmp, msg[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	abef = state0;
+	cdgh = state1;
+
+	for (i = 0; i < 16; ++i) {
+		__m128i *m = &msg[i & 3];
+
+		if (i < 4) {
+			*m = _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i *)(block + i * 16)), MASK);
+		} else {
+			/* msg[i & 3] still holds the words of group i - 4 */
+			tmp = _mm_sha256msg1_epu32(*m, msg[(i - 3) & 3]);
+			tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i - 1) & 3], msg[(i - 2) & 3], 4));
+			*m = _mm_sha256msg2_epu32(tmp, msg[(i - 1) & 3]);
+		}
+
+		tmp = _mm_add_epi32(*m, _mm_loadu_si128((const __m128i *)&K[i * 4]));
+		state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+		tmp = _mm_shuffle_epi32(tmp, 0x0E);
+		state0 = _mm_sha256rnds2_epu32(state0, state1, tmp);
+	}
+
+	state0 = _mm_add_epi32(state0, abef);
+	state1 = _mm_add_epi32(state1, cdgh);
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+
+/* one block of eight independent messages, one per lane */
+__attribute__((target("avx2")))
+static void
+compress_avx2(__m256i s[8], const uint32_t words[16][LANES])
+{
+	__m256i w[16], a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = _mm256_loadu_si256((const __m256i *)words[i]);
+
+	a = s[0]; b = s[1]; c = s[2]; d = s[3];
+	e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+	for (i = 0; i < 64; ++i) {
+		__m256i t1, t2, wi;
+
+		if (i < 16) {
+			wi = w[i];
+		} else {
+			__m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+			__m256i s0 = XOR3(ROTR8(w15, 7), ROTR8(w15, 18), _mm256_srli_epi32(w15, 3));
+			__m256i s1 = XOR3(ROTR8(w2, 17), ROTR8(w2, 19), _mm256_srli_epi32(w2, 10));
+
+			wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0),
+				_mm256_add_epi32(w[(i - 7) & 15], s1));
+			w[i & 15] = wi;
+		}
+
+		t1 = _mm256_add_epi32(h, XOR3(ROTR8(e, 6), ROTR8(e, 11), ROTR8(e, 25)));
+		t1 = _mm256_add_epi32(t1, _mm256_xor_si256(
+			_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+		t1 = _mm256_add_epi32(t1, _mm256_add_epi32(_mm256_set1_epi32(K[i]), wi));
+
+		t2 = _mm256_add_epi32(XOR3(ROTR8(a, 2), ROTR8(a, 13), ROTR8(a, 22)),
+			XOR3(_mm256_and_si256(a, b), _mm256_and_si256(a, c), _mm256_and_si256(b, c)));
+
+		h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+		d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+	}
+
+	s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+	s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+	s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+	s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+}
+
+/* HMAC of up to eight messages; idle lanes hash an empty message */
+__attribute__((target("avx2")))
+static void
+hmac_avx2(const struct brubeck_hmac_sha256 *hmac,
+	const uint8_t * const *msgs, const size_t *lens, size_t count,
+	uint8_t (*out)[BRUBECK_SHA256_SIZE])
+{
+	uint32_t words[16][LANES], digests[LANES][8], lanes[8][LANES];
+	size_t blocks[LANES], max_blocks = 0, j, l;
+	uint8_t tmp[SHA256_BLOCK];
+	__m256i s[8];
+	int i;
+
+	for (l = 0; l < LANES; ++l) {
+		size_t len = l < count ? lens[l] : 0;
+		blocks[l] = (len + 8) / SHA256_BLOCK + 1;
+		if (blocks[l] > max_blocks)
+			max_blocks = blocks[l];
+	}
+
+	for (i = 0; i < 8; ++i)
+		s[i] = _mm256_set1_epi32(hmac->inner[i]);
+
+	for (j = 0; j < max_blocks; ++j) {
+		int done = 0;
+
+		for (l = 0; l < LANES; ++l) {
+			const uint8_t *block;
+
+			if (l < count && j < blocks[l])
+				block = message_block(msgs[l], lens[l], SHA256_BLOCK, j, tmp);
+			else
+				block = message_block(NULL, 0, SHA256_BLOCK, 0, tmp);
+
+			for (i = 0; i < 16; ++i)
+				words[i][l] = load_be32(block + i * 4);
+
+			done |= (j == blocks[l] - 1);
+		}
+
+		compress_avx2(s, (const uint32_t (*)[LANES])words);
+
+		/* save the inner hash of the lanes that just finished */
+		if (done) {
+			for (i = 0; i < 8; ++i)
+				_mm256_storeu_si256((__m256i *)lanes[i], s[i]);
+
+			for (l = 0; l < LANES; ++l) {
+				if (j == blocks[l] - 1) {
+					for (i = 0; i < 8; ++i)
+						digests[l][i] = lanes[i][l];
+				}
+			}
+		}
+	}
+
+	/* the outer hash is always a single block: the 32 byte inner
+	 * hash after the 64 byte outer pad */
+	for (l = 0; l < LANES; ++l) {
+		for (i = 0; i < 8; ++i)
+			words[i][l] = digests[l][i];
+		words[8][l] = 0x80000000;
+		for (i = 9; i < 15; ++i)
+			words[i][l] = 0;
+		words[15][l] = (SHA256_BLOCK + BRUBECK_SHA256_SIZE) * 8;
+	}
+
+	for (i = 0; i < 8; ++i)
+		s[i] = _mm256_set1_epi32(hmac->outer[i]);
+
+	compress_avx2(s, (const uint32_t (*)[LANES])words);
+
+	for (i = 0; i < 8; ++i)
+		_mm256_storeu_si256((__m256i *)lanes[i], s[i]);
+
+	for (l = 0; l < count; ++l) {
+		for (i = 0; i < 8; ++i)
+			store_be32(out[l] + i * 4, lanes[i][l]);
+	}
+}
+#endif
+
+static int sha256_impl = -1;
+static void (*compress)(uint32_t state[8], const uint8_t *block) = &compress_scalar;
+
+static enum brubeck_sha256_impl sha256_detect(void)
+{
+#ifdef HAVE_X86_SIMD
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if (ebx & (1 << 29))
+			return BRUBECK_SHA256_SHANI;
+		if ((ebx & (1 << 5)) && __builtin_cpu_supports("avx2"))
+			return BRUBECK_SHA256_AVX2;
+	}
+#endif
+	return BRUBECK_SHA256_SCALAR;
+}
+
+bool brubeck_sha256_select(enum brubeck_sha256_impl impl)
+{
+	enum brubeck_sha256_impl best = sha256_detect();
+
+	/* implementations are ranked, so anything above the detected one
+	 * is unsupported. A SHA-NI CPU doesn't imply AVX2 (Goldmont and
+	 * Tremont have one but not the other), so that is checked on its
+	 * own; the scalar path runs anywhere */
+	if (impl > best)
+		return false;
+#ifdef HAVE_X86_SIMD
+	if (impl == BRUBECK_SHA256_AVX2 && !__builtin_cpu_supports("avx2"))
+		return false;
+	compress = (impl == BRUBECK_SHA256_SHANI) ? &compress_shani : &compress_scalar;
+#endif
+
+	sha256_impl = impl;
+	return true;
+}
+
+enum brubeck_sha256_impl brubeck_sha256_impl(void)
+{
+	if (unlikely(sha256_impl < 0))
+		brubeck_sha256_select(sha256_detect());
+	return (enum brubeck_sha256_impl)sha256_impl;
+}
+
+static void
+sha256_digest(const uint32_t state[8], uint8_t *out)
+{
+	int i;
+	for (i = 0; i < 8; ++i)
+		store_be32(out + i * 4, state[i]);
+}
+
+/* hash a message after the given (already hashed) key pad */
+static void
+sha256_from(uint32_t state[8], const uint32_t pad[8], const uint8_t *msg, size_t len, size_t prefix)
+{
+	const size_t blocks = (len + 8) / SHA256_BLOCK + 1;
+	uint8_t tmp[SHA256_BLOCK];
+	size_t j;
+
+	memcpy(state, pad, 8 * sizeof(uint32_t));
+
+	for (j = 0; j < blocks; ++j)
+		compress(state, message_block(msg, len, prefix, j, tmp));
+}
+
+void brubeck_hmac_sha256_init(struct brubeck_hmac_sha256 *hmac, const void *key, size_t len)
+{
+	uint8_t block[SHA256_BLOCK], ipad[SHA256_BLOCK], opad[SHA256_BLOCK];
+	uint32_t state[8];
+	int i;
+
+	brubeck_sha256_impl();
+	memset(block, 0x0, sizeof(block));
+
+	/* long keys are hashed down to their digest */
+	if (len > SHA256_BLOCK) {
+		sha256_from(state, IV, key, len, 0);
+		sha256_digest(state, block);
+	} else {
+		memcpy(block, key, len);
+	}
+
+	for (i = 0; i < SHA256_BLOCK; ++i) {
+		ipad[i] = block[i] ^ 0x36;
+		opad[i] = block[i] ^ 0x5c;
+	}
+
+	memcpy(hmac->inner, IV, sizeof(IV));
+	compress(hmac->inner, ipad);
+	memcpy(hmac->outer, IV, sizeof(IV));
+	compress(hmac->outer, opad);
+}
+
+void brubeck_hmac_sha256(const struct brubeck_hmac_sha256 *hmac,
+	const uint8_t *msg, size_t len, uint8_t *out)
+{
+	uint8_t digest[BRUBECK_SHA256_SIZE];
+	uint32_t state[8];
+
+	sha256_from(state, hmac->inner, msg, len, SHA256_BLOCK);
+	sha256_digest(state, digest);
+
+	sha256_from(state, hmac->outer, digest, sizeof(digest), SHA256_BLOCK);
+	sha256_digest(state, out);
+}
+
+void brubeck_hmac_sha256_batch(const struct brubeck_hmac_sha256 *hmac,
+	const uint8_t * const *msgs, const size_t *lens, size_t count,
+	uint8_t (*out)[BRUBECK_SHA256_SIZE])
+{
+	size_t i = 0;
+
+#ifdef HAVE_X86_SIMD
+	/* a lane costs as much as a whole scalar hash, so only
+	 * fill the registers when most of the lanes are in use */
+	if (brubeck_sha256_impl() == BRUBECK_SHA256_AVX2) {
+		for (; count - i >= LANES / 2; i += LANES) {
+			size_t n = count - i < LANES ? count - i : LANES;
+			hmac_avx2(hmac, msgs + i, lens + i, n, out + i);
+			if (n < LANES) {
+				i = count;
+				break;
+			}
+		}
+	}
+#endif
+
+	for (; i < count; ++i)
+		brubeck_hmac_sha256(hmac, msgs[i], lens[i], out[i]);
+}
@@ -0,0 +1,36 @@
+#ifndef __BRUBECK_SHA256_H__
+#define __BRUBECK_SHA256_H__
+
+/*
+ * HMAC-SHA256 for the statsd-secure sampler. The inner and outer key
+ * pads are hashed once, when the key is loaded, and a batch of packets
+ * can be verified in one call: with AVX2, eight packets are hashed at
+ * once, one per 32-bit SIMD lane. CPUs with the SHA extensions hash
+ * one packet at a time, but faster than the lanes can.
+ */
+#define BRUBECK_SHA256_SIZE 32
+
+enum brubeck_sha256_impl {
+	BRUBECK_SHA256_SCALAR,
+	BRUBECK_SHA256_AVX2,
+	BRUBECK_SHA256_SHANI
+};
+
+struct brubeck_hmac_sha256 {
+	uint32_t inner[8];
+	uint32_t outer[8];
+};
+
+void brubeck_hmac_sha256_init(struct brubeck_hmac_sha256 *hmac, const void *key, size_t len);
+void brubeck_hmac_sha256(const struct brubeck_hmac_sha256 *hmac,
+	const uint8_t *msg, size_t len, uint8_t *out);
+void brubeck_hmac_sha256_batch(const struct brubeck_hmac_sha256 *hmac,
+	const uint8_t * const *msgs, const size_t *lens, size_t count,
+	uint8_t (*out)[BRUBECK_SHA256_SIZE]);
+
+/* the implementation is picked on first use; tests and benchmarks can
+ * force one, which fails if the CPU doesn't support it */
+bool brubeck_sha256_select(enum brubeck_sha256_impl impl);
+enum brubeck_sha256_impl brubeck_sha256_impl(void);
+
+#endif
@@ -0,0 +1,210 @@
+#include "brubeck.h"
+
+static int ring_point_cmp(const void *a, const void *b)
+{
+	const struct brubeck_ring_point *pa = a, *pb = b;
+	if (pa->hash < pb->hash) return -1;
+	if (pa->hash > pb->hash) return 1;
+	return (int)pa->shard - (int)pb->shard;
+}
+
+static void ring_init(struct brubeck_sharding *sharding,
+	const char **shard_keys, const int *weights, int shards)
+{
+	size_t total = 0, n = 0;
+	int s, i;
+
+	for (s = 0; s < shards; ++s)
+		total += (size_t)weights[s] * BRUBECK_RING_POINTS;
+
+	sharding->ring = xmalloc(total * sizeof(struct brubeck_ring_point));
+
+	/* points depend only on the shard key, not on the position
+	 * of the backend in the config */
+	for (s = 0; s < shards; ++s) {
+		for (i = 0; i < weights[s] * BRUBECK_RING_POINTS; ++i) {
+			char point[MAX_ADDR + 16];
+			int len = snprintf(point, sizeof(point), "%s-%d", shard_keys[s], i);
+
+			sharding->ring[n].hash = CityHash32(point, len);
+			sharding->ring[n].shard = (uint8_t)s;
+			n++;
+		}
+	}
+
+	qsort(sharding->ring, n, sizeof(struct brubeck_ring_point), &ring_point_cmp);
+	sharding->ring_len = n;
+}
+
+static void jump_init(struct brubeck_sharding *sharding, const int *weights, int shards)
+{
+	size_t total = 0, n = 0;
+	int s, i;
+
+	for (s = 0; s < shards; ++s)
+		total += weights[s];
+
+	sharding->buckets = xmalloc(total);
+
+	for (s = 0; s < shards; ++s) {
+		for (i = 0; i < weights[s]; ++i)
+			sharding->buckets[n++] = (uint8_t)s;
+	}
+
+	sharding->bucket_len = n;
+}
+
+void brubeck_sharding_init(
+	struct brubeck_sharding *sharding,
+	enum brubeck_shard_mode mode, int replicas,
+	const char **shard_keys, const int *weights, int shards)
+{
+	memset(sharding, 0x0, sizeof(struct brubeck_sharding));
+
+	sharding->mode = mode;
+	sharding->shards = shards;
+	sharding->replicas = (replicas < 1) ? 1 : (replicas > shards ? shards : replicas);
+
+	if (shards <= 1)
+		return;
+
+	switch (mode) {
+	case BRUBECK_SHARD_RING:
+		ring_init(sharding, shard_keys, weights, shards);
+		break;
+	case BRUBECK_SHARD_JUMP:
+		jump_init(sharding, weights, shards);
+		break;
+	case BRUBECK_SHARD_MODULO:
+		break;
+	}
+}
+
+void brubeck_sharding_free(struct brubeck_sharding *sharding)
+{
+	free(sharding->ring);
+	free(sharding->buckets);
+	sharding->ring = NULL;
+	sharding->buckets = NULL;
+}
+
+/*
+ * Jump consistent hash (Lamping & Veach): maps a key to one of
+ * `buckets` buckets, moving only 1/n of the keys when the n-th
+ * bucket is added.
+ */
+static int32_t jump_hash(uint64_t key, int32_t buckets)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+
+	return (int32_t)b;
+}
+
+static inline uint64_t mix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static inline bool has_shard(const uint8_t *shards, int n, uint8_t s)
+{
+	int i;
+	for (i = 0; i < n; ++i) {
+		if (shards[i] == s)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Find the shards that own the given key, primary first. Returns
+ * the number of distinct shards written to `shards`, which is the
+ * replication factor (bounded by `max` and the number of shards).
+ */
+int brubeck_sharding_lookup(
+	struct brubeck_sharding *sharding,
+	const char *key, size_t key_len,
+	uint8_t *shards, int max)
+{
+	const int want = (sharding->replicas < max) ? sharding->replicas : max;
+	uint32_t hash;
+	int n = 0;
+
+	if (sharding->shards <= 1 || want < 1) {
+		shards[0] = 0;
+		return 1;
+	}
+
+	hash = CityHash32(key, key_len);
+
+	switch (sharding->mode) {
+	case BRUBECK_SHARD_MODULO:
+		for (n = 0; n < want; ++n)
+			shards[n] = (uint8_t)((hash + n) % sharding->shards);
+		break;
+
+	case BRUBECK_SHARD_RING: {
+		size_t lo = 0, hi = sharding->ring_len, i;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (sharding->ring[mid].hash < hash)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		/* walk clockwise until we've seen enough distinct shards */
+		for (i = 0; i < sharding->ring_len && n < want; ++i) {
+			uint8_t s = sharding->ring[(lo + i) % sharding->ring_len].shard;
+			if (!has_shard(shards, n, s))
+				shards[n++] = s;
+		}
+		break;
+	}
+
+	case BRUBECK_SHARD_JUMP: {
+		uint64_t k = mix64(hash);
+		int attempts;
+
+		for (attempts = 0; attempts < 64 && n < want; ++attempts) {
+			uint8_t s = sharding->buckets[jump_hash(k, (int32_t)sharding->bucket_len)];
+			if (!has_shard(shards, n, s))
+				shards[n++] = s;
+			k = mix64(k);
+		}
+
+		/* heavily skewed weights: fill up deterministically */
+		for (attempts = 0; n < want; ++attempts) {
+			uint8_t s = (uint8_t)((shards[0] + attempts) % sharding->shards);
+			if (!has_shard(shards, n, s))
+				shards[n++] = s;
+		}
+		break;
+	}
+	}
+
+	return n;
+}
+
+int brubeck_sharding_mode(const char *name, enum brubeck_shard_mode *mode)
+{
+	if (!strcmp(name, "modulo"))
+		*mode = BRUBECK_SHARD_MODULO;
+	else if (!strcmp(name, "ring"))
+		*mode = BRUBECK_SHARD_RING;
+	else if (!strcmp(name, "jump"))
+		*mode = BRUBECK_SHARD_JUMP;
+	else
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __BRUBECK_SHARDING_H__
+#define __BRUBECK_SHARDING_H__
+
+enum brubeck_shard_mode {
+	BRUBECK_SHARD_MODULO,
+	BRUBECK_SHARD_RING,
+	BRUBECK_SHARD_JUMP
+};
+
+/* Virtual nodes per unit of weight in the hash ring */
+#define BRUBECK_RING_POINTS 128
+
+struct brubeck_ring_point {
+	uint32_t hash;
+	uint8_t shard;
+};
+
+struct brubeck_sharding {
+	enum brubeck_shard_mode mode;
+	int shards;
+	int replicas;
+
+	/* ring mode: points sorted by hash */
+	struct brubeck_ring_point *ring;
+	size_t ring_len;
+
+	/* jump mode: one bucket per unit of weight */
+	uint8_t *buckets;
+	size_t bucket_len;
+};
+
+void brubeck_sharding_init(
+	struct brubeck_sharding *sharding,
+	enum brubeck_shard_mode mode, int replicas,
+	const char **shard_keys, const int *weights, int shards);
+
+void brubeck_sharding_free(struct brubeck_sharding *sharding);
+
+int brubeck_sharding_lookup(
+	struct brubeck_sharding *sharding,
+	const char *key, size_t key_len,
+	uint8_t *shards, int max);
+
+int brubeck_sharding_mode(const char *name, enum brubeck_shard_mode *mode);
+
+#endif
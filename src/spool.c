@@ -0,0 +1,190 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "brubeck.h"
+#include "spool.h"
+
+#define SPOOL_MAGIC 0x4C4F4F53 /* SOOL */
+#define SPOOL_VERSION 1
+
+static void spool_copy_in(struct brubeck_spool *spool, uint64_t off, const void *src, uint64_t len)
+{
+	const uint64_t size = spool->header->size;
+	uint64_t first = size - off;
+
+	if (first > len)
+		first = len;
+
+	memcpy(spool->data + off, src, first);
+	memcpy(spool->data, (const unsigned char *)src + first, len - first);
+}
+
+static void spool_copy_out(struct brubeck_spool *spool, uint64_t off, void *dst, uint64_t len)
+{
+	const uint64_t size = spool->header->size;
+	uint64_t first = size - off;
+
+	if (first > len)
+		first = len;
+
+	memcpy(dst, spool->data + off, first);
+	memcpy((unsigned char *)dst + first, spool->data, len - first);
+}
+
+static inline uint64_t spool_advance(struct brubeck_spool *spool, uint64_t off, uint64_t len)
+{
+	return (off + len) % spool->header->size;
+}
+
+static uint32_t spool_head_len(struct brubeck_spool *spool)
+{
+	uint32_t len;
+	spool_copy_out(spool, spool->header->head, &len, sizeof(len));
+	return len;
+}
+
+static void spool_reset(struct brubeck_spool_header *header, uint64_t size)
+{
+	memset(header, 0x0, sizeof(struct brubeck_spool_header));
+	header->magic = SPOOL_MAGIC;
+	header->version = SPOOL_VERSION;
+	header->size = size;
+}
+
+/*
+ * Besides the header, walk the records from head to tail: a torn
+ * or corrupted file could hold lengths that point past the data.
+ */
+static bool spool_valid(struct brubeck_spool *spool, uint64_t size)
+{
+	struct brubeck_spool_header *header = spool->header;
+	uint64_t off, left, i;
+
+	if (header->magic != SPOOL_MAGIC ||
+		header->version != SPOOL_VERSION ||
+		header->size != size ||
+		header->head >= size ||
+		header->tail >= size ||
+		header->used > size ||
+		(header->records == 0 && header->used != 0))
+		return false;
+
+	off = header->head;
+	left = header->used;
+
+	for (i = 0; i < header->records; ++i) {
+		uint32_t len;
+
+		if (left < sizeof(len))
+			return false;
+
+		spool_copy_out(spool, off, &len, sizeof(len));
+		if ((uint64_t)len + sizeof(len) > left)
+			return false;
+
+		off = spool_advance(spool, off, sizeof(len) + len);
+		left -= sizeof(len) + len;
+	}
+
+	return left == 0 && (header->records == 0 || off == header->tail);
+}
+
+struct brubeck_spool *brubeck_spool_open(const char *path, size_t size)
+{
+	struct brubeck_spool *spool;
+	void *map;
+
+	assert(size > sizeof(struct brubeck_spool_header));
+
+	spool = xcalloc(1, sizeof(struct brubeck_spool));
+	spool->path = path;
+	spool->map_size = size;
+	spool->fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if (spool->fd < 0 || ftruncate(spool->fd, size) < 0)
+		die("failed to open spool file '%s'", path);
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+	if (map == MAP_FAILED)
+		die("failed to mmap spool file '%s'", path);
+
+	spool->header = map;
+	spool->data = (unsigned char *)map + sizeof(struct brubeck_spool_header);
+	size -= sizeof(struct brubeck_spool_header);
+
+	/* keep whatever survived a restart, unless it looks corrupted */
+	if (!spool_valid(spool, size))
+		spool_reset(spool->header, size);
+
+	log_splunk("event=spool_open path=%s size=%llu records=%llu",
+		path, (long long unsigned int)size,
+		(long long unsigned int)spool->header->records);
+
+	return spool;
+}
+
+bool brubeck_spool_append(struct brubeck_spool *spool, const void *buf, uint32_t len)
+{
+	struct brubeck_spool_header *header = spool->header;
+	const uint64_t need = sizeof(len) + len;
+
+	if (need > header->size)
+		return false;
+
+	/* evict oldest-first until the new record fits */
+	while (header->size - header->used < need) {
+		uint64_t evict = sizeof(uint32_t) + spool_head_len(spool);
+
+		header->head = spool_advance(spool, header->head, evict);
+		header->used -= evict;
+		header->records--;
+		spool->evicted++;
+	}
+
+	spool_copy_in(spool, header->tail, &len, sizeof(len));
+	spool_copy_in(spool, spool_advance(spool, header->tail, sizeof(len)), buf, len);
+
+	header->tail = spool_advance(spool, header->tail, need);
+	header->used += need;
+	header->records++;
+	return true;
+}
+
+uint32_t brubeck_spool_peek(struct brubeck_spool *spool, void *buf, uint32_t max)
+{
+	struct brubeck_spool_header *header = spool->header;
+	uint32_t len;
+
+	if (header->records == 0)
+		return 0;
+
+	len = spool_head_len(spool);
+	if (buf && len <= max)
+		spool_copy_out(spool, spool_advance(spool, header->head, sizeof(len)), buf, len);
+
+	return len;
+}
+
+void brubeck_spool_pop(struct brubeck_spool *spool)
+{
+	struct brubeck_spool_header *header = spool->header;
+	uint64_t len;
+
+	if (header->records == 0)
+		return;
+
+	len = sizeof(uint32_t) + spool_head_len(spool);
+	header->head = spool_advance(spool, header->head, len);
+	header->used -= len;
+	header->records--;
+
+	if (header->records == 0)
+		header->head = header->tail = 0;
+}
+
+void brubeck_spool_close(struct brubeck_spool *spool)
+{
+	munmap(spool->header, spool->map_size);
+	close(spool->fd);
+	free(spool);
+}
@@ -0,0 +1,44 @@
+#ifndef __BRUBECK_SPOOL_H__
+#define __BRUBECK_SPOOL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Append-only, memory-mapped circular spool. Records are stored
+ * back-to-back (length-prefixed) in a fixed-size data region and
+ * may wrap around its end. When there's no space left for a new
+ * record, the oldest records are evicted.
+ */
+struct brubeck_spool_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t used;
+	uint64_t records;
+};
+
+struct brubeck_spool {
+	const char *path;
+	int fd;
+	size_t map_size;
+	struct brubeck_spool_header *header;
+	unsigned char *data;
+
+	size_t evicted;
+};
+
+struct brubeck_spool *brubeck_spool_open(const char *path, size_t size);
+bool brubeck_spool_append(struct brubeck_spool *spool, const void *buf, uint32_t len);
+uint32_t brubeck_spool_peek(struct brubeck_spool *spool, void *buf, uint32_t max);
+void brubeck_spool_pop(struct brubeck_spool *spool);
+void brubeck_spool_close(struct brubeck_spool *spool);
+
+static inline bool brubeck_spool_empty(struct brubeck_spool *spool)
+{
+	return spool->header->records == 0;
+}
+
+#endif
@@ -0,0 +1,216 @@
+#include "brubeck.h"
+#include "ck_ht.h"
+#include "ck_malloc.h"
+
+#define TAGS_CHUNK_BITS 12
+#define TAGS_CHUNK_SIZE (1 << TAGS_CHUNK_BITS)
+#define TAGS_MAX_CHUNKS 1024
+
+struct tag_string {
+	uint32_t id;
+	uint16_t len;
+	char str[];
+};
+
+struct brubeck_tags {
+	ck_ht_t table;
+	pthread_mutex_t write_mutex;
+	struct brubeck_slab *slab;
+	uint32_t count;
+
+	/* id -> string; chunks are never moved once allocated,
+	 * so lookups don't need to lock */
+	struct tag_string **chunks[TAGS_MAX_CHUNKS];
+};
+
+static void *
+tags_malloc(size_t r)
+{
+	return xmalloc(r);
+}
+
+static void
+tags_free(void *p, size_t b, bool r)
+{
+	free(p);
+}
+
+static struct ck_malloc ALLOCATOR = {
+	.malloc = tags_malloc,
+	.free = tags_free
+};
+
+brubeck_tags_t *brubeck_tags_new(struct brubeck_slab *slab)
+{
+	brubeck_tags_t *tags = xcalloc(1, sizeof(brubeck_tags_t));
+
+	pthread_mutex_init(&tags->write_mutex, NULL);
+	tags->slab = slab;
+
+	if (!ck_ht_init(&tags->table, CK_HT_MODE_BYTESTRING,
+		NULL, &ALLOCATOR, TAGS_CHUNK_SIZE, 0xBADC0FFE)) {
+		free(tags);
+		return NULL;
+	}
+
+	return tags;
+}
+
+static struct tag_string *
+tags_find(brubeck_tags_t *tags, ck_ht_hash_t h, const char *str, uint16_t len)
+{
+	ck_ht_entry_t entry;
+
+	ck_ht_entry_key_set(&entry, str, len);
+	if (ck_ht_get_spmc(&tags->table, h, &entry))
+		return ck_ht_entry_value(&entry);
+
+	return NULL;
+}
+
+static struct tag_string *
+tags_intern(brubeck_tags_t *tags, const char *str, uint16_t len)
+{
+	struct tag_string *tag;
+	ck_ht_entry_t entry;
+	ck_ht_hash_t h;
+	uint32_t id;
+
+	ck_ht_hash(&h, &tags->table, str, len);
+
+	tag = tags_find(tags, h, str, len);
+	if (likely(tag != NULL))
+		return tag;
+
+	pthread_mutex_lock(&tags->write_mutex);
+
+	/* somebody else may have interned it while we waited */
+	tag = tags_find(tags, h, str, len);
+	if (tag != NULL || tags->count == TAGS_MAX_CHUNKS * TAGS_CHUNK_SIZE)
+		goto out;
+
+	id = tags->count;
+	if (!tags->chunks[id >> TAGS_CHUNK_BITS])
+		tags->chunks[id >> TAGS_CHUNK_BITS] =
+			xcalloc(TAGS_CHUNK_SIZE, sizeof(struct tag_string *));
+
+	tag = brubeck_slab_alloc(tags->slab, sizeof(struct tag_string) + len + 1);
+	tag->id = id;
+	tag->len = len;
+	memcpy(tag->str, str, len);
+	tag->str[len] = '\0';
+
+	/* the id must resolve before anybody can find it */
+	tags->chunks[id >> TAGS_CHUNK_BITS][id & (TAGS_CHUNK_SIZE - 1)] = tag;
+	brubeck_barrier();
+
+	ck_ht_entry_set(&entry, h, tag->str, len, tag);
+	ck_ht_put_spmc(&tags->table, h, &entry);
+	tags->count++;
+
+out:
+	pthread_mutex_unlock(&tags->write_mutex);
+	return tag;
+}
+
+const char *brubeck_tags_string(brubeck_tags_t *tags, uint32_t id, uint16_t *len)
+{
+	struct tag_string *tag = tags->chunks[id >> TAGS_CHUNK_BITS][id & (TAGS_CHUNK_SIZE - 1)];
+	*len = tag->len;
+	return tag->str;
+}
+
+/*
+ * Build the series key for a metric name and its list of tags, as
+ * validated by the statsd parser. `series` must have room for
+ * name_len + BRUBECK_TAGS_SERIES_MAX + 1 bytes. Returns the length
+ * of the key, or -1 if the dictionary is full.
+ */
+int brubeck_tags_series(brubeck_tags_t *tags, char *series,
+	const char *name, uint16_t name_len, const char *list, uint16_t list_len)
+{
+	struct brubeck_tag vec[BRUBECK_MAX_TAGS];
+	const char *end = list + list_len;
+	size_t i, n = 0, len;
+
+	while (list < end) {
+		const char *comma = memchr(list, ',', end - list);
+		const char *colon;
+		struct tag_string *key, *value;
+
+		if (!comma)
+			comma = end;
+
+		colon = memchr(list, ':', comma - list);
+		key = tags_intern(tags, list, colon - list);
+		value = tags_intern(tags, colon + 1, comma - colon - 1);
+		if (!key || !value)
+			return -1;
+
+		/* insertion sort by key; a repeated key keeps its last value */
+		for (i = 0; i < n && vec[i].key < key->id; ++i);
+
+		if (i < n && vec[i].key == key->id) {
+			vec[i].value = value->id;
+		} else {
+			memmove(&vec[i + 1], &vec[i], (n - i) * sizeof(struct brubeck_tag));
+			vec[i].key = key->id;
+			vec[i].value = value->id;
+			n++;
+		}
+
+		list = comma + 1;
+	}
+
+	memcpy(series, name, name_len);
+	series[name_len] = '\0';
+	memcpy(series + name_len + 1, vec, n * sizeof(struct brubeck_tag));
+
+	len = name_len + 1 + n * sizeof(struct brubeck_tag);
+	series[len] = '\0';
+	return (int)len;
+}
+
+/*
+ * Render a series as `name<suffix>;key=value;...` into `buf`. Returns
+ * the length of the rendered key, or 0 if it doesn't fit.
+ */
+size_t brubeck_tags_render(brubeck_tags_t *tags, char *buf, size_t size,
+	const char *series, uint16_t series_len, uint8_t tag_count, const char *suffix)
+{
+	const char *ids = series + series_len - tag_count * sizeof(struct brubeck_tag);
+	size_t name_len = ids - series - 1;
+	size_t suffix_len = strlen(suffix);
+	size_t len = name_len + suffix_len;
+	uint8_t i;
+
+	if (len >= size)
+		return 0;
+
+	memcpy(buf, series, name_len);
+	memcpy(buf + name_len, suffix, suffix_len);
+
+	for (i = 0; i < tag_count; ++i) {
+		struct brubeck_tag tag;
+		const char *key, *value;
+		uint16_t key_len, value_len;
+
+		/* the ids follow the name, so they're unaligned */
+		memcpy(&tag, ids + i * sizeof(struct brubeck_tag), sizeof(tag));
+		key = brubeck_tags_string(tags, tag.key, &key_len);
+		value = brubeck_tags_string(tags, tag.value, &value_len);
+
+		if (len + key_len + value_len + 2 >= size)
+			return 0;
+
+		buf[len++] = ';';
+		memcpy(buf + len, key, key_len);
+		len += key_len;
+		buf[len++] = '=';
+		memcpy(buf + len, value, value_len);
+		len += value_len;
+	}
+
+	buf[len] = '\0';
+	return len;
+}
@@ -0,0 +1,37 @@
+#ifndef __BRUBECK_TAGS_H__
+#define __BRUBECK_TAGS_H__
+
+/*
+ * DogStatsD tags (`key:1|c|#host:web1,role:app`). Tag keys and values
+ * are interned in a dictionary shared by all the samplers, so a series
+ * is identified by its name followed by a short vector of ids instead
+ * of by the full text of its tags:
+ *
+ *	name \0 [key id, value id] [key id, value id] ...
+ *
+ * The tags of a series are sorted by key id, so the same set of tags
+ * maps to the same series regardless of the order they were sent in.
+ * Series are only rendered as text (in Graphite's tagged format,
+ * `name;host=web1;role=app`) when they are sampled.
+ */
+#define BRUBECK_MAX_TAGS 16
+#define BRUBECK_TAG_MAX_LEN 255
+#define BRUBECK_TAGS_RENDER_MAX 4096
+
+struct brubeck_tag {
+	uint32_t key;
+	uint32_t value;
+};
+
+#define BRUBECK_TAGS_SERIES_MAX (1 + BRUBECK_MAX_TAGS * sizeof(struct brubeck_tag))
+
+typedef struct brubeck_tags brubeck_tags_t;
+
+brubeck_tags_t *brubeck_tags_new(struct brubeck_slab *slab);
+int brubeck_tags_series(brubeck_tags_t *tags, char *series,
+	const char *name, uint16_t name_len, const char *list, uint16_t list_len);
+size_t brubeck_tags_render(brubeck_tags_t *tags, char *buf, size_t size,
+	const char *series, uint16_t series_len, uint8_t tag_count, const char *suffix);
+const char *brubeck_tags_string(brubeck_tags_t *tags, uint32_t id, uint16_t *len);
+
+#endif
@@ -5,6 +5,7 @@
 #define unlikely(x)     __builtin_expect((x),0)
 #define ct_assert(e) ((void)sizeof(char[1 - 2*!(e)]))
 
+int url_to_inaddr(struct sockaddr_in *addr, const char *url, int port);
 void url_to_inaddr2(struct sockaddr_in *addr, const char *url, int port);
 
 void sock_setnonblock(int fd);
@@ -15,8 +16,12 @@ void sock_enlarge_in(int fd);
 
 char *find_substr(const char *s, const char *find, size_t slen);
 
+/* enough for any double, sign and exponent included */
+#define BRUBECK_DTOA_SIZE 32
+
 int brubeck_itoa(char *ptr, uint32_t number);
-int brubeck_ftoa(char *outbuf, float f);
+int brubeck_utoa(char *outbuf, uint64_t number);
+int brubeck_dtoa(char *outbuf, double value);
 
 static inline int starts_with(const char *str, const char *prefix)
 {
@@ -61,6 +66,7 @@ static inline void *xrealloc(void *ptr, size_t size)
 #define brubeck_atomic_dec(P) __sync_add_and_fetch((P), -1)
 #define brubeck_atomic_add(P, V) __sync_add_and_fetch((P), (V))
 #define brubeck_atomic_swap(P, V) __sync_lock_test_and_set((P), (V))
+#define brubeck_atomic_cas(P, O, N) __sync_bool_compare_and_swap((P), (O), (N))
 #define brubeck_atomic_fetch(P) __sync_add_and_fetch((P), 0)
 
 /* Compile read-write barrier */
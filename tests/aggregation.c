@@ -0,0 +1,117 @@
+#include "brubeck.h"
+#include "sput.h"
+
+static const char *
+target(const struct brubeck_aggregation *aggregation, size_t rule, const char *key)
+{
+	static char buf[BRUBECK_AGGREGATE_KEY_MAX];
+
+	if (!brubeck_aggregation_target(&aggregation->rules[rule],
+			buf, sizeof(buf), key, strlen(key)))
+		return "";
+	return buf;
+}
+
+void test_aggregation__rules(void)
+{
+	struct brubeck_aggregation *aggregation;
+	json_t *rules;
+
+	rules = json_loads(
+		"[{\"pattern\": \"app.<host>.requests\", \"target\": \"app.all.requests\"},"
+		" {\"pattern\": \"<dc>.web*.<metric>\", \"target\": \"<dc>.web.<metric>\", \"drop\": true}]",
+		0, NULL);
+	aggregation = brubeck_aggregation_new(rules);
+
+	sput_fail_unless(aggregation->count == 2 && aggregation->rules[1].drop,
+		"the rules are loaded");
+	sput_fail_unless(!strcmp(target(aggregation, 0, "app.web1.requests"), "app.all.requests"),
+		"a capture matches any segment");
+	sput_fail_unless(!strcmp(target(aggregation, 0, "app.web1.errors"), "") &&
+		!strcmp(target(aggregation, 0, "app.web1.requests.count"), "") &&
+		!strcmp(target(aggregation, 0, "app.requests"), ""),
+		"keys must match every segment");
+	sput_fail_unless(!strcmp(target(aggregation, 1, "ash.web12.latency"), "ash.web.latency"),
+		"captures are substituted into the target");
+	sput_fail_unless(!strcmp(target(aggregation, 1, "ash.db1.latency"), ""),
+		"globs only match within their segment");
+}
+
+static int
+registered(struct brubeck_backend *backend, struct brubeck_metric *metric)
+{
+	struct brubeck_metric *mt;
+
+	for (mt = backend->queue; mt; mt = mt->next) {
+		if (mt == metric)
+			return 1;
+	}
+	return 0;
+}
+
+static struct brubeck_metric *
+find(struct brubeck_server *server, const char *key, uint8_t type)
+{
+	return brubeck_metric_find(server, key, strlen(key), type);
+}
+
+void test_aggregation__records(void)
+{
+	struct brubeck_server server;
+	struct brubeck_backend backend;
+	struct brubeck_metric *web1, *web2, *all, *db1, *db_all, *hits, *h1;
+	const value_t values[] = { 2.0, 3.0 };
+
+	memset(&server, 0x0, sizeof(server));
+	memset(&backend, 0x0, sizeof(backend));
+	brubeck_slab_init(&server.slab);
+	brubeck_flows_init(&server.flows, 1);
+	pthread_rwlock_init(&server.shard_lock, NULL);
+	server.metrics = brubeck_hashtable_new(1 << 10);
+	server.backends[0] = &backend;
+	server.active_backends = 1;
+	backend.server = &server;
+
+	server.aggregation = brubeck_aggregation_new(json_loads(
+		"[{\"pattern\": \"app.<host>.requests\", \"target\": \"app.all.requests\"},"
+		" {\"pattern\": \"db.<host>.latency\", \"target\": \"db.all.latency\", \"drop\": true},"
+		" {\"pattern\": \"cache.<host>.hits\", \"target\": \"cache.all.hits\", \"drop\": true}]",
+		0, NULL));
+
+	web1 = find(&server, "app.web1.requests", BRUBECK_MT_METER);
+	web2 = find(&server, "app.web2.requests", BRUBECK_MT_METER);
+	all = brubeck_hashtable_find(server.metrics, "app.all.requests", 16);
+
+	sput_fail_unless(all && registered(&backend, all) && all->aggregates == NULL,
+		"aggregates are created with their first source");
+	sput_fail_unless(web1->aggregates && web1->aggregates[0] == all && !web1->aggregates[1] &&
+		web2->aggregates && web2->aggregates[0] == all,
+		"sources share an existing aggregate");
+
+	/* created before any of its sources: it matches its own rule */
+	db_all = find(&server, "db.all.latency", BRUBECK_MT_TIMER);
+	db1 = find(&server, "db.db1.latency", BRUBECK_MT_TIMER);
+
+	sput_fail_unless(db_all->aggregates == NULL && !(db_all->flags & BRUBECK_METRIC_DROPPED),
+		"aggregates don't aggregate into themselves");
+	sput_fail_unless((db1->flags & BRUBECK_METRIC_DROPPED) && !registered(&backend, db1) &&
+		db1->aggregates && db1->aggregates[0] == db_all,
+		"dropped sources are not registered");
+
+	hits = find(&server, "cache.all.hits", BRUBECK_MT_METER);
+	h1 = find(&server, "cache.h1.hits", BRUBECK_MT_TIMER);
+
+	sput_fail_unless(h1->aggregates == NULL && !(h1->flags & BRUBECK_METRIC_DROPPED) &&
+		registered(&backend, h1), "sources are not bound to aggregates of another type");
+
+	brubeck_metric_record(web1, 1.0, 1.0, 0);
+	brubeck_metric_record_values(web2, values, 2, 1.0, 0);
+	brubeck_metric_record(db1, 12.0, 1.0, 0);
+
+	sput_fail_unless(web1->as.meter.value == 1.0 && web2->as.meter.value == 5.0,
+		"sources are recorded");
+	sput_fail_unless(all->as.meter.value == 6.0, "aggregates get the records of all their sources");
+	sput_fail_unless(db1->as.histogram.size == 0 && db_all->as.histogram.size == 1,
+		"dropped sources still feed their aggregates");
+	sput_fail_unless(hits->as.meter.value == 0.0, "unbound aggregates get nothing");
+}
@@ -0,0 +1,266 @@
+#include <endian.h>
+#include "sput.h"
+#include "brubeck.h"
+
+struct packet {
+	uint8_t data[512];
+	size_t len;
+};
+
+static void
+packet_init(struct packet *p, uint64_t sender)
+{
+	p->data[0] = BRUBECK_BINARY_MAGIC0;
+	p->data[1] = BRUBECK_BINARY_MAGIC1;
+	p->data[2] = BRUBECK_BINARY_VERSION;
+	p->data[3] = 0;
+	sender = htole64(sender);
+	memcpy(p->data + 4, &sender, sizeof(sender));
+	p->len = BRUBECK_BINARY_HEADER_SIZE;
+}
+
+static size_t
+put_varint(uint8_t *out, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		out[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	out[n++] = (uint8_t)v;
+	return n;
+}
+
+static void
+put_record(struct packet *p, uint8_t op, const uint8_t *body, size_t len)
+{
+	p->data[p->len++] = op;
+	p->len += put_varint(p->data + p->len, len);
+	memcpy(p->data + p->len, body, len);
+	p->len += len;
+}
+
+static void
+put_define(struct packet *p, uint64_t key, uint8_t type, const char *name)
+{
+	uint8_t body[128];
+	size_t len = put_varint(body, key);
+
+	body[len++] = type;
+	memcpy(body + len, name, strlen(name));
+	put_record(p, BRUBECK_BINARY_DEFINE, body, len + strlen(name));
+}
+
+static void
+put_values(struct packet *p, uint64_t key, const int64_t *values, size_t count)
+{
+	uint8_t body[128];
+	size_t i, len = put_varint(body, key);
+
+	for (i = 0; i < count; ++i)
+		len += put_varint(body + len, ((uint64_t)values[i] << 1) ^ (uint64_t)(values[i] >> 63));
+	put_record(p, BRUBECK_BINARY_VALUES, body, len);
+}
+
+static void
+put_double(struct packet *p, uint64_t key, double value)
+{
+	uint8_t body[16];
+	size_t len = put_varint(body, key);
+	uint64_t v;
+
+	memcpy(&v, &value, sizeof(v));
+	v = htole64(v);
+	memcpy(body + len, &v, sizeof(v));
+	put_record(p, BRUBECK_BINARY_DOUBLES, body, len + sizeof(v));
+}
+
+static struct brubeck_server server;
+static struct brubeck_backend backend;
+static struct brubeck_binary binary;
+
+static void
+binary_init(uint32_t max_keys)
+{
+	unsigned int i;
+
+	memset(&server, 0x0, sizeof(server));
+	memset(&backend, 0x0, sizeof(backend));
+	brubeck_slab_init(&server.slab);
+	brubeck_flows_init(&server.flows, 1);
+	pthread_rwlock_init(&server.shard_lock, NULL);
+	server.metrics = brubeck_hashtable_new(1 << 10);
+	server.backends[0] = &backend;
+	server.active_backends = 1;
+	backend.server = &server;
+
+	/* a single probe window, so senders evict each other */
+	memset(&binary, 0x0, sizeof(binary));
+	binary.sampler.server = &server;
+	binary.sender_count = BRUBECK_BINARY_PROBE;
+	binary.senders = xcalloc(binary.sender_count, sizeof(struct brubeck_binary_sender));
+	for (i = 0; i < binary.sender_count; ++i)
+		pthread_spin_init(&binary.senders[i].lock, PTHREAD_PROCESS_PRIVATE);
+	binary.max_keys = max_keys;
+	pthread_mutex_init(&binary.claim_lock, NULL);
+
+	brubeck_clock_now = 1000;
+}
+
+static void
+parse(const struct packet *p)
+{
+	brubeck_binary_packet_parse(&binary, p->data, p->len);
+}
+
+static struct brubeck_metric *
+find(const char *key)
+{
+	return brubeck_hashtable_find(server.metrics, key, (uint16_t)strlen(key));
+}
+
+void test_binary__records(void)
+{
+	static const int64_t values[] = { 3, -1, 300 };
+	static const uint8_t unknown[] = { 1, 2, 3 };
+	struct brubeck_metric *requests, *load, *wide;
+	struct packet p;
+
+	binary_init(128);
+
+	packet_init(&p, 42);
+	put_define(&p, 0, BRUBECK_MT_METER, "binary.requests");
+	put_define(&p, 1, BRUBECK_MT_GAUGE, "binary.load");
+	put_values(&p, 0, values, 3);
+	put_record(&p, 0x7f, unknown, sizeof(unknown));
+	put_double(&p, 1, 0.5);
+	parse(&p);
+
+	requests = find("binary.requests");
+	load = find("binary.load");
+
+	sput_fail_unless(requests && requests->as.meter.value == 302.0,
+		"zigzag varint values are recorded");
+	sput_fail_unless(load && load->as.gauge.value == 0.5,
+		"doubles are recorded past unknown opcodes");
+	sput_fail_unless(server.internal_stats.live.errors == 0 &&
+		server.internal_stats.live.metrics == 4, "every value is counted");
+
+	/* definitions outlive the packet, and dictionaries grow */
+	packet_init(&p, 42);
+	put_define(&p, 100, BRUBECK_MT_METER, "binary.wide");
+	put_values(&p, 100, values, 1);
+	put_values(&p, 0, values, 1);
+	parse(&p);
+
+	wide = find("binary.wide");
+	sput_fail_unless(wide && wide->as.meter.value == 3.0 && requests->as.meter.value == 305.0 &&
+		server.internal_stats.live.errors == 0, "dictionaries grow up to max_keys");
+
+	packet_init(&p, 42);
+	put_define(&p, 128, BRUBECK_MT_METER, "binary.too_far");
+	put_values(&p, 7, values, 1);
+	parse(&p);
+
+	sput_fail_unless(find("binary.too_far") == NULL && server.internal_stats.live.errors == 2,
+		"ids past max_keys and undefined ids are rejected");
+}
+
+void test_binary__malformed(void)
+{
+	static const int64_t values[] = { 1 };
+	static const uint8_t bad_varint[] = { 0, 0x80 };
+	static const uint8_t short_double[] = { 1, 0, 0, 0, 0 };
+	struct brubeck_metric *requests;
+	struct packet p;
+
+	binary_init(128);
+
+	packet_init(&p, 42);
+	put_define(&p, 0, BRUBECK_MT_METER, "malformed.requests");
+	put_define(&p, 1, BRUBECK_MT_GAUGE, "malformed.load");
+	put_define(&p, 2, BRUBECK_MT_METER, "malformed.trailing.");
+	put_record(&p, BRUBECK_BINARY_VALUES, bad_varint, sizeof(bad_varint));
+	put_record(&p, BRUBECK_BINARY_DOUBLES, short_double, sizeof(short_double));
+	parse(&p);
+
+	requests = find("malformed.requests");
+	sput_fail_unless(requests && find("malformed.trailing.") == NULL &&
+		server.internal_stats.live.errors == 3, "bad records are skipped");
+
+	/* the body is longer than what's left of the packet */
+	packet_init(&p, 42);
+	put_values(&p, 0, values, 1);
+	p.data[p.len++] = BRUBECK_BINARY_VALUES;
+	p.data[p.len++] = 16;
+	p.data[p.len++] = 0;
+	parse(&p);
+
+	sput_fail_unless(requests->as.meter.value == 1.0 && server.internal_stats.live.errors == 4,
+		"truncated bodies end the packet");
+
+	packet_init(&p, 42);
+	put_values(&p, 0, values, 1);
+	p.data[p.len++] = BRUBECK_BINARY_VALUES;
+	p.data[p.len++] = 0x80;
+	parse(&p);
+
+	sput_fail_unless(requests->as.meter.value == 2.0 && server.internal_stats.live.errors == 5,
+		"truncated lengths end the packet");
+
+	packet_init(&p, 42);
+	p.data[2] = BRUBECK_BINARY_VERSION + 1;
+	put_values(&p, 0, values, 1);
+	parse(&p);
+
+	packet_init(&p, 0);
+	put_values(&p, 0, values, 1);
+	parse(&p);
+
+	sput_fail_unless(requests->as.meter.value == 2.0 && server.internal_stats.live.errors == 7,
+		"bad headers and sender ids are rejected");
+}
+
+void test_binary__eviction(void)
+{
+	static const int64_t values[] = { 1 };
+	struct brubeck_metric *requests;
+	struct packet p;
+	uint64_t id;
+	unsigned int i;
+
+	binary_init(128);
+
+	packet_init(&p, 1);
+	put_define(&p, 0, BRUBECK_MT_METER, "evicted.requests");
+	parse(&p);
+
+	/* the first sender has been idle for the longest */
+	for (i = 0; i < binary.sender_count; ++i) {
+		if (binary.senders[i].id == 1)
+			binary.senders[i].last_seen = 0;
+	}
+
+	for (id = 2; id <= BRUBECK_BINARY_PROBE + 1; ++id) {
+		packet_init(&p, id);
+		parse(&p);
+	}
+
+	for (i = 0; i < binary.sender_count && binary.senders[i].id != 1; ++i)
+		;
+	sput_fail_unless(i == binary.sender_count, "the idlest sender is evicted");
+
+	/* its slot has been taken, and the dictionary with it */
+	packet_init(&p, BRUBECK_BINARY_PROBE + 1);
+	put_values(&p, 0, values, 1);
+	parse(&p);
+
+	packet_init(&p, 1);
+	put_values(&p, 0, values, 1);
+	parse(&p);
+
+	requests = find("evicted.requests");
+	sput_fail_unless(requests && requests->as.meter.value == 0.0 &&
+		server.internal_stats.live.errors == 2, "evicted dictionaries are cleared");
+}
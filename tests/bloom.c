@@ -0,0 +1,61 @@
+#include "brubeck.h"
+#include "thread_helper.h"
+#include "sput.h"
+
+#define BLOOM_KEYS 4096
+
+struct bloom_test {
+	struct multibloom *bloom;
+	size_t fresh;
+};
+
+static void *thread_bloom(void *ptr)
+{
+	struct bloom_test *t = ptr;
+	uint32_t i;
+
+	/* every thread checks the same keys, like a burst of
+	 * replayed packets hitting all the workers at once */
+	for (i = 0; i < BLOOM_KEYS; ++i) {
+		uint32_t a = i * 2654435761u, b = (i * 40503u) | 1;
+
+		if (!multibloom_check(t->bloom, 0, a, b))
+			brubeck_atomic_inc(&t->fresh);
+	}
+
+	return NULL;
+}
+
+void test_bloom__concurrent_checks(void)
+{
+	struct bloom_test t;
+
+	t.bloom = multibloom_new(1, BLOOM_KEYS * 4, 0.0001);
+	t.fresh = 0;
+
+	spawn_threads(&thread_bloom, &t);
+	sput_fail_unless(t.fresh <= BLOOM_KEYS, "a key is only new to one thread");
+	sput_fail_unless(t.fresh >= BLOOM_KEYS - 4, "new keys are not reported as replays");
+}
+
+void test_bloom__reset(void)
+{
+	struct multibloom *bloom = multibloom_new(2, BLOOM_KEYS, 0.001);
+	uint32_t i, replays = 0, fresh = 0;
+
+	for (i = 0; i < BLOOM_KEYS; ++i)
+		multibloom_check(bloom, 0, i * 2654435761u, (i * 40503u) | 1);
+
+	multibloom_reset(bloom, 0);
+
+	for (i = 0; i < BLOOM_KEYS; ++i) {
+		if (!multibloom_check(bloom, 0, i * 2654435761u, (i * 40503u) | 1))
+			fresh++;
+		if (multibloom_check(bloom, 0, i * 2654435761u, (i * 40503u) | 1))
+			replays++;
+	}
+
+	sput_fail_unless(fresh >= BLOOM_KEYS - 16, "keys are new again after a reset");
+	sput_fail_unless(replays == BLOOM_KEYS, "keys are replays once checked");
+	sput_fail_unless(!multibloom_check(bloom, 1, 12345, 67891), "other filters are not affected");
+}
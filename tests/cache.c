@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "sput.h"
+#include "brubeck.h"
+
+static char *cache_tmpfile(void)
+{
+	static char path[64];
+	int fd;
+
+	strcpy(path, "/tmp/brubeck_cache.XXXXXX");
+	fd = mkstemp(path);
+	close(fd);
+	return path;
+}
+
+static void
+cache_server(struct brubeck_server *server, struct brubeck_backend *backend, const char *path)
+{
+	memset(server, 0x0, sizeof(*server));
+	memset(backend, 0x0, sizeof(*backend));
+	brubeck_slab_init(&server->slab);
+	brubeck_flows_init(&server->flows, 1);
+	pthread_rwlock_init(&server->shard_lock, NULL);
+	server->metrics = brubeck_hashtable_new(1 << 10);
+	server->backends[0] = backend;
+	server->active_backends = 1;
+	server->cache_path = path;
+	backend->server = server;
+}
+
+/* straight into the table, the way the samplers would leave them */
+static struct brubeck_metric *
+add_metric(struct brubeck_server *server, const char *key, size_t key_len, uint8_t type)
+{
+	struct brubeck_metric *metric = xmalloc(BRUBECK_METRIC_SIZE(key_len));
+
+	brubeck_metric_init(server, metric, key, key_len, type);
+	brubeck_hashtable_insert(server->metrics, metric->key, metric->key_len, metric);
+	return metric;
+}
+
+static struct brubeck_metric *
+find(struct brubeck_server *server, const char *key)
+{
+	return brubeck_hashtable_find(server->metrics, key, (uint16_t)strlen(key));
+}
+
+static size_t
+cache_reload(const char *path)
+{
+	struct brubeck_server server;
+	struct brubeck_backend backend;
+
+	cache_server(&server, &backend, path);
+	brubeck_cache_load(&server);
+	return brubeck_hashtable_size(server.metrics);
+}
+
+void test_cache__round_trip(void)
+{
+	static const char tagged[] = "cache.tagged\0\1\0\0\0\2\0\0\0";
+	struct brubeck_server saved, loaded;
+	struct brubeck_backend saved_backend, loaded_backend;
+	struct brubeck_metric *gauge, *counter, *meter, *alias;
+	char *path = cache_tmpfile();
+
+	cache_server(&saved, &saved_backend, path);
+
+	gauge = add_metric(&saved, "cache.gauge", 11, BRUBECK_MT_GAUGE);
+	gauge->as.gauge.value = 12.5;
+	counter = add_metric(&saved, "cache.counter", 13, BRUBECK_MT_COUNTER);
+	counter->as.counter.value = 7.0;
+	counter->as.counter.previous = 40.0;
+	meter = add_metric(&saved, "cache.meter", 11, BRUBECK_MT_METER);
+	meter->as.meter.value = 3.0;
+	add_metric(&saved, "cache.denied.gauge", 18, BRUBECK_MT_GAUGE);
+	add_metric(&saved, tagged, sizeof(tagged) - 1, BRUBECK_MT_GAUGE);
+
+	alias = add_metric(&saved, "cache.alias", 11, BRUBECK_MT_GAUGE);
+	alias->flags |= (BRUBECK_METRIC_DROPPED | BRUBECK_METRIC_ALIAS);
+	alias->aggregates = xcalloc(2, sizeof(struct brubeck_metric *));
+	alias->aggregates[0] = gauge;
+
+	brubeck_cache_save(&saved);
+
+	cache_server(&loaded, &loaded_backend, path);
+	loaded.filter = brubeck_filter_new(json_loads(
+		"{\"deny\": [\"cache.denied.\"]}", 0, NULL));
+	brubeck_cache_load(&loaded);
+
+	gauge = find(&loaded, "cache.gauge");
+	counter = find(&loaded, "cache.counter");
+	meter = find(&loaded, "cache.meter");
+
+	sput_fail_unless(gauge && gauge->type == BRUBECK_MT_GAUGE && gauge->as.gauge.value == 12.5,
+		"gauges are restored");
+	sput_fail_unless(counter && counter->as.counter.value == 7.0 &&
+		counter->as.counter.previous == 40.0, "counters are restored with their previous value");
+	sput_fail_unless(meter && meter->as.meter.value == 3.0, "meters are restored");
+	sput_fail_unless(brubeck_hashtable_size(loaded.metrics) == 3 &&
+		find(&loaded, "cache.alias") == NULL &&
+		brubeck_hashtable_find(loaded.metrics, tagged, sizeof(tagged) - 1) == NULL,
+		"tagged series, aliases and filtered keys are not restored");
+	sput_fail_unless(loaded_backend.queue != NULL, "restored metrics are registered");
+
+	unlink(path);
+}
+
+void test_cache__corrupted(void)
+{
+	/* the header is 32 bytes, and the type follows value, previous and key_len */
+	static const off_t type_offset = 32 + 2 * sizeof(value_t) + sizeof(uint16_t);
+	static const uint8_t bad_type = 0xff;
+	struct brubeck_server saved;
+	struct brubeck_backend backend;
+	char *path = cache_tmpfile();
+	struct stat st;
+	int fd;
+
+	cache_server(&saved, &backend, path);
+	add_metric(&saved, "corrupted.gauge", 15, BRUBECK_MT_GAUGE);
+	add_metric(&saved, "corrupted.meter", 15, BRUBECK_MT_METER);
+
+	brubeck_cache_save(&saved);
+	sput_fail_unless(cache_reload(path) == 2, "good snapshots are loaded");
+
+	fd = open(path, O_WRONLY);
+	sput_fail_unless(pwrite(fd, &bad_type, 1, type_offset) == 1 &&
+		cache_reload(path) == 0, "corrupted records are rejected");
+	close(fd);
+
+	brubeck_cache_save(&saved);
+	sput_fail_unless(stat(path, &st) == 0 && truncate(path, st.st_size - 8) == 0 &&
+		cache_reload(path) == 0, "truncated snapshots are rejected");
+
+	sput_fail_unless(truncate(path, 16) == 0 && cache_reload(path) == 0,
+		"truncated headers are rejected");
+
+	unlink(path);
+}
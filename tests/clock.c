@@ -0,0 +1,13 @@
+#include "brubeck.h"
+#include "sput.h"
+
+void test_clock__coarse_time(void)
+{
+	time_t before = time(NULL), now;
+
+	brubeck_clock_init();
+	now = brubeck_now();
+
+	sput_fail_unless(now >= before && now <= time(NULL),
+		"the clock is set as soon as it's initialized");
+}
@@ -0,0 +1,137 @@
+#include "brubeck.h"
+#include "sput.h"
+
+static int
+apply(const struct brubeck_filter *filter, const char *key, const char **renamed)
+{
+	static char out[BRUBECK_FILTER_KEY_MAX];
+	size_t len;
+	int verdict;
+
+	verdict = brubeck_filter_apply(filter, out, sizeof(out), &len, key, strlen(key));
+	*renamed = (verdict == BRUBECK_FILTER_RENAME) ? out : key;
+	return verdict;
+}
+
+void test_filter__prefixes(void)
+{
+	struct brubeck_filter *filter;
+	const char *key;
+
+	filter = brubeck_filter_new(json_loads(
+		"{\"allow\": [\"app.\", \"sys.\"], \"deny\": [\"app.debug.\", \"sys.\"]}", 0, NULL));
+
+	sput_fail_unless(apply(filter, "app.requests", &key) == BRUBECK_FILTER_ALLOW,
+		"keys with an allowed prefix are allowed");
+	sput_fail_unless(apply(filter, "app.debug.requests", &key) == BRUBECK_FILTER_DENY,
+		"the longest prefix decides");
+	sput_fail_unless(apply(filter, "sys.load", &key) == BRUBECK_FILTER_DENY,
+		"deny wins over allow");
+	sput_fail_unless(apply(filter, "junk", &key) == BRUBECK_FILTER_DENY &&
+		apply(filter, "app", &key) == BRUBECK_FILTER_DENY,
+		"keys with no allowed prefix are denied");
+}
+
+void test_filter__renames(void)
+{
+	struct brubeck_filter *filter;
+	const char *key;
+
+	filter = brubeck_filter_new(json_loads(
+		"{\"deny\": [\"tmp.\"], \"sanitize\": true, \"rename\": ["
+		"  {\"match\": \"^hosts\\\\.([^.]+)\\\\.(.*)$\", \"replace\": \"\\\\2.\\\\1\"}]}",
+		0, NULL));
+
+	sput_fail_unless(apply(filter, "app.requests", &key) == BRUBECK_FILTER_ALLOW,
+		"keys with no deny prefix are allowed");
+	sput_fail_unless(apply(filter, "tmp.requests", &key) == BRUBECK_FILTER_DENY,
+		"denied keys are not renamed");
+	sput_fail_unless(apply(filter, "hosts.web1.requests", &key) == BRUBECK_FILTER_RENAME &&
+		!strcmp(key, "requests.web1"), "captures are substituted");
+	sput_fail_unless(apply(filter, "app.re/qu ests", &key) == BRUBECK_FILTER_RENAME &&
+		!strcmp(key, "app.re_qu_ests"), "keys are sanitized");
+
+	{
+		/* a tagged series: its name, a NUL byte and the tag ids */
+		static const char tagged[] = "hosts.web1.requests\0\1\0\0\0\2\0\0\0";
+		static const char renamed[] = "requests.web1\0\1\0\0\0\2\0\0\0";
+		char out[BRUBECK_FILTER_KEY_MAX], big[BRUBECK_FILTER_KEY_MAX + 16];
+		size_t len;
+
+		sput_fail_unless(brubeck_filter_apply(filter, out, sizeof(out), &len,
+				tagged, sizeof(tagged) - 1) == BRUBECK_FILTER_RENAME &&
+			len == sizeof(renamed) - 1 && !memcmp(out, renamed, len),
+			"tagged series are renamed and keep their tags");
+
+		memset(big, 'a', sizeof(big) - 1);
+		big[sizeof(big) - 1] = '\0';
+
+		sput_fail_unless(brubeck_filter_apply(filter, out, sizeof(out), &len,
+				big, sizeof(big) - 1) == BRUBECK_FILTER_DENY,
+			"keys too long to be rewritten are denied");
+	}
+}
+
+static int
+registered(struct brubeck_backend *backend, struct brubeck_metric *metric)
+{
+	struct brubeck_metric *mt;
+
+	for (mt = backend->queue; mt; mt = mt->next) {
+		if (mt == metric)
+			return 1;
+	}
+	return 0;
+}
+
+void test_filter__aliases(void)
+{
+	struct brubeck_server server;
+	struct brubeck_backend backend;
+	struct brubeck_metric *legacy, *old, *web1, *all, *dropped, *total;
+
+	memset(&server, 0x0, sizeof(server));
+	memset(&backend, 0x0, sizeof(backend));
+	brubeck_slab_init(&server.slab);
+	brubeck_flows_init(&server.flows, 1);
+	pthread_rwlock_init(&server.shard_lock, NULL);
+	server.metrics = brubeck_hashtable_new(1 << 10);
+	server.backends[0] = &backend;
+	server.active_backends = 1;
+	backend.server = &server;
+
+	server.filter = brubeck_filter_new(json_loads(
+		"{\"rename\": ["
+		"  {\"match\": \"^legacy\\\\.(.*)$\", \"replace\": \"app.\\\\1\"},"
+		"  {\"match\": \"^old\\\\.(.*)$\", \"replace\": \"new.\\\\1\"}]}",
+		0, NULL));
+	server.aggregation = brubeck_aggregation_new(json_loads(
+		"[{\"pattern\": \"app.<host>.latency\", \"target\": \"app.all.latency\"},"
+		" {\"pattern\": \"new.<host>.requests\", \"target\": \"new.all.requests\", \"drop\": true}]",
+		0, NULL));
+
+	legacy = brubeck_metric_find(&server, "legacy.web1.latency", 19, BRUBECK_MT_TIMER);
+	web1 = brubeck_hashtable_find(server.metrics, "app.web1.latency", 16);
+	all = brubeck_hashtable_find(server.metrics, "app.all.latency", 15);
+
+	sput_fail_unless(legacy && (legacy->flags & BRUBECK_METRIC_ALIAS) && web1 && all,
+		"renamed keys are aliases of their target");
+
+	brubeck_metric_record(legacy, 12.0, 1.0, 0);
+
+	sput_fail_unless(web1->as.histogram.size == 1 && all->as.histogram.size == 1,
+		"aliases feed the aggregates of their target");
+
+	old = brubeck_metric_find(&server, "old.web1.requests", 17, BRUBECK_MT_METER);
+	dropped = brubeck_hashtable_find(server.metrics, "new.web1.requests", 17);
+	total = brubeck_hashtable_find(server.metrics, "new.all.requests", 16);
+
+	sput_fail_unless(old && dropped && total &&
+		!registered(&backend, old) && !registered(&backend, dropped) &&
+		registered(&backend, total), "only the aggregate of a dropped target is sampled");
+
+	brubeck_metric_record(old, 3.0, 1.0, 0);
+
+	sput_fail_unless(dropped->as.meter.value == 0.0 && total->as.meter.value == 3.0,
+		"aliases of a dropped target still feed its aggregates");
+}
@@ -0,0 +1,80 @@
+#include "sput.h"
+#include "brubeck.h"
+
+#define FLOW_TEST_METRICS 5000
+#define FLOW_TEST_HEAVY 8
+#define FLOW_TEST_COUNT (20 * 2001) /* records of each heavy metric */
+
+static void check_heavy_hitters(int sample_rate, const char *msg)
+{
+	static struct brubeck_metric metrics[FLOW_TEST_METRICS];
+	struct brubeck_flows flows;
+	struct brubeck_flow_top top[FLOW_TEST_HEAVY];
+	size_t i, n, found = 0;
+	int round;
+
+	brubeck_flows_init(&flows, sample_rate);
+	brubeck_flow_local = NULL;
+
+	/* a long tail of metrics seen a few times each, and a handful
+	 * of noisy ones that account for most of the traffic */
+	for (round = 0; round < 20; ++round) {
+		for (i = 0; i < FLOW_TEST_METRICS; ++i)
+			brubeck_flow_record(&flows, &metrics[i]);
+
+		for (i = 0; i < FLOW_TEST_HEAVY * 2000; ++i)
+			brubeck_flow_record(&flows, &metrics[i % FLOW_TEST_HEAVY]);
+	}
+
+	n = brubeck_flows_top(&flows, top, FLOW_TEST_HEAVY);
+
+	for (i = 0; i < n; ++i) {
+		if (top[i].metric < metrics + FLOW_TEST_HEAVY)
+			found++;
+	}
+
+	sput_fail_unless(n == FLOW_TEST_HEAVY && found == FLOW_TEST_HEAVY, msg);
+
+	if (sample_rate == 1) {
+		sput_fail_unless(top[0].count - top[0].error <= FLOW_TEST_COUNT &&
+			top[0].count >= FLOW_TEST_COUNT, "exact count is within the error bound");
+	} else {
+		sput_fail_unless(top[0].count > FLOW_TEST_COUNT * 9 / 10 &&
+			top[0].count < FLOW_TEST_COUNT * 11 / 10, "sampled count is close to the real count");
+	}
+}
+
+void test_flow__heavy_hitters(void)
+{
+	check_heavy_hitters(1, "exact counting finds the heavy hitters");
+	check_heavy_hitters(16, "sampled counting finds the heavy hitters");
+}
+
+void test_flow__decay(void)
+{
+	static struct brubeck_metric metrics[2];
+	struct brubeck_flows flows;
+	struct brubeck_flow_top top[2];
+	size_t i, n;
+
+	brubeck_flows_init(&flows, 1);
+	brubeck_flow_local = NULL;
+
+	for (i = 0; i < 1000; ++i)
+		brubeck_flow_record(&flows, &metrics[0]);
+
+	for (i = 0; i < BRUBECK_FLOW_DECAY_INTERVAL; ++i)
+		brubeck_flows_tick(&flows);
+
+	/* the worker hasn't sampled since: readers decay for it */
+	n = brubeck_flows_top(&flows, top, 2);
+	sput_fail_unless(n == 1 && top[0].count == 500, "idle sketch is decayed on read");
+
+	for (i = 0; i < 600; ++i)
+		brubeck_flow_record(&flows, &metrics[1]);
+
+	n = brubeck_flows_top(&flows, top, 2);
+	sput_fail_unless(n == 2 && top[0].metric == &metrics[1] && top[0].count == 600,
+		"current traffic outranks decayed traffic");
+	sput_fail_unless(top[1].count == 500, "sketch is decayed once per epoch");
+}
@@ -1,13 +1,20 @@
 #include "sput.h"
 #include "brubeck.h"
 
-static void check_eq(float f, const char *str)
+static void check_eq(double f, const char *str)
 {
-	char buf[16];
-	brubeck_ftoa(buf, f);
+	char buf[BRUBECK_DTOA_SIZE];
+	brubeck_dtoa(buf, f);
 	sput_fail_unless(strcmp(str, buf) == 0, str);
 }
 
+static void check_roundtrip(double f)
+{
+	char buf[BRUBECK_DTOA_SIZE];
+	brubeck_dtoa(buf, f);
+	sput_fail_unless(strtod(buf, NULL) == f, buf);
+}
+
 void test_ftoa(void)
 {
 	check_eq(0.0, "0");
@@ -16,6 +23,18 @@ void test_ftoa(void)
 	check_eq(15.505, "15.505");
 	check_eq(0.125, "0.125");
 	check_eq(1234.567, "1234.567");
-	check_eq(99999.999, "100000");
+	check_eq(99999.999, "99999.999");
 	check_eq(0.999, "0.999");
+	check_eq(-2.5, "-2.5");
+	check_eq(0.1, "0.1");
+	check_eq(1.0 / 3.0, "0.3333333333333333");
+	check_eq(123456789012.0, "123456789012");
+	check_eq(9007199254740993.0, "9007199254740992");
+	check_eq(1e22, "1e22");
+	check_eq(1.5e-7, "1.5e-7");
+
+	check_roundtrip(5e-324);
+	check_roundtrip(1.7976931348623157e308);
+	check_roundtrip(2.2250738585072014e-308);
+	check_roundtrip(0.30000000000000004);
 }
@@ -168,3 +168,34 @@ void test_histogram__capacity(void)
 	sput_fail_unless(sample.count == ((HISTO_CAP + 500) * 10), "sample.count");
 }
 
+
+void test_histogram__push_n(void)
+{
+	struct brubeck_histo h;
+	struct brubeck_histo_sample sample;
+	value_t values[1000];
+	size_t j;
+
+	memset(&h, 0x0, sizeof(h));
+
+	for (j = 0; j < 1000; ++j)
+		values[j] = (double)(j + 1);
+
+	brubeck_histo_push_n(&h, values, 3, 1.0);
+	brubeck_histo_push_n(&h, values + 3, 997, 2.0);
+
+	sput_fail_unless(h.size == 1000, "histogram size");
+	sput_fail_unless(h.count == 3 + 997 * 2, "histogram value count");
+
+	brubeck_histo_sample(&sample, &h);
+
+	sput_fail_unless(sample.min == 1.0, "sample.min");
+	sput_fail_unless(sample.max == 1000.0, "sample.max");
+	sput_fail_unless(sample.sum == 500500.0, "sample.sum");
+
+	for (j = 0; j < 70; ++j)
+		brubeck_histo_push_n(&h, values, 1000, 1.0);
+
+	sput_fail_unless(h.size == USHRT_MAX, "histogram size is capped");
+	sput_fail_unless(h.count == 70000, "histogram value count");
+}
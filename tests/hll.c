@@ -0,0 +1,71 @@
+#include <math.h>
+#include "brubeck.h"
+#include "sput.h"
+
+static void add_members(struct brubeck_hll *hll, size_t from, size_t to)
+{
+	char member[32];
+	size_t i;
+
+	for (i = from; i < to; ++i) {
+		int len = snprintf(member, sizeof(member), "member.%zu", i);
+		brubeck_hll_add(hll, brubeck_hll_hash(member, len));
+	}
+}
+
+static int within(double estimate, double expected, double error)
+{
+	return fabs(estimate - expected) <= expected * error;
+}
+
+void test_hll__estimate(void)
+{
+	struct brubeck_hll hll;
+
+	memset(&hll, 0x0, sizeof(hll));
+
+	add_members(&hll, 0, 100);
+	add_members(&hll, 0, 100);
+	sput_fail_unless(!hll.dense, "small sets stay sparse");
+	sput_fail_unless(within(brubeck_hll_estimate(&hll), 100, 0.02),
+		"100 distinct members (sparse)");
+
+	add_members(&hll, 100, 100000);
+	sput_fail_unless(hll.dense, "large sets are converted to dense registers");
+	sput_fail_unless(within(brubeck_hll_estimate(&hll), 100000, 0.03),
+		"100k distinct members (dense)");
+
+	brubeck_hll_reset(&hll);
+	sput_fail_unless(!hll.dense && brubeck_hll_estimate(&hll) == 0.0,
+		"reset set is empty");
+	brubeck_hll_reset(&hll);
+}
+
+void test_hll__merge(void)
+{
+	struct brubeck_hll a, b, c;
+
+	memset(&a, 0x0, sizeof(a));
+	memset(&b, 0x0, sizeof(b));
+	memset(&c, 0x0, sizeof(c));
+
+	add_members(&a, 0, 300);
+	add_members(&b, 200, 500);
+	brubeck_hll_merge(&a, &b);
+	sput_fail_unless(within(brubeck_hll_estimate(&a), 500, 0.02),
+		"sparse + sparse is the union");
+
+	add_members(&c, 0, 50000);
+	brubeck_hll_merge(&c, &a);
+	sput_fail_unless(within(brubeck_hll_estimate(&c), 50000, 0.03),
+		"dense + sparse is the union");
+
+	brubeck_hll_merge(&a, &c);
+	sput_fail_unless(a.dense, "sparse + dense becomes dense");
+	sput_fail_unless(brubeck_hll_estimate(&a) == brubeck_hll_estimate(&c),
+		"merge is commutative");
+
+	brubeck_hll_reset(&a);
+	brubeck_hll_reset(&b);
+	brubeck_hll_reset(&c);
+}
@@ -9,11 +9,39 @@ void test_histogram__large_range(void);
 void test_histogram__multisamples(void);
 void test_histogram__with_sample_rate(void);
 void test_histogram__capacity(void);
+void test_histogram__push_n(void);
 
 void test_mstore__save(void);
 void test_atomic_spinlocks(void);
 void test_ftoa(void);
 void test_statsd_msg__parse_strings(void);
+void test_statsd_msg__mixed_types(void);
+void test_binary__records(void);
+void test_binary__malformed(void);
+void test_binary__eviction(void);
+void test_spool__append_and_replay(void);
+void test_spool__evict_oldest(void);
+void test_spool__reopen_corrupted(void);
+void test_cache__round_trip(void);
+void test_cache__corrupted(void);
+void test_sharding__stability(void);
+void test_sharding__weights(void);
+void test_sharding__replicas(void);
+void test_flow__heavy_hitters(void);
+void test_flow__decay(void);
+void test_hll__estimate(void);
+void test_hll__merge(void);
+void test_tags__series(void);
+void test_bloom__concurrent_checks(void);
+void test_bloom__reset(void);
+void test_sha256__hmac(void);
+void test_clock__coarse_time(void);
+void test_rollup__merge_intervals(void);
+void test_aggregation__rules(void);
+void test_aggregation__records(void);
+void test_filter__prefixes(void);
+void test_filter__renames(void);
+void test_filter__aliases(void);
 
 int main(int argc, char *argv[])
 {
@@ -26,6 +54,7 @@ int main(int argc, char *argv[])
 	sput_run_test(test_histogram__multisamples);
 	sput_run_test(test_histogram__with_sample_rate);
 	sput_run_test(test_histogram__capacity);
+	sput_run_test(test_histogram__push_n);
 
 	sput_enter_suite("mstore: concurrency test for metrics hash table");
 	sput_run_test(test_mstore__save);
@@ -38,6 +67,59 @@ int main(int argc, char *argv[])
 
 	sput_enter_suite("statsd: packet parsing");
 	sput_run_test(test_statsd_msg__parse_strings);
+	sput_run_test(test_statsd_msg__mixed_types);
+
+	sput_enter_suite("binary: packet parsing");
+	sput_run_test(test_binary__records);
+	sput_run_test(test_binary__malformed);
+	sput_run_test(test_binary__eviction);
+
+	sput_enter_suite("spool: on-disk circular buffer");
+	sput_run_test(test_spool__append_and_replay);
+	sput_run_test(test_spool__evict_oldest);
+	sput_run_test(test_spool__reopen_corrupted);
+
+	sput_enter_suite("cache: metrics snapshot");
+	sput_run_test(test_cache__round_trip);
+	sput_run_test(test_cache__corrupted);
+
+	sput_enter_suite("sharding: consistent hashing across backends");
+	sput_run_test(test_sharding__stability);
+	sput_run_test(test_sharding__weights);
+	sput_run_test(test_sharding__replicas);
+
+	sput_enter_suite("flow: heavy hitter tracking");
+	sput_run_test(test_flow__heavy_hitters);
+	sput_run_test(test_flow__decay);
+
+	sput_enter_suite("hll: set cardinality estimation");
+	sput_run_test(test_hll__estimate);
+	sput_run_test(test_hll__merge);
+
+	sput_enter_suite("tags: interned tag dictionary");
+	sput_run_test(test_tags__series);
+
+	sput_enter_suite("bloom: replay filter");
+	sput_run_test(test_bloom__concurrent_checks);
+	sput_run_test(test_bloom__reset);
+
+	sput_enter_suite("sha256: HMAC verification for statsd-secure");
+	sput_run_test(test_sha256__hmac);
+
+	sput_enter_suite("clock: coarse wall clock");
+	sput_run_test(test_clock__coarse_time);
+
+	sput_enter_suite("rollup: multi-resolution flushes");
+	sput_run_test(test_rollup__merge_intervals);
+
+	sput_enter_suite("aggregation: ingest-time aggregates");
+	sput_run_test(test_aggregation__rules);
+	sput_run_test(test_aggregation__records);
+
+	sput_enter_suite("filter: key filtering and rewriting");
+	sput_run_test(test_filter__prefixes);
+	sput_run_test(test_filter__renames);
+	sput_run_test(test_filter__aliases);
 
 	sput_finish_testing();
 	return sput_get_return_value();
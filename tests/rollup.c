@@ -0,0 +1,91 @@
+#include "brubeck.h"
+#include "sput.h"
+
+/* a backend that keeps what it samples */
+struct test_backend {
+	struct brubeck_backend backend;
+	value_t values[16];
+	char keys[16][64];
+	size_t count;
+};
+
+static void sample_cb(const char *key, size_t key_len, value_t value, void *backend)
+{
+	struct test_backend *t = backend;
+
+	if (t->count < 16) {
+		snprintf(t->keys[t->count], sizeof(t->keys[0]), "%.*s", (int)key_len, key);
+		t->values[t->count++] = value;
+	}
+}
+
+static value_t sampled(struct test_backend *t, const char *key)
+{
+	size_t i;
+
+	for (i = 0; i < t->count; ++i) {
+		if (!strcmp(t->keys[i], key))
+			return t->values[i];
+	}
+	return -1.0;
+}
+
+static struct brubeck_metric *
+new_metric(struct brubeck_server *server, const char *key, uint8_t type)
+{
+	struct brubeck_metric *metric = xmalloc(BRUBECK_METRIC_SIZE(strlen(key)));
+	brubeck_metric_init(server, metric, key, strlen(key), type);
+	return metric;
+}
+
+void test_rollup__merge_intervals(void)
+{
+	struct brubeck_server server;
+	struct test_backend fine, coarse;
+	struct brubeck_metric *meter, *histo;
+	int i;
+
+	memset(&server, 0x0, sizeof(server));
+	memset(&fine, 0x0, sizeof(fine));
+	memset(&coarse, 0x0, sizeof(coarse));
+	brubeck_slab_init(&server.slab);
+
+	fine.backend.server = &server;
+	fine.backend.sample_freq = 10;
+	fine.backend.rollups[0] = &coarse.backend;
+	fine.backend.rollup_count = 1;
+
+	coarse.backend.server = &server;
+	coarse.backend.sample_freq = 60;
+	coarse.backend.parent = &fine.backend;
+
+	meter = new_metric(&server, "requests", BRUBECK_MT_METER);
+	histo = new_metric(&server, "latency", BRUBECK_MT_TIMER);
+
+	/* three intervals of the fine backend */
+	for (i = 1; i <= 3; ++i) {
+		brubeck_metric_record(meter, (value_t)i, 1.0, 0);
+		brubeck_metric_record(histo, (value_t)i, 1.0, 0);
+		brubeck_metric_record(histo, (value_t)(i * 10), 1.0, 0);
+
+		fine.count = 0;
+		brubeck_metric_sample(meter, &sample_cb, &fine);
+		brubeck_metric_sample(histo, &sample_cb, &fine);
+	}
+
+	sput_fail_unless(sampled(&fine, "requests") == 3.0 &&
+		sampled(&fine, "latency.max") == 30.0, "the backend only sees its own interval");
+
+	brubeck_metric_sample_rollup(meter, 0, &sample_cb, &coarse);
+	brubeck_metric_sample_rollup(histo, 0, &sample_cb, &coarse);
+
+	sput_fail_unless(sampled(&coarse, "requests") == 6.0, "meters are summed over the window");
+	sput_fail_unless(sampled(&coarse, "latency.count") == 6.0, "histogram counts are summed");
+	sput_fail_unless(sampled(&coarse, "latency.count_ps") == 0.1, "rates are per second of the window");
+	sput_fail_unless(sampled(&coarse, "latency.min") == 1.0 &&
+		sampled(&coarse, "latency.max") == 30.0, "histogram values are merged");
+
+	coarse.count = 0;
+	brubeck_metric_sample_rollup(meter, 0, &sample_cb, &coarse);
+	sput_fail_unless(sampled(&coarse, "requests") == 0.0, "sampling a rollup starts a new window");
+}
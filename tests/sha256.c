@@ -0,0 +1,108 @@
+#include "brubeck.h"
+#include "sput.h"
+
+static void tohex(const uint8_t *hmac, char *hex)
+{
+	static const char hex_str[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < BRUBECK_SHA256_SIZE; ++i) {
+		*hex++ = hex_str[hmac[i] >> 4];
+		*hex++ = hex_str[hmac[i] & 0xF];
+	}
+	*hex = 0;
+}
+
+static int check_rfc4231(void)
+{
+	static const struct {
+		uint8_t key_byte;
+		size_t key_len;
+		const char *key, *data, *expected;
+	} vectors[] = {
+		{ 0x0b, 20, NULL, "Hi There",
+			"b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7" },
+		{ 0, 4, "Jefe", "what do ya want for nothing?",
+			"5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843" },
+		{ 0xaa, 131, NULL, "Test Using Larger Than Block-Size Key - Hash Key First",
+			"60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54" },
+	};
+
+	struct brubeck_hmac_sha256 hmac;
+	uint8_t key[256], out[BRUBECK_SHA256_SIZE];
+	char hex[BRUBECK_SHA256_SIZE * 2 + 1];
+	size_t i;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+		if (vectors[i].key)
+			memcpy(key, vectors[i].key, vectors[i].key_len);
+		else
+			memset(key, vectors[i].key_byte, vectors[i].key_len);
+
+		brubeck_hmac_sha256_init(&hmac, key, vectors[i].key_len);
+		brubeck_hmac_sha256(&hmac, (const uint8_t *)vectors[i].data,
+			strlen(vectors[i].data), out);
+
+		tohex(out, hex);
+		if (strcmp(hex, vectors[i].expected) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* lengths around the padding boundaries, more than one group of lanes */
+static int check_batch(void)
+{
+	static const size_t lens[] = {
+		0, 1, 55, 56, 63, 64, 119, 120, 1000, 12, 44, 990, 8, 64, 128, 3, 77
+	};
+	enum { COUNT = sizeof(lens) / sizeof(lens[0]) };
+
+	struct brubeck_hmac_sha256 hmac;
+	uint8_t data[1024], out[COUNT][BRUBECK_SHA256_SIZE], one[BRUBECK_SHA256_SIZE];
+	const uint8_t *msgs[COUNT];
+	size_t i, count;
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = (uint8_t)(i * 31 + 7);
+
+	for (i = 0; i < COUNT; ++i)
+		msgs[i] = data + i;
+
+	brubeck_hmac_sha256_init(&hmac, "750c783e6ab0b503eaa86e310a5db738", 32);
+
+	for (count = 1; count <= COUNT; ++count) {
+		brubeck_hmac_sha256_batch(&hmac, msgs, lens, count, out);
+
+		for (i = 0; i < count; ++i) {
+			brubeck_hmac_sha256(&hmac, msgs[i], lens[i], one);
+			if (memcmp(one, out[i], sizeof(one)) != 0)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+void test_sha256__hmac(void)
+{
+	static const char *names[] = { "scalar", "avx2", "shani" };
+
+	enum brubeck_sha256_impl detected = brubeck_sha256_impl();
+	char desc[64];
+	int impl;
+
+	for (impl = BRUBECK_SHA256_SCALAR; impl <= BRUBECK_SHA256_SHANI; ++impl) {
+		if (!brubeck_sha256_select(impl))
+			continue;
+
+		snprintf(desc, sizeof(desc), "RFC 4231 test vectors (%s)", names[impl]);
+		sput_fail_unless(check_rfc4231(), desc);
+
+		snprintf(desc, sizeof(desc), "batches match single packets (%s)", names[impl]);
+		sput_fail_unless(check_batch(), desc);
+	}
+
+	brubeck_sha256_select(detected);
+}
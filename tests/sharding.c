@@ -0,0 +1,91 @@
+#include "sput.h"
+#include "brubeck.h"
+
+#define SHARD_TEST_KEYS 20000
+
+static const char *SHARD_KEYS[] = {
+	"carbon-a:2004", "carbon-b:2004", "carbon-c:2004",
+	"carbon-d:2004", "carbon-e:2004"
+};
+static const int SHARD_WEIGHTS[] = { 1, 1, 1, 1, 1 };
+
+static int lookup(struct brubeck_sharding *sharding, int i)
+{
+	char key[64];
+	uint8_t shard;
+	int len = sprintf(key, "github.test.metric.%d", i);
+
+	brubeck_sharding_lookup(sharding, key, len, &shard, 1);
+	return shard;
+}
+
+/* Adding a fifth shard must move roughly 1/5 of the keys,
+ * and only towards the new shard */
+static void check_stability(enum brubeck_shard_mode mode, const char *msg)
+{
+	struct brubeck_sharding before, after;
+	int i, moved = 0, misplaced = 0;
+
+	brubeck_sharding_init(&before, mode, 1, SHARD_KEYS, SHARD_WEIGHTS, 4);
+	brubeck_sharding_init(&after, mode, 1, SHARD_KEYS, SHARD_WEIGHTS, 5);
+
+	for (i = 0; i < SHARD_TEST_KEYS; ++i) {
+		int a = lookup(&before, i), b = lookup(&after, i);
+		if (a != b) {
+			moved++;
+			if (b != 4)
+				misplaced++;
+		}
+	}
+
+	sput_fail_unless(misplaced == 0, msg);
+	sput_fail_unless(moved > SHARD_TEST_KEYS / 8 && moved < SHARD_TEST_KEYS / 4, msg);
+}
+
+void test_sharding__stability(void)
+{
+	check_stability(BRUBECK_SHARD_RING, "ring: adding a shard moves ~1/N keys");
+	check_stability(BRUBECK_SHARD_JUMP, "jump: adding a shard moves ~1/N keys");
+}
+
+void test_sharding__weights(void)
+{
+	static const int weights[] = { 3, 1 };
+	struct brubeck_sharding sharding;
+	int i, counts[2] = {0, 0};
+
+	brubeck_sharding_init(&sharding, BRUBECK_SHARD_RING, 1, SHARD_KEYS, weights, 2);
+
+	for (i = 0; i < SHARD_TEST_KEYS; ++i)
+		counts[lookup(&sharding, i)]++;
+
+	sput_fail_unless(counts[0] > 2 * counts[1], "weighted shard takes more keys");
+}
+
+void test_sharding__replicas(void)
+{
+	enum brubeck_shard_mode modes[] = {
+		BRUBECK_SHARD_MODULO, BRUBECK_SHARD_RING, BRUBECK_SHARD_JUMP
+	};
+	size_t m;
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+		struct brubeck_sharding sharding;
+		int i, failed = 0;
+
+		brubeck_sharding_init(&sharding, modes[m], 3, SHARD_KEYS, SHARD_WEIGHTS, 5);
+
+		for (i = 0; i < 1000; ++i) {
+			char key[64];
+			uint8_t shards[BRUBECK_MAX_BACKENDS];
+			int n, len = sprintf(key, "github.test.metric.%d", i);
+
+			n = brubeck_sharding_lookup(&sharding, key, len, shards, BRUBECK_MAX_BACKENDS);
+			if (n != 3 || shards[0] == shards[1] ||
+				shards[0] == shards[2] || shards[1] == shards[2])
+				failed++;
+		}
+
+		sput_fail_unless(failed == 0, "replicas are on distinct shards");
+	}
+}
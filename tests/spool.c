@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sput.h"
+#include "brubeck.h"
+
+#define SPOOL_TEST_SIZE (sizeof(struct brubeck_spool_header) + 256)
+
+static char *spool_tmpfile(void)
+{
+	static char path[64];
+	int fd;
+
+	strcpy(path, "/tmp/brubeck_spool.XXXXXX");
+	fd = mkstemp(path);
+	close(fd);
+	return path;
+}
+
+void test_spool__append_and_replay(void)
+{
+	char *path = spool_tmpfile();
+	struct brubeck_spool *spool = brubeck_spool_open(path, SPOOL_TEST_SIZE);
+	char buf[64];
+	uint32_t len;
+
+	sput_fail_unless(brubeck_spool_empty(spool), "new spool is empty");
+
+	brubeck_spool_append(spool, "first", 5);
+	brubeck_spool_append(spool, "second", 6);
+
+	len = brubeck_spool_peek(spool, buf, sizeof(buf));
+	sput_fail_unless(len == 5 && !memcmp(buf, "first", 5), "oldest record first");
+	brubeck_spool_pop(spool);
+
+	len = brubeck_spool_peek(spool, buf, sizeof(buf));
+	sput_fail_unless(len == 6 && !memcmp(buf, "second", 6), "records in order");
+	brubeck_spool_pop(spool);
+
+	sput_fail_unless(brubeck_spool_empty(spool), "spool is empty after replay");
+	unlink(path);
+}
+
+void test_spool__evict_oldest(void)
+{
+	char *path = spool_tmpfile();
+	struct brubeck_spool *spool = brubeck_spool_open(path, SPOOL_TEST_SIZE);
+	char record[60], buf[64];
+	uint32_t len;
+	int i;
+
+	/* 20 records of 64 bytes each won't fit in 256 bytes; the
+	 * spool wraps around and keeps only the newest ones */
+	for (i = 0; i < 20; ++i) {
+		memset(record, 'a' + i, sizeof(record));
+		brubeck_spool_append(spool, record, sizeof(record));
+	}
+
+	sput_fail_unless(spool->header->records == 4, "spool keeps newest records");
+	sput_fail_unless(spool->evicted == 16, "oldest records are evicted");
+
+	for (i = 16; i < 20; ++i) {
+		len = brubeck_spool_peek(spool, buf, sizeof(buf));
+		sput_fail_unless(len == sizeof(record) && buf[0] == 'a' + i &&
+			buf[len - 1] == 'a' + i, "wrapped record is intact");
+		brubeck_spool_pop(spool);
+	}
+
+	sput_fail_unless(!brubeck_spool_append(spool, buf, 1024), "oversized record is rejected");
+	unlink(path);
+}
+
+void test_spool__reopen_corrupted(void)
+{
+	char *path = spool_tmpfile();
+	struct brubeck_spool *spool = brubeck_spool_open(path, SPOOL_TEST_SIZE);
+	uint32_t bogus = 1 << 30;
+	char buf[64];
+	int fd;
+
+	brubeck_spool_append(spool, "first", 5);
+	brubeck_spool_append(spool, "second", 6);
+	brubeck_spool_close(spool);
+
+	spool = brubeck_spool_open(path, SPOOL_TEST_SIZE);
+	sput_fail_unless(spool->header->records == 2 &&
+		brubeck_spool_peek(spool, buf, sizeof(buf)) == 5, "records survive a reopen");
+	brubeck_spool_close(spool);
+
+	/* the length of the second record is past what's been used */
+	fd = open(path, O_WRONLY);
+	pwrite(fd, &bogus, sizeof(bogus), sizeof(struct brubeck_spool_header) + 9);
+	close(fd);
+
+	spool = brubeck_spool_open(path, SPOOL_TEST_SIZE);
+	sput_fail_unless(brubeck_spool_empty(spool), "a corrupted spool is reset");
+	brubeck_spool_close(spool);
+	unlink(path);
+}
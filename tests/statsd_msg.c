@@ -11,11 +11,51 @@ static void must_parse(const char *msg_text, double value, double sample, uint8_
 	memcpy(buffer, msg_text, len);
 
 	sput_fail_unless(brubeck_statsd_msg_parse(&msg, buffer, buffer + len) == 0, msg_text);
-	sput_fail_unless(value == msg.value, "msg.value == expected");
+	sput_fail_unless(msg.value_count == 1, "msg.value_count == 1");
+	sput_fail_unless(value == msg.values[0], "msg.value == expected");
 	sput_fail_unless(sample == msg.sample_freq, "msg.sample_rate == expected");
 	sput_fail_unless(modifiers == msg.modifiers, "msg.modifiers == expected");
 }
 
+static void must_parse_values(const char *msg_text, const double *values, uint16_t count)
+{
+	struct brubeck_statsd_msg msg;
+	char buffer[128];
+	size_t len = strlen(msg_text);
+	memcpy(buffer, msg_text, len);
+
+	sput_fail_unless(brubeck_statsd_msg_parse(&msg, buffer, buffer + len) == 0, msg_text);
+	sput_fail_unless(msg.value_count == count, "msg.value_count == expected");
+	sput_fail_unless(memcmp(msg.values, values, count * sizeof(double)) == 0,
+		"msg.values == expected");
+}
+
+static void must_parse_tags(const char *msg_text, const char *tags, double sample)
+{
+	struct brubeck_statsd_msg msg;
+	char buffer[128];
+	size_t len = strlen(msg_text);
+	memcpy(buffer, msg_text, len);
+
+	sput_fail_unless(brubeck_statsd_msg_parse(&msg, buffer, buffer + len) == 0, msg_text);
+	sput_fail_unless(msg.tags_len == strlen(tags) &&
+		memcmp(msg.tags, tags, msg.tags_len) == 0, "msg.tags == expected");
+	sput_fail_unless(sample == msg.sample_freq, "msg.sample_rate == expected");
+}
+
+static void must_parse_set(const char *msg_text, const char *member)
+{
+	struct brubeck_statsd_msg msg;
+	char buffer[128];
+	size_t len = strlen(msg_text);
+	memcpy(buffer, msg_text, len);
+
+	sput_fail_unless(brubeck_statsd_msg_parse(&msg, buffer, buffer + len) == 0, msg_text);
+	sput_fail_unless(msg.type == BRUBECK_MT_SET, "msg.type == set");
+	sput_fail_unless(msg.member_len == strlen(member) &&
+		memcmp(msg.member, member, msg.member_len) == 0, "msg.member == expected");
+}
+
 static void must_not_parse(const char *msg_text)
 {
 	struct brubeck_statsd_msg msg;
@@ -48,6 +88,25 @@ void test_statsd_msg__parse_strings(void)
 	must_parse("this.are.some.floats:1234567.89|g", 1234567.89, 1.0, 0);
 	must_parse("gauge.increment:+1|g", 1, 1.0, BRUBECK_MOD_RELATIVE_VALUE);
 	must_parse("gauge.decrement:-1|g", -1, 1.0, BRUBECK_MOD_RELATIVE_VALUE);
+	must_parse_set("unique.users:765|s", "765");
+	must_parse_set("unique.users:jdoe@github.com|s", "jdoe@github.com");
+	must_parse_set("unique.users:-12.5e3|s", "-12.5e3");
+	must_parse_tags("tagged:1|c|#host:web1,role:app", "host:web1,role:app", 1.0);
+	must_parse_tags("tagged:1|c|@0.5|#host:web1", "host:web1", 2.0);
+	must_parse_tags("tagged:1|c|#url:http://github.com|@0.5", "url:http://github.com", 2.0);
+
+	{
+		static const double timings[] = {12, 9.5, 33};
+		static const double deltas[] = {-1, 2};
+		static const double errors[] = {1, -1};
+		static const double timer_deltas[] = {12, -3};
+
+		must_parse_values("response_time:12:9.5:33|ms", timings, 3);
+		must_parse_values("response_time:12:9.5:33|h|@0.5", timings, 3);
+		must_parse_values("gauge.delta:-1:+2|g", deltas, 2);
+		must_parse_values("errors:1:-1|c", errors, 2);
+		must_parse_values("delta:12:-3|ms", timer_deltas, 2);
+	}
 
 	must_not_parse("this.are.some.floats:12.89.23|g");
 	must_not_parse("this.are.some.floats:12.89|a");
@@ -70,4 +129,68 @@ void test_statsd_msg__parse_strings(void)
 	must_not_parse("this.are.some.floats:1.0|g|@-0.23");
 	must_not_parse("this.are.some.floats:1.0|g|@0.0");
 	must_not_parse("this.are.some.floats:1.0|g|@0");
+	must_not_parse("response_time:12::33|ms");
+	must_not_parse("response_time:12:|ms");
+	must_not_parse("response_time::12|ms");
+	must_not_parse("response_time:12:lol|ms");
+	must_not_parse("gauge.delta:5:+2|g");
+	must_not_parse("gauge.delta:-5:2|g");
+	must_not_parse("tagged:1|c|#host");
+	must_not_parse("tagged:1|c|#host:");
+	must_not_parse("tagged:1|c|#:web1");
+	must_not_parse("tagged:1|c|#host:web1,");
+	must_not_parse("tagged:1|c|#host=web1");
+	must_not_parse("tagged:1|c|#host:web;1");
+	must_not_parse("tagged:1|c|#host:web1|#role:app");
+	must_not_parse("tagged:1|c|#a:1,b:2,c:3,d:4,e:5,f:6,g:7,h:8,i:9,j:10,k:11,l:12,m:13,n:14,o:15,p:16,q:17");
+}
+
+static void
+parse_packet(struct brubeck_server *server, const char *packet)
+{
+	char buffer[128];
+	size_t len = strlen(packet);
+
+	memcpy(buffer, packet, len + 1);
+	brubeck_statsd_packet_parse(server, buffer, buffer + len);
+}
+
+/* keys keep the type of their first record, whatever comes after */
+void test_statsd_msg__mixed_types(void)
+{
+	struct brubeck_server server;
+	struct brubeck_backend backend;
+	struct brubeck_metric *meter, *timer, *set;
+
+	memset(&server, 0x0, sizeof(server));
+	memset(&backend, 0x0, sizeof(backend));
+	brubeck_slab_init(&server.slab);
+	brubeck_flows_init(&server.flows, 1);
+	pthread_rwlock_init(&server.shard_lock, NULL);
+	server.metrics = brubeck_hashtable_new(1 << 10);
+	server.backends[0] = &backend;
+	server.active_backends = 1;
+	backend.server = &server;
+
+	parse_packet(&server, "mixed.meter:1|c");
+	parse_packet(&server, "mixed.meter:bar|s");
+	meter = brubeck_hashtable_find(server.metrics, "mixed.meter", 11);
+
+	sput_fail_unless(meter && meter->type == BRUBECK_MT_METER && meter->as.meter.value == 1.0 &&
+		server.internal_stats.live.errors == 1, "set members are refused by meters");
+
+	parse_packet(&server, "mixed.timer:1|ms");
+	parse_packet(&server, "mixed.timer:bar|s");
+	timer = brubeck_hashtable_find(server.metrics, "mixed.timer", 11);
+
+	sput_fail_unless(timer && timer->type == BRUBECK_MT_TIMER && timer->as.histogram.size == 1 &&
+		server.internal_stats.live.errors == 2, "set members are refused by timers");
+
+	parse_packet(&server, "mixed.set:bar|s");
+	parse_packet(&server, "mixed.set:1|c");
+	set = brubeck_hashtable_find(server.metrics, "mixed.set", 9);
+
+	sput_fail_unless(set && set->type == BRUBECK_MT_SET &&
+		brubeck_hll_estimate(&set->as.set) > 1.5 &&
+		server.internal_stats.live.errors == 2, "numbers recorded into a set are members");
 }
@@ -0,0 +1,55 @@
+#include <string.h>
+
+#include "sput.h"
+#include "brubeck.h"
+
+static int series(brubeck_tags_t *tags, char *out, const char *name, const char *list)
+{
+	return brubeck_tags_series(tags, out, name, strlen(name), list, strlen(list));
+}
+
+static void must_render(brubeck_tags_t *tags, const char *name,
+	const char *list, const char *suffix, const char *expected)
+{
+	char key[256], rendered[256];
+	int len = series(tags, key, name, list);
+	uint8_t tag_count = (len - strlen(name) - 1) / sizeof(struct brubeck_tag);
+	size_t rlen = brubeck_tags_render(tags, rendered, sizeof(rendered),
+		key, len, tag_count, suffix);
+
+	sput_fail_unless(rlen == strlen(expected) &&
+		strcmp(rendered, expected) == 0, expected);
+}
+
+void test_tags__series(void)
+{
+	struct brubeck_slab slab;
+	brubeck_tags_t *tags;
+	char a[256], b[256], c[256];
+	int alen, blen, clen;
+
+	brubeck_slab_init(&slab);
+	tags = brubeck_tags_new(&slab);
+
+	alen = series(tags, a, "requests", "host:web1,role:app");
+	blen = series(tags, b, "requests", "role:app,host:web1");
+	sput_fail_unless(alen == blen && memcmp(a, b, alen) == 0,
+		"tag order doesn't change the series");
+	sput_fail_unless(alen == (int)(strlen("requests") + 1 + 2 * sizeof(struct brubeck_tag)),
+		"series key holds the name and two tag ids");
+
+	clen = series(tags, c, "requests", "host:web2,role:app");
+	sput_fail_unless(clen == alen && memcmp(a, c, alen) != 0,
+		"different tag values are different series");
+
+	clen = series(tags, c, "requests", "host:web2,role:app,host:web1");
+	sput_fail_unless(clen == alen && memcmp(a, c, alen) == 0,
+		"a repeated tag keeps its last value");
+
+	must_render(tags, "requests", "role:app,host:web1", "",
+		"requests;host=web1;role=app");
+	must_render(tags, "latency", "host:web1,role:app", ".percentile.99",
+		"latency.percentile.99;host=web1;role=app");
+	must_render(tags, "latency", "url:http://github.com", "",
+		"latency;url=http://github.com");
+}